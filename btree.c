@@ -1,40 +1,119 @@
 // btree.c
+#define _POSIX_C_SOURCE 200809L // fileno(), fsync(), mmap() and ftruncate()
+
 #include "btree.h"
+#include "extsort.h"
+#include "ingest.h"
+#include "keysearch.h"
+#include "wal.h"
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
-#define MAX_CACHED_NODES 3
+#define LOAD_FILL_FACTOR 0.9     // Leaf fill used when load_data() bulk-builds a tree
+#define MAP_MIN_BLOCKS 1024      // Smallest read-write mapping, grown by doubling
+#define OPTIMISTIC_RETRIES 8     // Optimistic descents before search_key() latches instead
+#define EXPORT_CHUNK 65536       // Initial export buffer, and the serial export's write size
+#define EXPORT_MAX_LINE 42       // Two 20-digit numbers, a comma and a newline
+#define EXPORT_TASKS_PER_THREAD 32 // Subtrees the parallel export aims to give each worker
+#define LOAD_BATCH 4096          // Pairs per batch in the load pipeline
+#define LOAD_QUEUE_DEPTH 4       // Batches that may wait between two load stages
+#define LOAD_PROGRESS_INTERVAL 1.0 // Seconds between load_progress calls
+#define WAL_SUFFIX "-wal"        // The redo log lives next to the index file
 
-typedef struct CacheNode
+/**
+ * Buffer pool
+ * -----------
+ * A fixed set of frames, each holding one raw block of up to frame_size bytes.
+ * Frames are found through a (tree, block_id) -> frame hash table, pinned
+ * while in use, and evicted with the CLOCK algorithm.
+ * write_node() only marks a frame dirty; dirty frames reach the file when
+ * they are evicted or when btree_sync()/close_btree() flushes the tree.
+ * Block 0 (the header) is never cached, so block_id 0 marks a free frame.
+ *
+ * Every handle is served by one pool: a private pool sized from
+ * BTree.cache_frames, or a pool made with create_buffer_pool() and shared by
+ * several handles. Each frame records the tree it belongs to, so handles on
+ * different files never see each other's blocks, and an eviction writes the
+ * victim back through its own tree's file.
+ *
+ * The pool mutex guards the table, the CLOCK state and every frame's
+ * metadata. A frame's contents are guarded by its latch instead, a
+ * reader/writer lock taken through page_get(). A miss publishes the frame
+ * and reads the block with the latch held exclusively and the mutex
+ * released, so other threads keep hitting the pool during the read and a
+ * thread that wants the same block waits on the latch until the data is in.
+ *
+ * Every exclusive latch also bumps the frame's version twice, once when it
+ * is taken and once when it is released, so optimistic readers can read a
+ * pinned frame without latching it and check the version afterwards.
+ *
+ * Under BTREE_DURABILITY_WAL a frame changed since the tree's last log
+ * commit is marked unlogged. It is neither evicted nor flushed until the
+ * commit has put its image in the log, so the file only ever receives
+ * committed blocks.
+ */
+typedef struct BufferFrame
 {
-    uint64_t block_id;
-    BTreeNode node;
-    int is_dirty; // 1 if node needs to be written back to disk
-} CacheNode;
+    BTree *owner;        // Tree the block belongs to (NULL if the frame is free)
+    uint64_t block_id;   // Block held by this frame (0 if the frame is free)
+    unsigned char *data; // Raw on-disk image of the block
+    int pin_count;       // Active users; pinned frames are never evicted
+    int is_dirty;        // 1 if the block must be written back before eviction
+    int referenced;      // CLOCK reference bit, set on every access
+    int hash_next;       // Next frame in the same hash bucket (-1 ends the chain)
+    int valid;           // 0 until the block has been read in (or overwritten)
+    pthread_rwlock_t latch; // Shared for readers, exclusive while the data changes
+    uint64_t version;    // Even while the data is stable, odd while it changes
+    int unlogged;        // 1 if changed since the owner's last log commit
+} BufferFrame;
 
-typedef struct NodeCache
+struct BufferPool
 {
-    CacheNode entries[MAX_CACHED_NODES];
-    int count;
-} NodeCache;
-
-static NodeCache node_cache = {{0}, 0};
+    BufferFrame *frames;
+    unsigned char *slab; // num_frames * frame_size bytes backing every frame
+    size_t frame_size;   // Largest block size the pool can hold
+    size_t num_frames;
+    size_t num_used;     // Frames [0, num_used) have been handed out at least once
+    int *buckets;        // Hash table heads, indexed by block_hash()
+    size_t bucket_mask;  // Number of buckets - 1 (a power of two)
+    size_t clock_hand;
+    uint64_t hits, misses, evictions, writebacks;
+    pthread_mutex_t lock; // Guards everything above except frame contents
+};
 
 // Forward declarations for internal functions
 static int is_leaf(BTreeNode *node);
-static int write_block(FILE *fp, uint64_t block_id, const void *buf);
-static int read_block(FILE *fp, uint64_t block_id, void *buf);
+static int write_block(BTree *tree, uint64_t block_id, const void *buf);
+static int read_block(BTree *tree, uint64_t block_id, void *buf);
 static int write_header(BTree *tree);
 static int read_header(BTree *tree);
 static int write_node(BTree *tree, BTreeNode *node);
 static int read_node(BTree *tree, uint64_t block_id, BTreeNode *node);
 static BTreeNode *create_node(BTree *tree);
-static int split_child(BTree *tree, BTreeNode *parent, int child_index);
+static uint64_t allocate_block(BTree *tree);
+static int release_block(BTree *tree, uint64_t block_id);
+static int free_block(BTree *tree, uint64_t block_id);
+static uint64_t compressed_min_keys(const BTree *tree);
+static int split_child(BTree *tree, BTreeNode *parent, int child_index, BTreeNode *child, BTreeNode *right);
 static int insert_nonfull(BTree *tree, BTreeNode *node, uint64_t key, uint64_t value);
-static void write_node_recursive(FILE *fp, BTree *tree, uint64_t block_id);
+static int put_unsynced(BTree *tree, uint64_t key, uint64_t value, int mode);
 static void print_node_recursive(BTree *tree, uint64_t block_id, int level);
 static void count_nodes_recursive(uint64_t block_id, int level, int *height, int *total_nodes, int *total_keys, BTree *tree);
+static int pool_flush(BufferPool *pool, BTree *owner);
+static int valid_block_size(uint64_t block_size);
+static int flush_tree(BTree *tree, int do_fsync);
+static void log_track(BTree *tree, BufferFrame *frame);
+static void log_track_retired(BTree *tree);
+static int log_commit(BTree *tree);
+static int log_commit_if_full(BTree *tree);
+static int commit_write(BTree *tree);
+static void log_rollback(BTree *tree);
 
 // Endianness conversion functions
 static uint64_t to_big_endian(uint64_t value)
@@ -55,539 +134,5521 @@ static uint64_t from_big_endian(uint64_t value)
 #endif
 }
 
-// Cache management functions
-static void init_node_cache()
+// 1 if node words of this format must be byte-swapped on this host
+static int format_swaps(uint64_t format_version)
 {
-    node_cache.count = 0;
-    for (int i = 0; i < MAX_CACHED_NODES; i++)
-    {
-        node_cache.entries[i].block_id = 0;
-        node_cache.entries[i].is_dirty = 0;
-    }
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return format_version == BTREE_FORMAT_V1;
+#else
+    return format_version != BTREE_FORMAT_V1;
+#endif
 }
 
-static void clear_node_cache(BTree *tree)
+static uint64_t swap_word(int swap, uint64_t value)
+{
+    return swap ? __builtin_bswap64(value) : value;
+}
+
+// Buffer pool management functions
+static size_t block_hash(const BufferPool *pool, const BTree *owner, uint64_t block_id)
 {
-    // Write any dirty nodes back to disk
-    for (int i = 0; i < node_cache.count; i++)
+    uint64_t h = (block_id ^ (uint64_t)(uintptr_t)owner) * 0x9E3779B97F4A7C15ULL;
+    return (size_t)(h >> 32) & pool->bucket_mask;
+}
+
+static void pool_destroy(BufferPool *pool)
+{
+    if (pool->frames)
     {
-        if (node_cache.entries[i].is_dirty)
+        for (size_t i = 0; i < pool->num_frames; i++)
         {
-            write_node(tree, &node_cache.entries[i].node);
-            node_cache.entries[i].is_dirty = 0;
+            pthread_rwlock_destroy(&pool->frames[i].latch);
         }
+        pthread_mutex_destroy(&pool->lock);
     }
-    // Reset cache
-    init_node_cache();
+    free(pool->frames);
+    free(pool->slab);
+    free(pool->buckets);
+    free(pool);
 }
 
-static BTreeNode *get_cached_node(uint64_t block_id)
+static BufferPool *pool_create(size_t num_frames, size_t frame_size)
 {
-    for (int i = 0; i < node_cache.count; i++)
+    BufferPool *pool = (BufferPool *)calloc(1, sizeof(BufferPool));
+    if (!pool)
+        return NULL;
+
+    if (num_frames == 0)
+        num_frames = BTREE_DEFAULT_CACHE_FRAMES;
+    if (num_frames < BTREE_MIN_CACHE_FRAMES)
+        num_frames = BTREE_MIN_CACHE_FRAMES;
+
+    size_t num_buckets = 1;
+    while (num_buckets < num_frames * 2)
+        num_buckets <<= 1;
+
+    pool->frames = (BufferFrame *)calloc(num_frames, sizeof(BufferFrame));
+    pool->slab = (unsigned char *)malloc(num_frames * frame_size);
+    pool->buckets = (int *)malloc(num_buckets * sizeof(int));
+    if (!pool->frames || !pool->slab || !pool->buckets)
     {
-        if (node_cache.entries[i].block_id == block_id)
-        {
-            return &node_cache.entries[i].node;
-        }
+        free(pool->frames);
+        free(pool->slab);
+        free(pool->buckets);
+        free(pool);
+        return NULL;
     }
-    return NULL;
+
+    for (size_t i = 0; i < num_frames; i++)
+    {
+        pool->frames[i].data = pool->slab + i * frame_size;
+        pool->frames[i].hash_next = -1;
+        pthread_rwlock_init(&pool->frames[i].latch, NULL);
+    }
+    for (size_t i = 0; i < num_buckets; i++)
+    {
+        pool->buckets[i] = -1;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+
+    pool->num_frames = num_frames;
+    pool->frame_size = frame_size;
+    pool->bucket_mask = num_buckets - 1;
+    return pool;
 }
 
-// Helper function to check if node is a leaf
-static int is_leaf(BTreeNode *node)
+BufferPool *create_buffer_pool(size_t num_frames, size_t frame_size)
 {
-    return node->children[0] == 0;
+    if (!valid_block_size(frame_size))
+        return NULL;
+    return pool_create(num_frames, frame_size);
 }
 
-// Create a new node
-static BTreeNode *create_node(BTree *tree)
+void destroy_buffer_pool(BufferPool *pool)
 {
-    BTreeNode *node = (BTreeNode *)calloc(1, sizeof(BTreeNode));
-    if (!node)
-        return NULL;
+    if (pool)
+        pool_destroy(pool);
+}
 
-    node->block_id = tree->header.next_block_id++;
-    write_header(tree);
+// Find a tree's block in the pool; the caller holds the pool mutex
+static BufferFrame *pool_lookup(BufferPool *pool, const BTree *owner, uint64_t block_id)
+{
+    for (int i = pool->buckets[block_hash(pool, owner, block_id)]; i != -1; i = pool->frames[i].hash_next)
+    {
+        if (pool->frames[i].block_id == block_id && pool->frames[i].owner == owner)
+        {
+            return &pool->frames[i];
+        }
+    }
+    return NULL;
+}
 
-    return node;
+static void pool_unlink(BufferPool *pool, BufferFrame *frame)
+{
+    int index = (int)(frame - pool->frames);
+    int *link = &pool->buckets[block_hash(pool, frame->owner, frame->block_id)];
+    while (*link != -1)
+    {
+        if (*link == index)
+        {
+            *link = frame->hash_next;
+            break;
+        }
+        link = &pool->frames[*link].hash_next;
+    }
+    frame->hash_next = -1;
+    frame->block_id = 0;
+    frame->owner = NULL;
 }
 
-// Split child node when full
-static int split_child(BTree *tree, BTreeNode *parent, int child_index)
+// Write a dirty frame back to its block; the caller holds the pool mutex
+static int pool_write_back(BufferPool *pool, BufferFrame *frame)
 {
-    BTreeNode child = {0}, new_node = {0};
-    read_node(tree, parent->children[child_index], &child);
+    if (write_block(frame->owner, frame->block_id, frame->data) != 0)
+    {
+        return -1;
+    }
+    frame->is_dirty = 0;
+    pool->writebacks++;
+    return 0;
+}
 
-    new_node.block_id = tree->header.next_block_id++;
-    new_node.parent_block_id = parent->block_id;
-    new_node.num_keys = MAX_KEYS / 2;
+// Pick a frame for a new block, evicting with CLOCK when the pool is full.
+// An unpinned frame has no latch holders, so it can be written back as is.
+static BufferFrame *pool_victim(BufferPool *pool)
+{
+    if (pool->num_used < pool->num_frames)
+    {
+        return &pool->frames[pool->num_used++];
+    }
 
-    // Copy second half of child's keys and values to new node
-    for (int i = 0; i < MAX_KEYS / 2; i++)
+    // Two sweeps clear every reference bit, so a third finds any unpinned frame
+    for (size_t scanned = 0; scanned < 3 * pool->num_frames; scanned++)
     {
-        new_node.keys[i] = child.keys[i + MAX_KEYS / 2 + 1];
-        new_node.values[i] = child.values[i + MAX_KEYS / 2 + 1];
-        child.keys[i + MAX_KEYS / 2 + 1] = 0;
-        child.values[i + MAX_KEYS / 2 + 1] = 0;
+        BufferFrame *frame = &pool->frames[pool->clock_hand];
+        pool->clock_hand = (pool->clock_hand + 1) % pool->num_frames;
+
+        if (frame->pin_count > 0 || frame->unlogged)
+            continue;
+        if (frame->block_id == 0)
+            return frame; // Released when its tree was closed
+        if (frame->referenced)
+        {
+            frame->referenced = 0;
+            continue;
+        }
+
+        if (frame->is_dirty && pool_write_back(pool, frame) != 0)
+        {
+            return NULL;
+        }
+        pool_unlink(pool, frame);
+        pool->evictions++;
+        return frame;
     }
 
-    // If not leaf, copy relevant children
-    if (!is_leaf(&child))
+    return NULL; // Every frame is pinned
+}
+
+/**
+ * Pin the frame holding block_id of `owner`, bringing it in from disk on a
+ * miss. When load is 0 the caller is about to overwrite the whole block, so
+ * a miss skips the read, and the frame comes back latched exclusively, hit
+ * or miss, so no reader sees it before it is filled. Returns NULL if no
+ * frame can be freed or the read fails.
+ */
+static BufferFrame *pool_fetch(BufferPool *pool, BTree *owner, uint64_t block_id, int load)
+{
+    pthread_mutex_lock(&pool->lock);
+    BufferFrame *frame = pool_lookup(pool, owner, block_id);
+    if (frame)
     {
-        for (int i = 0; i <= MAX_KEYS / 2; i++)
+        pool->hits++;
+        frame->pin_count++;
+        frame->referenced = 1;
+        pthread_mutex_unlock(&pool->lock);
+        if (!load)
         {
-            new_node.children[i] = child.children[i + MAX_KEYS / 2 + 1];
-            child.children[i + MAX_KEYS / 2 + 1] = 0;
+            pthread_rwlock_wrlock(&frame->latch);
+            __atomic_store_n(&frame->version, frame->version + 1, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_RELEASE);
         }
+        return frame;
+    }
+
+    pool->misses++;
+    frame = pool_victim(pool);
+    if (!frame)
+    {
+        pthread_mutex_unlock(&pool->lock);
+        return NULL;
     }
 
-    child.num_keys = MAX_KEYS / 2;
+    // A free frame has no latch holders, so this always succeeds at once
+    pthread_rwlock_trywrlock(&frame->latch);
 
-    // Move parent's keys and children to make room
-    for (int i = parent->num_keys; i > child_index; i--)
+    size_t bucket = block_hash(pool, owner, block_id);
+    frame->owner = owner;
+    frame->block_id = block_id;
+    frame->hash_next = pool->buckets[bucket];
+    pool->buckets[bucket] = (int)(frame - pool->frames);
+    frame->pin_count = 1;
+    frame->is_dirty = 0;
+    frame->referenced = 1;
+    frame->valid = !load;
+    __atomic_store_n(&frame->version, frame->version + 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&pool->lock);
+
+    // The caller overwrites a block it did not load, so it keeps the latch
+    // until the frame holds real data
+    if (!load)
+        return frame;
+
+    int valid = read_block(owner, block_id, frame->data) == 0;
+    frame->valid = valid;
+    __atomic_store_n(&frame->version, frame->version + 1, __ATOMIC_RELEASE);
+    pthread_rwlock_unlock(&frame->latch);
+
+    if (!valid)
     {
-        parent->keys[i] = parent->keys[i - 1];
-        parent->values[i] = parent->values[i - 1];
-        parent->children[i + 1] = parent->children[i];
+        // Threads that found the frame meanwhile see valid == 0 and fail too
+        pthread_mutex_lock(&pool->lock);
+        frame->pin_count--;
+        pool_unlink(pool, frame);
+        pthread_mutex_unlock(&pool->lock);
+        return NULL;
     }
+    return frame;
+}
 
-    // Add middle key to parent
-    parent->keys[child_index] = child.keys[MAX_KEYS / 2];
-    parent->values[child_index] = child.values[MAX_KEYS / 2];
-    parent->children[child_index + 1] = new_node.block_id;
-    parent->num_keys++;
+static void pool_unpin(BufferPool *pool, BufferFrame *frame, int dirty)
+{
+    pthread_mutex_lock(&pool->lock);
+    if (dirty)
+        frame->is_dirty = 1;
+    if (frame->pin_count > 0)
+        frame->pin_count--;
+    pthread_mutex_unlock(&pool->lock);
+}
 
-    // Write all modified nodes
-    write_node(tree, parent);
-    write_node(tree, &child);
-    write_node(tree, &new_node);
-    write_header(tree);
+static int compare_frame_blocks(const void *a, const void *b)
+{
+    uint64_t x = (*(BufferFrame *const *)a)->block_id;
+    uint64_t y = (*(BufferFrame *const *)b)->block_id;
+    return (x > y) - (x < y);
+}
 
-    return 0;
+// Dirty frames of owner that may go to its file
+static int frame_flushable(const BufferFrame *frame, const BTree *owner)
+{
+    return frame->owner == owner && frame->is_dirty && !frame->unlogged;
 }
 
-// Insert into a non-full node
-static int insert_nonfull(BTree *tree, BTreeNode *node, uint64_t key, uint64_t value)
+/**
+ * Write every dirty frame of `owner` back to its file, in ascending block
+ * order. Only the tree's writer dirties its frames and it is the one
+ * flushing, so the dirty set is pinned and written with the mutex dropped;
+ * readers and other trees keep running.
+ */
+static int pool_flush(BufferPool *pool, BTree *owner)
 {
-    int i = node->num_keys - 1;
+    pthread_mutex_lock(&pool->lock);
+    size_t num_dirty = 0;
+    for (size_t i = 0; i < pool->num_used; i++)
+    {
+        if (frame_flushable(&pool->frames[i], owner))
+            num_dirty++;
+    }
 
-    if (is_leaf(node))
+    BufferFrame **dirty = num_dirty ? (BufferFrame **)malloc(num_dirty * sizeof(BufferFrame *)) : NULL;
+    size_t n = 0;
+    for (size_t i = 0; dirty && i < pool->num_used; i++)
     {
-        while (i >= 0 && key < node->keys[i])
+        if (frame_flushable(&pool->frames[i], owner))
         {
-            node->keys[i + 1] = node->keys[i];
-            node->values[i + 1] = node->values[i];
-            i--;
+            pool->frames[i].pin_count++;
+            dirty[n++] = &pool->frames[i];
         }
+    }
+    pthread_mutex_unlock(&pool->lock);
 
-        node->keys[i + 1] = key;
-        node->values[i + 1] = value;
-        node->num_keys++;
+    if (num_dirty == 0)
+        return 0;
+    if (!dirty)
+        return -1;
 
-        // Write the modified node back to disk
-        int result = write_node(tree, node);
-        if (result == 0)
+    qsort(dirty, n, sizeof(BufferFrame *), compare_frame_blocks);
+
+    int result = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        int written = write_block(owner, dirty[i]->block_id, dirty[i]->data) == 0;
+
+        pthread_mutex_lock(&pool->lock);
+        if (written)
         {
-            fflush(tree->fp);
+            dirty[i]->is_dirty = 0;
+            pool->writebacks++;
         }
-        return result;
+        dirty[i]->pin_count--;
+        pthread_mutex_unlock(&pool->lock);
+
+        if (!written)
+            result = -1;
     }
-    else
+
+    free(dirty);
+    return result;
+}
+
+// Free every frame of `owner`; its blocks must already be flushed
+static void pool_release(BufferPool *pool, BTree *owner)
+{
+    pthread_mutex_lock(&pool->lock);
+    for (size_t i = 0; i < pool->num_used; i++)
     {
-        while (i >= 0 && key < node->keys[i])
+        if (pool->frames[i].owner == owner)
         {
-            i--;
+            pool->frames[i].is_dirty = 0;
+            pool->frames[i].referenced = 0;
+            pool->frames[i].unlogged = 0;
+            pool_unlink(pool, &pool->frames[i]);
         }
-        i++;
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
 
-        BTreeNode child = {0};
-        read_node(tree, node->children[i], &child);
+/**
+ * Attach the tree to its pool at create/open time: the shared pool if one
+ * was set, otherwise a private pool of cache_frames frames (at least
+ * BTREE_MIN_WAL_CACHE_FRAMES under the log).
+ */
+static int attach_pool(BTree *tree)
+{
+    tree->scratch = (unsigned char *)malloc(tree->header.block_size);
+    if (!tree->scratch)
+        return -1;
 
-        if (child.num_keys == MAX_KEYS)
-        {
-            split_child(tree, node, i);
-            if (key > node->keys[i])
-            {
-                i++;
-                read_node(tree, node->children[i], &child);
-            }
-        }
+    if (tree->shared_pool)
+    {
+        if (tree->header.block_size > tree->shared_pool->frame_size)
+            return -1;
+        tree->pool = tree->shared_pool;
+        return 0;
+    }
+
+    size_t num_frames = tree->cache_frames;
+    if (tree->durability == BTREE_DURABILITY_WAL && num_frames != 0 &&
+        num_frames < BTREE_MIN_WAL_CACHE_FRAMES)
+        num_frames = BTREE_MIN_WAL_CACHE_FRAMES;
+    tree->pool = pool_create(num_frames, tree->header.block_size);
+    return tree->pool ? 0 : -1;
+}
 
-        insert_nonfull(tree, &child, key, value);
+static void clear_node_cache(BTree *tree)
+{
+    // Write any dirty nodes back to disk, then release the frames
+    if (tree->pool)
+    {
+        pool_flush(tree->pool, tree);
+        if (tree->pool == tree->shared_pool)
+            pool_release(tree->pool, tree);
+        else
+            pool_destroy(tree->pool);
+        tree->pool = NULL;
     }
+    free(tree->scratch);
+    tree->scratch = NULL;
+}
 
-    return 0;
+// Helper function to check if node is a leaf
+static int is_leaf(BTreeNode *node)
+{
+    return node->children[0] == 0;
 }
 
-// Main insert function
-int insert_key(BTree *tree, uint64_t key, uint64_t value)
+// 1 if the tree's nodes use the B+tree layout
+static int is_bplus(const BTree *tree)
 {
-    if (!tree->is_open)
-        return -1;
+    return (tree->header.flags & BTREE_FLAG_BPLUS) != 0;
+}
 
-    int result;
-    if (tree->header.root_block_id == 0)
+// 1 if the tree's nodes use the compressed encoding
+static int is_compressed(const BTree *tree)
+{
+    return (tree->header.flags & BTREE_FLAG_COMPRESSED) != 0;
+}
+
+// Fewest keys a non-root node may hold
+static uint64_t min_keys(const BTree *tree)
+{
+    if (is_compressed(tree))
+        return compressed_min_keys(tree);
+    return (tree->header.max_keys - 1) / 2;
+}
+
+/**
+ * Allocate an empty node sized for the tree's fanout. The key, value and
+ * child arrays live in the same allocation, so free_node() is a single free().
+ */
+static BTreeNode *alloc_node(const BTree *tree)
+{
+    uint64_t max_keys = tree->header.max_keys;
+    BTreeNode *node = (BTreeNode *)calloc(1, sizeof(BTreeNode) + (3 * max_keys + 1) * sizeof(uint64_t));
+    if (!node)
+        return NULL;
+
+    node->keys = (uint64_t *)(node + 1);
+    node->values = node->keys + max_keys;
+    node->children = node->values + max_keys;
+    return node;
+}
+
+static void free_node(BTreeNode *node)
+{
+    free(node);
+}
+
+// Reset a node to empty without reallocating its arrays
+static void clear_node(const BTree *tree, BTreeNode *node)
+{
+    node->block_id = 0;
+    node->parent_block_id = 0;
+    node->num_keys = 0;
+    node->prev_leaf = 0;
+    node->next_leaf = 0;
+    memset(node->keys, 0, (3 * tree->header.max_keys + 1) * sizeof(uint64_t));
+}
+
+/**
+ * Compressed nodes
+ * ----------------
+ * A compressed node keeps the three header words of a plain node (block id,
+ * parent, key count) and packs everything after them:
+ *
+ *   byte 24      1 in a leaf, 0 in an interior node
+ *   byte 25      bits per child block ID
+ *   bytes 26-27  length of the key section, little-endian
+ *   keys         the first key as a word, then the gap to each following key
+ *                as a LEB128 varint (seven bits a byte, low bits first)
+ *   values       one word per pair (leaves)
+ *   links        previous and next leaf as words (leaves)
+ *   children     num_keys + 1 block IDs of that many bits, low bits first
+ *                (interior nodes)
+ *
+ * Words use the byte order of the format version and may start at any byte.
+ * The last word of the block stays free for its LSN. Only the B+ layout is
+ * compressed: its deletes change interior keys only by rewriting separators,
+ * so a write that finds a node too full to pass through can always start
+ * over from the root.
+ *
+ * How many keys fit depends on the keys, so a node counts as full once one
+ * more entry with the widest gap, plus one separator rewritten with the
+ * widest gap, might not fit, with every child as wide as the blocks the
+ * file is about to hand out. Splits still halve the node by count.
+ */
+#define PACKED_HEADER 28   // Header words, leaf flag, child bits and key section length
+#define VARINT_MAX 10      // LEB128 bytes of the largest gap
+#define PACKED_ID_MARGIN 4 // Blocks a write may allocate between checking a node and giving it a child
+
+// Descend again from the root: a split left a node on the path too full to pass through
+#define WRITE_RESTART 2
+
+// Bits needed to hold value (0 for 0)
+static unsigned bits_for(uint64_t value)
+{
+    return value ? 64 - (unsigned)__builtin_clzll(value) : 0;
+}
+
+static unsigned varint_size(uint64_t value)
+{
+    unsigned size = 1;
+    while (value >= 0x80)
     {
-        BTreeNode *root = create_node(tree);
-        if (!root)
-            return -1;
+        value >>= 7;
+        size++;
+    }
+    return size;
+}
 
-        root->keys[0] = key;
-        root->values[0] = value;
-        root->num_keys = 1;
-        tree->header.root_block_id = root->block_id;
+static unsigned char *put_varint(unsigned char *p, uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        *p++ = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    *p++ = (unsigned char)value;
+    return p;
+}
 
-        result = write_node(tree, root);
-        if (result == 0)
+// Read a varint that ends before `end`; NULL if it does not
+static const unsigned char *get_varint(const unsigned char *p, const unsigned char *end, uint64_t *value)
+{
+    uint64_t result = 0;
+    for (unsigned shift = 0; p < end && shift < 64; shift += 7)
+    {
+        unsigned char byte = *p++;
+        result |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
         {
-            write_header(tree);
-            fflush(tree->fp);
+            *value = result;
+            return p;
         }
+    }
+    return NULL;
+}
 
-        free(root);
-        return result;
+// Words at any byte offset, in the byte order of the format
+static void store_word(int swap, unsigned char *p, uint64_t value)
+{
+    value = swap_word(swap, value);
+    memcpy(p, &value, sizeof(value));
+}
+
+static uint64_t load_word(int swap, const unsigned char *p)
+{
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return swap_word(swap, value);
+}
+
+// Write count values of `bits` bits each into a zeroed buffer, low bits first
+static void pack_bits(unsigned char *out, const uint64_t *values, uint64_t count, unsigned bits)
+{
+    uint64_t pos = 0;
+    for (uint64_t i = 0; i < count; i++)
+    {
+        for (unsigned done = 0; done < bits;)
+        {
+            unsigned shift = pos % 8;
+            unsigned take = bits - done < 8 - shift ? bits - done : 8 - shift;
+            out[pos / 8] |= (unsigned char)(((values[i] >> done) & ((1u << take) - 1)) << shift);
+            done += take;
+            pos += take;
+        }
     }
+}
 
-    // Create a temporary node for the root
-    BTreeNode root = {0};
-    result = read_node(tree, tree->header.root_block_id, &root);
-    if (result != 0)
-        return result;
+// Value i of a pack_bits() buffer
+static uint64_t unpack_bits(const unsigned char *in, uint64_t i, unsigned bits)
+{
+    uint64_t pos = i * bits;
+    uint64_t value = 0;
+    for (unsigned done = 0; done < bits;)
+    {
+        unsigned shift = pos % 8;
+        unsigned take = bits - done < 8 - shift ? bits - done : 8 - shift;
+        value |= (uint64_t)((in[pos / 8] >> shift) & ((1u << take) - 1)) << done;
+        done += take;
+        pos += take;
+    }
+    return value;
+}
 
-    // Now pass the node struct instead of the block_id
-    result = insert_nonfull(tree, &root, key, value);
-    if (result == 0)
+// Bytes of a compressed node: the key section, then values and links or children
+static uint64_t packed_size(int leaf, uint64_t num_keys, uint64_t key_bytes, unsigned bits)
+{
+    uint64_t size = PACKED_HEADER + key_bytes;
+    if (leaf)
+        return size + (num_keys + 2) * sizeof(uint64_t);
+    return size + ((num_keys + 1) * bits + 7) / 8;
+}
+
+// Bytes a compressed node may use, leaving the LSN word
+static uint64_t packed_room(const BTree *tree)
+{
+    return tree->header.block_size - sizeof(uint64_t);
+}
+
+static uint64_t key_section_bytes(const uint64_t *keys, uint64_t num_keys)
+{
+    if (num_keys == 0)
+        return 0;
+    uint64_t bytes = sizeof(uint64_t);
+    for (uint64_t i = 1; i < num_keys; i++)
     {
-        fflush(tree->fp);
+        bytes += varint_size(keys[i] - keys[i - 1]);
     }
-    return result;
+    return bytes;
 }
 
-// Search function
-int search_key(BTree *tree, uint64_t key, uint64_t *value)
+// Bits per child ID of an interior node: enough for its largest child
+static unsigned child_bits(const BTreeNode *node)
 {
-    if (!tree->is_open || tree->header.root_block_id == 0)
+    uint64_t largest = 0;
+    for (uint64_t i = 0; i <= node->num_keys; i++)
+    {
+        if (node->children[i] > largest)
+            largest = node->children[i];
+    }
+    return bits_for(largest);
+}
+
+/**
+ * Keys per compressed node for a block size: the most an interior node can
+ * hold, with one-byte gaps and children numbered as low as they can be.
+ * Leaves fill up well before that, since their values stay whole words.
+ */
+static uint64_t compressed_keys_for_block_size(uint64_t block_size)
+{
+    uint64_t room = block_size - sizeof(uint64_t);
+    uint64_t keys = 1;
+    while (packed_size(0, keys + 1, keys + 8, bits_for(keys + 2)) <= room)
+    {
+        keys++;
+    }
+    return keys;
+}
+
+// 1 if a compressed node with this shape has no room for a write to pass through
+static int packed_full(const BTree *tree, int leaf, uint64_t num_keys, uint64_t key_bytes, unsigned bits)
+{
+    unsigned next_bits = bits_for(tree->header.next_block_id + PACKED_ID_MARGIN);
+    if (!leaf && bits < next_bits)
+        bits = next_bits;
+    return num_keys + 1 > tree->header.max_keys ||
+           packed_size(leaf, num_keys + 1, key_bytes + 2 * VARINT_MAX, bits) > packed_room(tree);
+}
+
+/**
+ * 1 if a write must split the node before descending into it. A plain node
+ * is full at max_keys keys; a compressed one when packed_full() says so.
+ */
+static int node_full(const BTree *tree, const BTreeNode *node)
+{
+    if (!is_compressed(tree))
+        return node->num_keys >= tree->header.max_keys;
+
+    int leaf = node->children[0] == 0;
+    return packed_full(tree, leaf, node->num_keys, key_section_bytes(node->keys, node->num_keys),
+                       leaf ? 0 : child_bits(node));
+}
+
+/**
+ * Compressed trees: fewest keys a non-root node may hold. Every node of up
+ * to 2 * min + 1 keys has room to pass a write through even with the widest
+ * gaps and 64-bit children, so whatever a merge or a borrow produces fits.
+ */
+static uint64_t compressed_min_keys(const BTree *tree)
+{
+    // Binary search for the largest key count that is never full
+    uint64_t lo = 0, hi = tree->header.max_keys;
+    while (lo < hi)
+    {
+        uint64_t n = lo + (hi - lo + 1) / 2;
+        uint64_t key_bytes = sizeof(uint64_t) + (n - 1) * VARINT_MAX;
+        if (packed_full(tree, 1, n, key_bytes, 0) || packed_full(tree, 0, n, key_bytes, 64))
+            hi = n - 1;
+        else
+            lo = n;
+    }
+    return lo > 0 ? (lo - 1) / 2 : 0;
+}
+
+// Sections of a compressed block, as found by packed_parse()
+typedef struct
+{
+    uint64_t num_keys;
+    uint64_t key_bytes;
+    unsigned bits;                 // Bits per child ID
+    int leaf;
+    const unsigned char *keys;     // Key section
+    const unsigned char *values;   // Leaves: value words, then the two links
+    const unsigned char *children; // Interior nodes: packed child IDs
+} PackedNode;
+
+// Locate the sections of a compressed block; -1 if they would overrun it
+static int packed_parse(const BTree *tree, const unsigned char *block, PackedNode *packed)
+{
+    packed->num_keys = load_word(tree->swap_words, block + 2 * sizeof(uint64_t));
+    packed->leaf = block[24] != 0;
+    packed->bits = block[25];
+    packed->key_bytes = block[26] | (uint64_t)block[27] << 8;
+    if (packed->num_keys > tree->header.max_keys || packed->bits > 64 ||
+        (packed->num_keys == 0 ? packed->key_bytes != 0 : packed->key_bytes < sizeof(uint64_t)) ||
+        packed_size(packed->leaf, packed->num_keys, packed->key_bytes, packed->bits) > packed_room(tree))
     {
         return -1;
     }
 
-    BTreeNode node = {0};
-    uint64_t current_block = tree->header.root_block_id;
+    packed->keys = block + PACKED_HEADER;
+    packed->values = packed->keys + packed->key_bytes;
+    packed->children = packed->values;
+    return 0;
+}
+
+// Decode the key section of a parsed block; -1 if it is malformed
+static int packed_keys(const PackedNode *packed, int swap, uint64_t *keys)
+{
+    if (packed->num_keys == 0)
+        return 0;
+
+    const unsigned char *p = packed->keys + sizeof(uint64_t);
+    const unsigned char *end = packed->keys + packed->key_bytes;
+    keys[0] = load_word(swap, packed->keys);
+    for (uint64_t i = 1; i < packed->num_keys; i++)
+    {
+        uint64_t gap;
+        p = get_varint(p, end, &gap);
+        if (!p)
+            return -1;
+        keys[i] = keys[i - 1] + gap;
+    }
+    return p == end ? 0 : -1;
+}
+
+// Bytes the node takes compressed
+static uint64_t packed_node_size(const BTreeNode *node)
+{
+    int leaf = node->children[0] == 0;
+    return packed_size(leaf, node->num_keys, key_section_bytes(node->keys, node->num_keys),
+                       leaf ? 0 : child_bits(node));
+}
+
+// Encode a compressed node; -1 if it does not fit the block
+static int encode_compressed(const BTree *tree, const BTreeNode *node, unsigned char *block)
+{
+    int swap = tree->swap_words;
+    int leaf = node->children[0] == 0;
+    uint64_t n = node->num_keys;
+    uint64_t key_bytes = key_section_bytes(node->keys, n);
+    unsigned bits = leaf ? 0 : child_bits(node);
+    if (packed_size(leaf, n, key_bytes, bits) > packed_room(tree))
+        return -1;
+
+    memset(block, 0, tree->header.block_size);
+    store_word(swap, block, node->block_id);
+    store_word(swap, block + sizeof(uint64_t), node->parent_block_id);
+    store_word(swap, block + 2 * sizeof(uint64_t), n);
+    block[24] = (unsigned char)leaf;
+    block[25] = (unsigned char)bits;
+    block[26] = (unsigned char)key_bytes;
+    block[27] = (unsigned char)(key_bytes >> 8);
+
+    unsigned char *p = block + PACKED_HEADER;
+    if (n > 0)
+    {
+        store_word(swap, p, node->keys[0]);
+        p += sizeof(uint64_t);
+        for (uint64_t i = 1; i < n; i++)
+        {
+            p = put_varint(p, node->keys[i] - node->keys[i - 1]);
+        }
+    }
+
+    if (!leaf)
+    {
+        pack_bits(p, node->children, n + 1, bits);
+        return 0;
+    }
+    for (uint64_t i = 0; i < n; i++, p += sizeof(uint64_t))
+    {
+        store_word(swap, p, node->values[i]);
+    }
+    store_word(swap, p, node->prev_leaf);
+    store_word(swap, p + sizeof(uint64_t), node->next_leaf);
+    return 0;
+}
+
+static int decode_compressed(const BTree *tree, const unsigned char *block, BTreeNode *node)
+{
+    int swap = tree->swap_words;
+    PackedNode packed;
+    clear_node(tree, node);
+    if (packed_parse(tree, block, &packed) != 0 || packed_keys(&packed, swap, node->keys) != 0)
+        return -1;
+
+    node->block_id = load_word(swap, block);
+    node->parent_block_id = load_word(swap, block + sizeof(uint64_t));
+    node->num_keys = packed.num_keys;
+    if (!packed.leaf)
+    {
+        for (uint64_t i = 0; i <= packed.num_keys; i++)
+        {
+            node->children[i] = unpack_bits(packed.children, i, packed.bits);
+        }
+        return 0;
+    }
+
+    const unsigned char *p = packed.values;
+    for (uint64_t i = 0; i < packed.num_keys; i++, p += sizeof(uint64_t))
+    {
+        node->values[i] = load_word(swap, p);
+    }
+    node->prev_leaf = load_word(swap, p);
+    node->next_leaf = load_word(swap, p + sizeof(uint64_t));
+    return 0;
+}
+
+// Create a new node
+static BTreeNode *create_node(BTree *tree)
+{
+    BTreeNode *node = alloc_node(tree);
+    if (!node)
+        return NULL;
+
+    node->block_id = allocate_block(tree);
+    if (node->block_id == 0)
+    {
+        free_node(node);
+        return NULL;
+    }
+
+    return node;
+}
+
+/**
+ * Snapshots
+ * ---------
+ * A snapshot copies the header while the writer holds writer_lock, and
+ * seals the tree: from then on every block below next_block_id counts as
+ * committed, and writes shadow it instead of changing it (see the
+ * append-only trees below). Snapshots are numbered in the order they are
+ * taken. A block replaced while snapshots are open is retired with the
+ * number of the newest snapshot, which is the newest that can reach it, and
+ * goes on the free list once every snapshot up to that number is closed.
+ * The writer takes waiting snapshots and frees retired blocks only between
+ * writes, when the tree is consistent.
+ */
+typedef struct
+{
+    uint64_t block_id;
+    uint64_t version; // Newest snapshot that may still read the block
+} RetiredBlock;
+
+struct BTreeSnapshots
+{
+    BTree **waiting;        // Snapshots asked for but not yet taken
+    size_t num_waiting, max_waiting;
+    uint64_t *live;         // Versions of the open snapshots, ascending
+    size_t num_live, max_live;
+    uint64_t last_version;  // Version of the newest snapshot taken
+    RetiredBlock *retired;  // Blocks waiting for snapshots to close, oldest first
+    size_t first_retired, num_retired, max_retired;
+};
+
+// Make room for `count` items of `size` bytes in a growable array
+static int reserve_items(void **items, size_t *max, size_t count, size_t size)
+{
+    if (count <= *max)
+        return 0;
+    size_t grown = *max ? *max : 8;
+    while (grown < count)
+        grown *= 2;
+    void *resized = realloc(*items, grown * size);
+    if (!resized)
+        return -1;
+    *items = resized;
+    *max = grown;
+    return 0;
+}
+
+// 1 while a snapshot of the tree is open
+static int snapshots_pinned(const BTree *tree)
+{
+    BTreeSnapshots *snapshots = __atomic_load_n(&tree->snapshots, __ATOMIC_ACQUIRE);
+    return snapshots && __atomic_load_n(&snapshots->num_live, __ATOMIC_ACQUIRE) > 0;
+}
+
+// Take the waiting snapshots. The caller holds writer_lock and snapshot_lock.
+static void take_snapshots(BTree *tree)
+{
+    BTreeSnapshots *snapshots = tree->snapshots;
+    if (!snapshots || snapshots->num_waiting == 0)
+        return;
+
+    // btree_snapshot() made room in `live` for every waiting snapshot
+    uint64_t version = ++snapshots->last_version;
+    if (tree->committed_blocks < tree->header.next_block_id)
+        tree->committed_blocks = tree->header.next_block_id;
+    for (size_t i = 0; i < snapshots->num_waiting; i++)
+    {
+        BTree *snapshot = snapshots->waiting[i];
+        snapshot->header = tree->header;
+        snapshot->snapshot_version = version;
+        snapshots->live[snapshots->num_live + i] = version;
+    }
+    __atomic_store_n(&snapshots->num_live, snapshots->num_live + snapshots->num_waiting,
+                     __ATOMIC_RELEASE);
+    snapshots->num_waiting = 0;
+    pthread_cond_broadcast(&tree->snapshot_taken);
+}
+
+// Free the retired blocks no open snapshot can reach. The caller holds writer_lock and snapshot_lock.
+static int reclaim_blocks(BTree *tree)
+{
+    BTreeSnapshots *snapshots = tree->snapshots;
+    if (!snapshots)
+        return 0;
+
+    uint64_t oldest = snapshots->num_live > 0 ? snapshots->live[0] : UINT64_MAX;
+    int result = 0;
+    while (result == 0 && snapshots->first_retired < snapshots->num_retired &&
+           snapshots->retired[snapshots->first_retired].version < oldest)
+    {
+        // Oldest first, which is root to leaf along any path a reader may still be on.
+        // A logged tree commits as it goes, since unlogged frames cannot be evicted.
+        result = free_block(tree, snapshots->retired[snapshots->first_retired].block_id);
+        if (result == 0)
+        {
+            snapshots->first_retired++;
+            result = log_commit_if_full(tree);
+        }
+    }
+    if (snapshots->first_retired == snapshots->num_retired)
+        snapshots->first_retired = snapshots->num_retired = 0;
+    return result;
+}
+
+/**
+ * Keep a replaced block until the snapshots that can reach it are closed.
+ * A block that cannot be queued is left dead until the file is compacted.
+ */
+static int retire_block(BTree *tree, uint64_t block_id)
+{
+    pthread_mutex_lock(&tree->snapshot_lock);
+    BTreeSnapshots *snapshots = tree->snapshots;
+    if (snapshots->first_retired > 0 && snapshots->num_retired == snapshots->max_retired)
+    {
+        snapshots->num_retired -= snapshots->first_retired;
+        memmove(snapshots->retired, snapshots->retired + snapshots->first_retired,
+                snapshots->num_retired * sizeof(RetiredBlock));
+        snapshots->first_retired = 0;
+    }
+    if (reserve_items((void **)&snapshots->retired, &snapshots->max_retired,
+                      snapshots->num_retired + 1, sizeof(RetiredBlock)) == 0)
+    {
+        snapshots->retired[snapshots->num_retired].block_id = block_id;
+        snapshots->retired[snapshots->num_retired].version = snapshots->last_version;
+        snapshots->num_retired++;
+        if (tree->log)
+            log_track_retired(tree);
+    }
+    pthread_mutex_unlock(&tree->snapshot_lock);
+    return 0;
+}
+
+// Called by the writer between two writes in a long operation
+static void snapshot_point(BTree *tree)
+{
+    if (!__atomic_load_n(&tree->snapshots, __ATOMIC_ACQUIRE))
+        return;
+    pthread_mutex_lock(&tree->snapshot_lock);
+    take_snapshots(tree);
+    reclaim_blocks(tree);
+    pthread_mutex_unlock(&tree->snapshot_lock);
+}
+
+/**
+ * Release writer_lock at the end of a write. snapshot_lock is held across
+ * the unlock, so a snapshot asked for meanwhile either is taken here or
+ * finds the writer gone and takes itself.
+ */
+static void writer_unlock(BTree *tree)
+{
+    pthread_mutex_lock(&tree->snapshot_lock);
+    take_snapshots(tree);
+    reclaim_blocks(tree);
+    pthread_mutex_unlock(&tree->writer_lock);
+    pthread_mutex_unlock(&tree->snapshot_lock);
+}
+
+/**
+ * Append-only trees
+ * -----------------
+ * A node that is part of the last commit is never changed where it lies.
+ * Before a write changes it, the node is shadowed: copied to a new block at
+ * the end of the file, with its parent pointed at the copy. The parent has
+ * been shadowed already, since writes work down from the root, so the copy
+ * is reachable only through new blocks until the header goes out. Each
+ * shadow leaves the tree's contents as they were, and nodes shadowed
+ * earlier in the same commit are changed in place, exactly like a tree
+ * updated in place, so readers follow the same protocol either way.
+ */
+static int is_append_only(const BTree *tree)
+{
+    return (tree->header.flags & BTREE_FLAG_APPEND_ONLY) != 0;
+}
+
+// 1 if writes shadow committed blocks: in append-only files, and while snapshots are open
+static int writes_shadow(const BTree *tree)
+{
+    return is_append_only(tree) || snapshots_pinned(tree);
+}
+
+// 1 if the block is on disk under the header, or reachable from a snapshot, and must not be rewritten
+static int is_committed(const BTree *tree, uint64_t block_id)
+{
+    return block_id < tree->committed_blocks && writes_shadow(tree);
+}
+
+// Shadow the root, publishing the copy as the new root
+static int shadow_root(BTree *tree, BTreeNode *root)
+{
+    if (!is_committed(tree, root->block_id))
+        return 0;
+
+    uint64_t old_block_id = root->block_id;
+    uint64_t block_id = allocate_block(tree);
+    if (block_id == 0)
+        return -1;
+    root->block_id = block_id;
+    if (write_node(tree, root) != 0)
+        return -1;
+
+    pthread_rwlock_wrlock(&tree->root_latch);
+    __atomic_store_n(&tree->header.root_block_id, block_id, __ATOMIC_RELEASE);
+    pthread_rwlock_unlock(&tree->root_latch);
+    return release_block(tree, old_block_id);
+}
+
+// Shadow child i of a parent that has been shadowed already
+static int shadow_child(BTree *tree, BTreeNode *parent, uint64_t i, BTreeNode *child)
+{
+    if (!is_committed(tree, child->block_id))
+        return 0;
+
+    uint64_t old_block_id = child->block_id;
+    uint64_t block_id = allocate_block(tree);
+    if (block_id == 0)
+        return -1;
+    child->block_id = block_id;
+    child->parent_block_id = parent->block_id;
+    parent->children[i] = block_id;
+
+    // The copy is complete before the parent points at it
+    if (write_node(tree, child) != 0 || write_node(tree, parent) != 0)
+        return -1;
+    return release_block(tree, old_block_id);
+}
+
+/**
+ * Shadow the path from the root to the node holding key, or the leaf it
+ * belongs in, and leave that node in *node. *node is swapped with a node of
+ * the same size on the way down; the caller frees whichever it ends up with.
+ */
+static int shadow_path(BTree *tree, uint64_t key, BTreeNode **node)
+{
+    BTreeNode *child = alloc_node(tree);
+    int result = child && read_node(tree, tree->header.root_block_id, *node) == 0 ? 0 : -1;
+    if (result == 0)
+        result = shadow_root(tree, *node);
+
+    while (result == 0)
+    {
+        BTreeNode *parent = *node;
+        uint64_t i = keysearch_lower_bound(parent->keys, parent->num_keys, key, 0);
+        if (is_leaf(parent) || (i < parent->num_keys && parent->keys[i] == key))
+            break;
+
+        result = read_node(tree, parent->children[i], child);
+        if (result == 0)
+            result = shadow_child(tree, parent, i, child);
+        *node = child;
+        child = parent;
+    }
+
+    free_node(child);
+    return result;
+}
+
+/**
+ * Split the full child at child_index of parent. The caller has already read
+ * the child into `child`; on return it holds the left half and `right` the
+ * new right-hand node, so the insert can carry on into either without
+ * reading them back.
+ */
+static int split_child(BTree *tree, BTreeNode *parent, int child_index, BTreeNode *child, BTreeNode *right)
+{
+    // Keys [0, half) stay in the child. Normally key half moves up to the
+    // parent and the rest move right. A B+ leaf keeps every pair: keys from
+    // half on move right and a copy of the first becomes the separator.
+    int bplus_leaf = is_bplus(tree) && is_leaf(child);
+    int num_keys = (int)child->num_keys;
+    int half = num_keys / 2;
+    int first_right = bplus_leaf ? half : half + 1;
+
+    clear_node(tree, right);
+    right->block_id = allocate_block(tree);
+    if (right->block_id == 0)
+        return -1;
+    right->parent_block_id = parent->block_id;
+    right->num_keys = num_keys - first_right;
+
+    // Copy second half of child's keys and values to the new node
+    for (int i = 0; i < (int)right->num_keys; i++)
+    {
+        right->keys[i] = child->keys[i + first_right];
+        right->values[i] = child->values[i + first_right];
+    }
+
+    // If not leaf, copy relevant children
+    if (!is_leaf(child))
+    {
+        for (int i = 0; i <= (int)right->num_keys; i++)
+        {
+            right->children[i] = child->children[i + first_right];
+            child->children[i + first_right] = 0;
+        }
+    }
+
+    uint64_t sep_key = bplus_leaf ? right->keys[0] : child->keys[half];
+    uint64_t sep_value = bplus_leaf ? 0 : child->values[half];
+    for (int i = half; i < num_keys; i++)
+    {
+        child->keys[i] = 0;
+        child->values[i] = 0;
+    }
+    child->num_keys = half;
+
+    // Splice the new leaf into the chain after the child
+    if (bplus_leaf)
+    {
+        right->prev_leaf = child->block_id;
+        right->next_leaf = child->next_leaf;
+        child->next_leaf = right->block_id;
+
+        if (right->next_leaf != 0)
+        {
+            BTreeNode *next = alloc_node(tree);
+            int result = next && read_node(tree, right->next_leaf, next) == 0 ? 0 : -1;
+            if (result == 0)
+            {
+                next->prev_leaf = right->block_id;
+                result = write_node(tree, next);
+            }
+            free_node(next);
+            if (result != 0)
+                return -1;
+        }
+    }
+
+    // Move parent's keys and children to make room
+    for (int i = parent->num_keys; i > child_index; i--)
+    {
+        parent->keys[i] = parent->keys[i - 1];
+        parent->values[i] = parent->values[i - 1];
+        parent->children[i + 1] = parent->children[i];
+    }
+
+    // Add middle key to parent
+    parent->keys[child_index] = sep_key;
+    parent->values[child_index] = sep_value;
+    parent->children[child_index + 1] = right->block_id;
+    parent->num_keys++;
+
+    // Write all modified nodes. A reader that crabbed into the child before the
+    // parent changed still finds every key: the new node is complete before the
+    // parent points at it, and the child is cut down last.
+    if (write_node(tree, right) != 0 || write_node(tree, parent) != 0 || write_node(tree, child) != 0)
+        return -1;
+    return 0;
+}
+
+// 1 if key belongs in the right-hand node once the split separator is `sep`;
+// a key equal to a B+ separator belongs to the right-hand node
+static int goes_right(const BTree *tree, uint64_t key, uint64_t sep)
+{
+    return key > sep || (is_bplus(tree) && key == sep);
+}
+
+/**
+ * Insert into a node that has room. Every full child is split before the
+ * descent steps into it, so the parent always has room for the separator
+ * and no node is visited twice. Half of a compressed node can still be
+ * full when its children are about to widen; the insert then returns
+ * WRITE_RESTART and starts again from the root, splitting it from above.
+ */
+static int insert_nonfull(BTree *tree, BTreeNode *node, uint64_t key, uint64_t value)
+{
+    if (node_full(tree, node))
+        return WRITE_RESTART;
+
+    // Callers have already ruled out an existing key, so the upper bound is
+    // the slot the key goes in (or, in an interior node, the child to descend)
+    uint64_t i = keysearch_upper_bound(node->keys, node->num_keys, key, 0);
+
+    if (is_leaf(node))
+    {
+        uint64_t tail = node->num_keys - i;
+        memmove(&node->keys[i + 1], &node->keys[i], tail * sizeof(uint64_t));
+        memmove(&node->values[i + 1], &node->values[i], tail * sizeof(uint64_t));
+
+        node->keys[i] = key;
+        node->values[i] = value;
+        node->num_keys++;
+
+        // Mark the modified node dirty in the buffer pool
+        return write_node(tree, node);
+    }
+
+    BTreeNode *child = alloc_node(tree);
+    BTreeNode *right = alloc_node(tree);
+    int result = child && right && read_node(tree, node->children[i], child) == 0 ? 0 : -1;
+    if (result == 0)
+        result = shadow_child(tree, node, i, child);
+
+    if (result == 0 && node_full(tree, child))
+    {
+        result = split_child(tree, node, (int)i, child, right);
+        if (result == 0 && goes_right(tree, key, node->keys[i]))
+        {
+            BTreeNode *swap = child;
+            child = right;
+            right = swap;
+        }
+    }
+
+    if (result == 0)
+        result = insert_nonfull(tree, child, key, value);
+    free_node(child);
+    free_node(right);
+    return result;
+}
+
+/**
+ * Grow the tree by one level: publish a new root whose only child is the
+ * full root, then split the old root under it. Readers that start from the
+ * new root see a complete tree at every step of the split; the old root is
+ * cut down only after the new root points past it. On return *root holds
+ * whichever half key belongs in.
+ */
+static int grow_root(BTree *tree, BTreeNode **root, uint64_t key)
+{
+    BTreeNode *new_root = create_node(tree);
+    BTreeNode *right = alloc_node(tree);
+    int result = new_root && right ? 0 : -1;
+
+    if (result == 0)
+    {
+        new_root->children[0] = (*root)->block_id;
+        result = write_node(tree, new_root);
+    }
+    if (result == 0)
+    {
+        pthread_rwlock_wrlock(&tree->root_latch);
+        __atomic_store_n(&tree->header.root_block_id, new_root->block_id, __ATOMIC_RELEASE);
+        pthread_rwlock_unlock(&tree->root_latch);
+        tree->header_dirty = 1;
+        (*root)->parent_block_id = new_root->block_id;
+        result = split_child(tree, new_root, 0, *root, right);
+    }
+    if (result == 0 && goes_right(tree, key, new_root->keys[0]))
+    {
+        BTreeNode *swap = *root;
+        *root = right;
+        right = swap;
+    }
+
+    free_node(new_root);
+    free_node(right);
+    return result;
+}
+
+// Insert a new key, splitting full nodes on the way down; callers decide when
+// the change becomes durable
+static int insert_unsynced(BTree *tree, uint64_t key, uint64_t value)
+{
+    int result;
+    if (tree->header.root_block_id == 0)
+    {
+        BTreeNode *root = create_node(tree);
+        if (!root)
+            return -1;
+
+        root->keys[0] = key;
+        root->values[0] = value;
+        root->num_keys = 1;
+
+        result = write_node(tree, root);
+        if (result == 0)
+        {
+            pthread_rwlock_wrlock(&tree->root_latch);
+            __atomic_store_n(&tree->header.root_block_id, root->block_id, __ATOMIC_RELEASE);
+            pthread_rwlock_unlock(&tree->root_latch);
+        }
+
+        free_node(root);
+        return result;
+    }
+
+    // Create a temporary node for the root
+    BTreeNode *root = alloc_node(tree);
+    if (!root)
+        return -1;
+
+    do
+    {
+        result = read_node(tree, tree->header.root_block_id, root);
+        if (result == 0)
+            result = shadow_root(tree, root);
+        if (result == 0 && node_full(tree, root))
+        {
+            // A full root is split before the descent, like any other full node
+            result = grow_root(tree, &root, key);
+        }
+        if (result == 0)
+        {
+            // Now pass the node struct instead of the block_id
+            result = insert_nonfull(tree, root, key, value);
+        }
+    } while (result == WRITE_RESTART);
+
+    free_node(root);
+    return result;
+}
+
+
+// Memory-mapped I/O
+
+/**
+ * Make sure the mapping covers block_id. A read-write mapping grows the file
+ * by doubling as next_block_id advances; a read-only mapping follows the file
+ * when another process has grown it.
+ */
+static int map_ensure(BTree *tree, uint64_t block_id)
+{
+    size_t needed = (size_t)(block_id + 1) * tree->header.block_size;
+    if (needed <= tree->map_size)
+        return 0;
+
+    int fd = fileno(tree->fp);
+    struct stat st;
+
+    // Appends made through stdio (bulk loads) must reach the file first
+    if (fflush(tree->fp) != 0 || fstat(fd, &st) != 0)
+        return -1;
+
+    size_t new_size = (size_t)st.st_size;
+    if (tree->read_only)
+    {
+        if (new_size < needed)
+            return -1;
+    }
+    else
+    {
+        size_t grown = tree->map_size ? tree->map_size : (size_t)MAP_MIN_BLOCKS * tree->header.block_size;
+        while (grown < needed)
+            grown *= 2;
+        if (grown > new_size)
+        {
+            if (ftruncate(fd, (off_t)grown) != 0)
+                return -1;
+            new_size = grown;
+        }
+    }
+
+    void *map = mmap(NULL, new_size, tree->read_only ? PROT_READ : PROT_READ | PROT_WRITE,
+                     MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+        return -1;
+
+    if (tree->map)
+        munmap(tree->map, tree->map_size);
+    tree->map = (unsigned char *)map;
+    tree->map_size = new_size;
+    return 0;
+}
+
+static void map_close(BTree *tree)
+{
+    if (!tree->map)
+        return;
+
+    munmap(tree->map, tree->map_size);
+    tree->map = NULL;
+    tree->map_size = 0;
+
+    // Drop the slack a read-write mapping added past the last block
+    if (!tree->read_only)
+    {
+        fflush(tree->fp);
+        if (ftruncate(fileno(tree->fp), (off_t)(tree->header.next_block_id * tree->header.block_size)) != 0)
+        {
+            // The file keeps its zero-filled tail; it is never read
+        }
+    }
+}
+
+/**
+ * Page access: the raw image of a block, either straight from the mapping
+ * or from a pinned buffer pool frame, latched shared (PAGE_READ) or
+ * exclusively (PAGE_WRITE). Release with page_put(). Mapped pages have no
+ * latches; a mapping is shared between threads only when it is read-only.
+ *
+ * PAGE_OPTIMISTIC pins the frame without latching it, once no writer holds
+ * it, and remembers its version. The data may change underneath the reader,
+ * so anything read from it counts only if page_validate() then succeeds.
+ * Both sides touch such frame data only with relaxed atomic word accesses:
+ * the writer builds a new image in tree->scratch and copies it into the
+ * frame by word (page_image(), page_publish()), and readers load fixed-layout
+ * words in place. A compressed node's words sit at any byte offset, so its
+ * optimistic reader gets a private copy of the block instead, without the
+ * last word (the LSN), which no view reads and log commits stamp unlatched.
+ */
+#define PAGE_READ 0
+#define PAGE_WRITE 1
+#define PAGE_OPTIMISTIC 2
+
+typedef struct
+{
+    unsigned char *data;
+    BufferFrame *frame; // NULL when the page lives in the mapping
+    BufferPool *pool;   // Pool holding the frame
+    int mode;           // PAGE_READ, PAGE_WRITE or PAGE_OPTIMISTIC
+    uint64_t version;   // Frame version seen by an optimistic reader
+    unsigned char *copy; // Optimistic reads of compressed nodes: the copy data points at
+} PageRef;
+
+// Frame data shared with optimistic readers moves by word with relaxed atomics
+static void store_block_words(unsigned char *dst, const unsigned char *src, size_t bytes)
+{
+    for (size_t i = 0; i < bytes / sizeof(uint64_t); i++)
+        __atomic_store_n((uint64_t *)dst + i, ((const uint64_t *)src)[i], __ATOMIC_RELAXED);
+}
+
+static void load_block_words(unsigned char *dst, const unsigned char *src, size_t bytes)
+{
+    for (size_t i = 0; i < bytes / sizeof(uint64_t); i++)
+        ((uint64_t *)dst)[i] = __atomic_load_n((const uint64_t *)src + i, __ATOMIC_RELAXED);
+}
+
+static int page_get(BTree *tree, uint64_t block_id, int load, int mode, PageRef *page)
+{
+    page->copy = NULL;
+    if (tree->map)
+    {
+        if (map_ensure(tree, block_id) != 0)
+            return -1;
+        page->data = tree->map + block_id * tree->header.block_size;
+        page->frame = NULL;
+        return 0;
+    }
+
+    // A snapshot shares the frames of the handle it was taken from
+    page->pool = tree->pool;
+    page->mode = mode;
+    page->frame = pool_fetch(tree->pool, tree->base ? tree->base : tree, block_id, load);
+    if (!page->frame)
+        return -1;
+
+    BufferFrame *frame = page->frame;
+    if (mode == PAGE_WRITE)
+    {
+        // pool_fetch() latches the frames it hands out without loading them
+        if (load)
+        {
+            pthread_rwlock_wrlock(&frame->latch);
+            __atomic_store_n(&frame->version, frame->version + 1, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_RELEASE);
+        }
+    }
+    else if (mode == PAGE_READ)
+    {
+        pthread_rwlock_rdlock(&frame->latch);
+    }
+    else
+    {
+        // Wait out a writer (or the read of a missed block) on its latch
+        while ((page->version = __atomic_load_n(&frame->version, __ATOMIC_ACQUIRE)) & 1)
+        {
+            pthread_rwlock_rdlock(&frame->latch);
+            pthread_rwlock_unlock(&frame->latch);
+        }
+    }
+
+    // The thread that missed may have failed to read the block in
+    if (!frame->valid)
+    {
+        if (mode != PAGE_OPTIMISTIC)
+            pthread_rwlock_unlock(&frame->latch);
+        pool_unpin(tree->pool, frame, 0);
+        page->frame = NULL;
+        return -1;
+    }
+    page->data = frame->data;
+    if (mode != PAGE_OPTIMISTIC || !is_compressed(tree))
+        return 0;
+
+    size_t block_size = tree->header.block_size;
+    page->copy = (unsigned char *)malloc(block_size);
+    if (!page->copy)
+    {
+        pool_unpin(tree->pool, frame, 0);
+        page->frame = NULL;
+        return -1;
+    }
+    load_block_words(page->copy, frame->data, block_size - sizeof(uint64_t));
+    memset(page->copy + block_size - sizeof(uint64_t), 0, sizeof(uint64_t));
+    page->data = page->copy;
+    return 0;
+}
+
+// Where to build a new image of a page: off to the side for a frame
+static unsigned char *page_image(BTree *tree, const PageRef *page)
+{
+    return page->frame ? tree->scratch : page->data;
+}
+
+// Copy an image built with page_image() into the page
+static void page_publish(BTree *tree, PageRef *page, const unsigned char *image)
+{
+    if (image != page->data)
+        store_block_words(page->data, image, tree->header.block_size);
+}
+
+// 1 if nothing wrote to an optimistically read page since page_get()
+static int page_validate(const PageRef *page)
+{
+    if (!page->frame || page->mode != PAGE_OPTIMISTIC)
+        return 1;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&page->frame->version, __ATOMIC_RELAXED) == page->version;
+}
+
+static void page_put(PageRef *page, int dirty)
+{
+    BufferFrame *frame = page->frame;
+    if (frame)
+    {
+        if (page->mode == PAGE_WRITE)
+            __atomic_store_n(&frame->version, frame->version + 1, __ATOMIC_RELEASE);
+        if (page->mode != PAGE_OPTIMISTIC)
+            pthread_rwlock_unlock(&frame->latch);
+
+        // Still pinned, so the frame cannot be evicted before it is marked
+        if (dirty && frame->owner->log && !frame->unlogged)
+            log_track(frame->owner, frame);
+        pool_unpin(page->pool, frame, dirty);
+    }
+    free(page->copy);
+    page->copy = NULL;
+    page->frame = NULL;
+    page->data = NULL;
+}
+
+/**
+ * Hint that a block will be read soon. Sequential leaf walks use this to
+ * start reading the next leaf while the current one is being consumed.
+ */
+static void page_prefetch(BTree *tree, uint64_t block_id)
+{
+    size_t block_size = tree->header.block_size;
+    if (block_id == 0)
+        return;
+
+    if (tree->map)
+    {
+        size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+        size_t start = (size_t)block_id * block_size;
+        if (start + block_size > tree->map_size)
+            return;
+
+        size_t aligned = start - start % page_size;
+        posix_madvise(tree->map + aligned, start + block_size - aligned, POSIX_MADV_WILLNEED);
+    }
+    else
+    {
+        pthread_mutex_lock(&tree->pool->lock);
+        int cached = pool_lookup(tree->pool, tree->base ? tree->base : tree, block_id) != NULL;
+        pthread_mutex_unlock(&tree->pool->lock);
+        if (cached)
+            return;
+
+        posix_fadvise(fileno(tree->fp), (off_t)(block_id * block_size), (off_t)block_size,
+                      POSIX_FADV_WILLNEED);
+    }
+}
+
+/**
+ * Block allocation. A new node takes the head of the free list when there is
+ * one and grows the file otherwise. Either way the header changes, and it
+ * goes out with the next sync after the blocks that depend on it.
+ */
+static uint64_t allocate_block(BTree *tree)
+{
+    uint64_t block_id = tree->header.free_block_id;
+    if (block_id == 0)
+    {
+        block_id = tree->header.next_block_id++;
+    }
+    else
+    {
+        PageRef page;
+        if (page_get(tree, block_id, 1, PAGE_READ, &page) != 0)
+            return 0;
+        tree->header.free_block_id = swap_word(tree->swap_words, ((const uint64_t *)page.data)[1]);
+        page_put(&page, 0);
+    }
+    tree->header_dirty = 1;
+    return block_id;
+}
+
+/**
+ * Give up a block no node of the tree uses any more. An append-only file
+ * leaves it dead until the file is compacted, and a block that open
+ * snapshots may still read waits for them to close.
+ */
+static int release_block(BTree *tree, uint64_t block_id)
+{
+    if (tree->read_only)
+        return -1;
+    if (is_append_only(tree))
+        return 0;
+    if (is_committed(tree, block_id))
+        return retire_block(tree, block_id);
+    return free_block(tree, block_id);
+}
+
+// Put a block no node uses any more at the head of the free list
+static int free_block(BTree *tree, uint64_t block_id)
+{
+    PageRef page;
+    if (page_get(tree, block_id, 0, PAGE_WRITE, &page) != 0)
+        return -1;
+    unsigned char *image = page_image(tree, &page);
+    memset(image, 0, tree->header.block_size);
+    ((uint64_t *)image)[1] = swap_word(tree->swap_words, tree->header.free_block_id);
+    page_publish(tree, &page, image);
+    page_put(&page, 1);
+
+    tree->header.free_block_id = block_id;
+    tree->header_dirty = 1;
+    return 0;
+}
+
+// Block I/O operations. Positioned reads and writes leave the stdio file
+// offset alone, so threads that miss in the pool can read concurrently.
+static int write_block(BTree *tree, uint64_t block_id, const void *buf)
+{
+    size_t block_size = tree->header.block_size;
+
+    if (tree->map)
+    {
+        if (tree->read_only || map_ensure(tree, block_id) != 0)
+            return -1;
+        memcpy(tree->map + block_id * block_size, buf, block_size);
+        return 0;
+    }
+
+    if (pwrite(fileno(tree->fp), buf, block_size, (off_t)(block_id * block_size)) != (ssize_t)block_size)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+static int read_block(BTree *tree, uint64_t block_id, void *buf)
+{
+    size_t block_size = tree->header.block_size;
+
+    if (tree->map)
+    {
+        if (map_ensure(tree, block_id) != 0)
+            return -1;
+        memcpy(buf, tree->map + block_id * block_size, block_size);
+        return 0;
+    }
+
+    if (pread(fileno(tree->fp), buf, block_size, (off_t)(block_id * block_size)) != (ssize_t)block_size)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Keys per node for a block size. A classic node (3 header words, the keys,
+ * the values and one more child than keys) keeps 2t - 1 keys for the largest
+ * minimal degree t that fits; a 512-byte block gives the original 19. A B+
+ * leaf (4 header words, the keys, the values and two sibling links) is the
+ * larger B+ node, and gives 28. Both leave the last word of the block spare
+ * for the block's LSN (see the write-ahead log). Compressed nodes have no
+ * fixed arrays; see compressed_keys_for_block_size().
+ */
+static uint64_t keys_for_block_size(uint64_t block_size, uint64_t flags)
+{
+    uint64_t words = block_size / sizeof(uint64_t);
+    if (flags & BTREE_FLAG_COMPRESSED)
+        return compressed_keys_for_block_size(block_size);
+    if (flags & BTREE_FLAG_BPLUS)
+        return (words - 7) / 2;
+
+    uint64_t keys = (words - 4) / 3;
+    return keys % 2 == 0 ? keys - 1 : keys;
+}
+
+static int valid_block_size(uint64_t block_size)
+{
+    return block_size >= BTREE_MIN_BLOCK_SIZE && block_size <= BTREE_MAX_BLOCK_SIZE &&
+           (block_size & (block_size - 1)) == 0;
+}
+
+uint64_t btree_keys_per_node(uint64_t block_size, uint64_t flags)
+{
+    return valid_block_size(block_size) ? keys_for_block_size(block_size, flags) : 0;
+}
+
+// Header I/O operations
+static void encode_header(const BTree *tree, unsigned char *block)
+{
+    memset(block, 0, tree->header.block_size);
+    memcpy(block, tree->header.magic, 8);
+
+    // Header fields stay big-endian in every format version
+    uint64_t *fields = (uint64_t *)(block + 8);
+    fields[0] = to_big_endian(tree->header.root_block_id);
+    fields[1] = to_big_endian(tree->header.next_block_id);
+    fields[2] = to_big_endian(tree->header.format_version);
+    fields[3] = to_big_endian(tree->header.flags);
+    fields[4] = to_big_endian(tree->header.block_size);
+    fields[5] = to_big_endian(tree->header.max_keys);
+    fields[6] = to_big_endian(tree->header.free_block_id);
+    fields[7] = to_big_endian(tree->header.checkpoint_lsn);
+}
+
+static int write_header(BTree *tree)
+{
+    unsigned char *block = (unsigned char *)malloc(tree->header.block_size);
+    if (!block)
+        return -1;
+    encode_header(tree, block);
+
+    int result = write_block(tree, 0, block);
+    free(block);
+    return result;
+}
+
+static int read_header(BTree *tree)
+{
+    // Every header fits in the smallest block; read that much to learn the real size
+    uint64_t block[BTREE_MIN_BLOCK_SIZE / sizeof(uint64_t)];
+    tree->header.block_size = BTREE_MIN_BLOCK_SIZE;
+    if (read_block(tree, 0, block) != 0)
+    {
+        return -1;
+    }
+
+    memcpy(tree->header.magic, block, 8);
+    uint64_t *fields = block + 1;
+    tree->header.root_block_id = from_big_endian(fields[0]);
+    tree->header.next_block_id = from_big_endian(fields[1]);
+    tree->header.format_version = from_big_endian(fields[2]);
+    tree->header.flags = from_big_endian(fields[3]);
+    tree->header.block_size = from_big_endian(fields[4]);
+    tree->header.max_keys = from_big_endian(fields[5]);
+    tree->header.free_block_id = from_big_endian(fields[6]);
+    tree->header.checkpoint_lsn = from_big_endian(fields[7]);
+
+    // Files written before these fields existed have zeros there
+    if (tree->header.format_version == 0)
+        tree->header.format_version = BTREE_FORMAT_V1;
+    if (tree->header.block_size == 0)
+        tree->header.block_size = BLOCK_SIZE;
+    if (tree->header.max_keys == 0)
+        tree->header.max_keys = MAX_KEYS;
+    tree->swap_words = format_swaps(tree->header.format_version);
+
+    if (!valid_block_size(tree->header.block_size) ||
+        tree->header.max_keys < 3 ||
+        tree->header.max_keys > keys_for_block_size(tree->header.block_size, tree->header.flags))
+    {
+        return -1;
+    }
+
+    // Compressed nodes are B+ nodes written in place
+    if (is_compressed(tree) &&
+        (!is_bplus(tree) || is_append_only(tree) || compressed_min_keys(tree) == 0))
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Node encoding: pack a node into its on-disk block image and back.
+ * Format v1 stores every word big-endian; v2 stores them little-endian, which
+ * is a plain copy on x86. The key, value and child arrays are sized by the
+ * tree's max_keys, so their offsets depend on the block size.
+ *
+ * Classic layout: block id, parent, key count, keys, values, children.
+ * B+ layout: block id, parent, key count, leaf flag, keys, then values and
+ * the previous/next leaf links in a leaf or children in an interior node.
+ * Compressed trees have their own encoding (see "Compressed nodes"), which
+ * can fail: encoding when a node does not fit, decoding a malformed block.
+ */
+static int encode_node(const BTree *tree, const BTreeNode *node, unsigned char *block)
+{
+    if (is_compressed(tree))
+        return encode_compressed(tree, node, block);
+
+    int swap = tree->swap_words;
+    uint64_t max_keys = tree->header.max_keys;
+    uint64_t *fields = (uint64_t *)block;
+    memset(block, 0, tree->header.block_size);
+
+    fields[0] = swap_word(swap, node->block_id);
+    fields[1] = swap_word(swap, node->parent_block_id);
+    fields[2] = swap_word(swap, node->num_keys);
+
+    if (is_bplus(tree))
+    {
+        int leaf = node->children[0] == 0;
+        uint64_t *keys = fields + 4;
+        uint64_t *rest = keys + max_keys;
+
+        fields[3] = swap_word(swap, leaf);
+        for (uint64_t i = 0; i < max_keys; i++)
+        {
+            keys[i] = swap_word(swap, node->keys[i]);
+        }
+        if (leaf)
+        {
+            for (uint64_t i = 0; i < max_keys; i++)
+            {
+                rest[i] = swap_word(swap, node->values[i]);
+            }
+            rest[max_keys] = swap_word(swap, node->prev_leaf);
+            rest[max_keys + 1] = swap_word(swap, node->next_leaf);
+        }
+        else
+        {
+            for (uint64_t i = 0; i <= max_keys; i++)
+            {
+                rest[i] = swap_word(swap, node->children[i]);
+            }
+        }
+        return 0;
+    }
+
+    for (uint64_t i = 0; i < max_keys; i++)
+    {
+        fields[3 + i] = swap_word(swap, node->keys[i]);
+        fields[3 + max_keys + i] = swap_word(swap, node->values[i]);
+    }
+
+    for (uint64_t i = 0; i <= max_keys; i++)
+    {
+        fields[3 + 2 * max_keys + i] = swap_word(swap, node->children[i]);
+    }
+    return 0;
+}
+
+static int decode_node(const BTree *tree, const unsigned char *block, BTreeNode *node)
+{
+    if (is_compressed(tree))
+        return decode_compressed(tree, block, node);
+
+    int swap = tree->swap_words;
+    uint64_t max_keys = tree->header.max_keys;
+    const uint64_t *fields = (const uint64_t *)block;
+    node->block_id = swap_word(swap, fields[0]);
+    node->parent_block_id = swap_word(swap, fields[1]);
+    node->num_keys = swap_word(swap, fields[2]);
+    node->prev_leaf = 0;
+    node->next_leaf = 0;
+
+    if (is_bplus(tree))
+    {
+        int leaf = swap_word(swap, fields[3]) != 0;
+        const uint64_t *keys = fields + 4;
+        const uint64_t *rest = keys + max_keys;
+
+        for (uint64_t i = 0; i < max_keys; i++)
+        {
+            node->keys[i] = swap_word(swap, keys[i]);
+            node->values[i] = leaf ? swap_word(swap, rest[i]) : 0;
+        }
+        for (uint64_t i = 0; i <= max_keys; i++)
+        {
+            node->children[i] = leaf ? 0 : swap_word(swap, rest[i]);
+        }
+        if (leaf)
+        {
+            node->prev_leaf = swap_word(swap, rest[max_keys]);
+            node->next_leaf = swap_word(swap, rest[max_keys + 1]);
+        }
+        return 0;
+    }
+
+    for (uint64_t i = 0; i < max_keys; i++)
+    {
+        node->keys[i] = swap_word(swap, fields[3 + i]);
+        node->values[i] = swap_word(swap, fields[3 + max_keys + i]);
+    }
+
+    for (uint64_t i = 0; i <= max_keys; i++)
+    {
+        node->children[i] = swap_word(swap, fields[3 + 2 * max_keys + i]);
+    }
+    return 0;
+}
+
+// Node I/O operations
+static int write_node(BTree *tree, BTreeNode *node)
+{
+    if (tree->read_only)
+    {
+        return -1;
+    }
+
+    // Refuse a compressed node that outgrew its block before touching the page
+    if (is_compressed(tree) && packed_node_size(node) > packed_room(tree))
+    {
+        return -1;
+    }
+
+    // The whole block is rewritten, so a miss does not need to read it first
+    PageRef page;
+    if (page_get(tree, node->block_id, 0, PAGE_WRITE, &page) != 0)
+    {
+        return -1;
+    }
+
+    unsigned char *image = page_image(tree, &page);
+    encode_node(tree, node, image);
+    page_publish(tree, &page, image);
+
+    // Leave it to the pool (or the kernel, when mapped) to write the block back
+    page_put(&page, 1);
+    return 0;
+}
+
+int read_node(BTree *tree, uint64_t block_id, BTreeNode *node)
+{
+    PageRef page;
+    if (page_get(tree, block_id, 1, PAGE_READ, &page) != 0)
+    {
+        return -1;
+    }
+
+    int result = decode_node(tree, page.data, node);
+
+    page_put(&page, 0);
+    return result;
+}
+
+/**
+ * Node views
+ * ----------
+ * A NodeView reads fields lazily from a node's raw block (a pinned pool frame
+ * or a mapped page) instead of decoding the whole block into a BTreeNode. A
+ * descent then only decodes the keys its binary search touches plus a single
+ * child pointer. A view keeps its page pinned until view_close().
+ *
+ * A compressed node's keys can only be read in order, so its view decodes
+ * them all on open and reads values and children from the block as usual.
+ */
+typedef struct
+{
+    PageRef page;
+    const uint64_t *keys;          // Raw key array, or the decoded keys of a compressed node
+    const unsigned char *values;   // Value words (leaves only in the B+ layout)
+    const unsigned char *children; // Child words or packed child IDs (unused in B+ leaves)
+    const unsigned char *links;    // B+ leaves: previous and next leaf; NULL otherwise
+    uint64_t *decoded;             // Compressed nodes: keys decoded on open, freed on close
+    uint64_t num_keys;
+    uint64_t key_bytes;  // Compressed nodes: length of the key section
+    unsigned child_bits; // Compressed nodes: bits per child ID
+    int packed;          // 1 for a compressed node
+    int leaf;
+    int bplus;     // Interior keys are separators, and only leaves hold pairs
+    int swap;      // Byte-swap keys on access (format v1 on a little-endian host)
+    int word_swap; // Byte-swap value, child and link words
+    int racing;    // Fixed layout read optimistically: the writer may change it meanwhile
+} NodeView;
+
+// An aligned word of a fixed-layout node; optimistic readers share it with the writer
+static uint64_t view_word(const uint64_t *word)
+{
+    return __atomic_load_n(word, __ATOMIC_RELAXED);
+}
+
+// A value, child or link word, in the format's byte order
+static uint64_t view_load(const NodeView *view, const unsigned char *p)
+{
+    if (view->packed)
+        return load_word(view->word_swap, p);
+    return swap_word(view->word_swap, view_word((const uint64_t *)p));
+}
+
+// Decode a compressed node's keys into the view
+static int view_open_packed(BTree *tree, NodeView *view)
+{
+    PackedNode packed;
+    if (packed_parse(tree, view->page.data, &packed) != 0)
+        return -1;
+
+    view->decoded = (uint64_t *)malloc((packed.num_keys + 1) * sizeof(uint64_t));
+    if (!view->decoded || packed_keys(&packed, view->word_swap, view->decoded) != 0)
+    {
+        free(view->decoded);
+        view->decoded = NULL;
+        return -1;
+    }
+
+    view->packed = 1;
+    view->swap = 0;
+    view->keys = view->decoded;
+    view->num_keys = packed.num_keys;
+    view->key_bytes = packed.key_bytes;
+    view->child_bits = packed.bits;
+    view->leaf = packed.leaf;
+    view->values = packed.values;
+    view->children = packed.children;
+    view->links = packed.leaf ? packed.values + packed.num_keys * sizeof(uint64_t) : NULL;
+    return 0;
+}
+
+static int view_open_mode(BTree *tree, uint64_t block_id, int mode, NodeView *view)
+{
+    if (page_get(tree, block_id, 1, mode, &view->page) != 0)
+        return -1;
+
+    const uint64_t *fields = (const uint64_t *)view->page.data;
+    const unsigned char *data = view->page.data;
+    uint64_t max_keys = tree->header.max_keys;
+    view->swap = tree->swap_words;
+    view->word_swap = tree->swap_words;
+    view->bplus = is_bplus(tree);
+    view->decoded = NULL;
+    view->packed = 0;
+    view->racing = 0;
+    if (is_compressed(tree))
+    {
+        if (view_open_packed(tree, view) != 0)
+        {
+            page_put(&view->page, 0);
+            return -1; // Corrupt block, or one changing under an optimistic reader
+        }
+        return 0;
+    }
+
+    view->racing = mode == PAGE_OPTIMISTIC && view->page.frame;
+    view->num_keys = swap_word(view->swap, view_word(&fields[2]));
+    if (view->num_keys > max_keys)
+    {
+        page_put(&view->page, 0);
+        return -1; // Corrupt block; never index past the key array
+    }
+
+    if (view->bplus)
+    {
+        view->leaf = view_word(&fields[3]) != 0;
+        view->keys = fields + 4;
+        view->values = data + (4 + max_keys) * sizeof(uint64_t);
+        view->children = view->values;
+        view->links = view->leaf ? view->values + max_keys * sizeof(uint64_t) : NULL;
+    }
+    else
+    {
+        view->keys = fields + 3;
+        view->values = data + (3 + max_keys) * sizeof(uint64_t);
+        view->children = view->values + max_keys * sizeof(uint64_t);
+        view->links = NULL;
+        view->leaf = view_load(view, view->children) == 0;
+    }
+    return 0;
+}
+
+static int view_open(BTree *tree, uint64_t block_id, NodeView *view)
+{
+    return view_open_mode(tree, block_id, PAGE_READ, view);
+}
+
+static void view_close(NodeView *view)
+{
+    page_put(&view->page, 0);
+    free(view->decoded);
+    view->decoded = NULL;
+}
+
+static uint64_t view_key(const NodeView *view, uint64_t i)
+{
+    return swap_word(view->swap, view_word(&view->keys[i]));
+}
+
+static uint64_t view_value(const NodeView *view, uint64_t i)
+{
+    return view_load(view, view->values + i * sizeof(uint64_t));
+}
+
+static uint64_t view_child(const NodeView *view, uint64_t i)
+{
+    if (view->packed)
+        return unpack_bits(view->children, i, view->child_bits);
+    return view_load(view, view->children + i * sizeof(uint64_t));
+}
+
+static int view_is_leaf(const NodeView *view)
+{
+    return view->leaf;
+}
+
+// Neighbouring leaves in key order; 0 at either end and outside B+ leaves
+static uint64_t view_prev_leaf(const NodeView *view)
+{
+    return view->links ? view_load(view, view->links) : 0;
+}
+
+static uint64_t view_next_leaf(const NodeView *view)
+{
+    return view->links ? view_load(view, view->links + sizeof(uint64_t)) : 0;
+}
+
+/**
+ * Binary search for keys the writer may be changing, one relaxed load per
+ * probe; the key search kernels read the array with plain loads. With
+ * `upper`, keys equal to key count as smaller.
+ */
+static uint64_t view_racing_bound(const NodeView *view, uint64_t key, int upper)
+{
+    uint64_t lo = 0, hi = view->num_keys;
+    while (lo < hi)
+    {
+        uint64_t mid = lo + (hi - lo) / 2;
+        uint64_t probe = view_key(view, mid);
+        if (probe < key || (upper && probe == key))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// Index of the first key >= key (num_keys if there is none)
+static uint64_t view_lower_bound(const NodeView *view, uint64_t key)
+{
+    if (view->racing)
+        return view_racing_bound(view, key, 0);
+    return keysearch_lower_bound(view->keys, view->num_keys, key, view->swap);
+}
+
+// Child of a B+ interior node that covers key: separators equal to key route right
+static uint64_t view_route(const NodeView *view, uint64_t key)
+{
+    if (view->racing)
+        return view_child(view, view_racing_bound(view, key, 1));
+    return view_child(view, keysearch_upper_bound(view->keys, view->num_keys, key, view->swap));
+}
+
+/**
+ * Copy an interior node's child pointers out of its view and release it. The
+ * recursive walks drop each view before descending, so a deep tree never
+ * needs more pinned frames than a small pool has. Free the array afterwards.
+ */
+static int view_take_children(NodeView *view, uint64_t **children, uint64_t *num_children)
+{
+    *children = NULL;
+    *num_children = 0;
+    if (view_is_leaf(view))
+    {
+        view_close(view);
+        return 0;
+    }
+
+    *children = (uint64_t *)malloc((view->num_keys + 1) * sizeof(uint64_t));
+    if (*children)
+    {
+        *num_children = view->num_keys + 1;
+        for (uint64_t i = 0; i < *num_children; i++)
+        {
+            (*children)[i] = view_child(view, i);
+        }
+    }
+    view_close(view);
+    return *children ? 0 : -1;
+}
+
+// Search with latch crabbing
+static int search_latched(BTree *tree, uint64_t key, uint64_t *value)
+{
+    // Latch the root before letting go of the root pointer
+    NodeView view;
+    pthread_rwlock_rdlock(&tree->root_latch);
+    uint64_t root = __atomic_load_n(&tree->header.root_block_id, __ATOMIC_RELAXED);
+    int result = root != 0 ? view_open(tree, root, &view) : -1;
+    pthread_rwlock_unlock(&tree->root_latch);
+    if (result != 0)
+    {
+        return -1;
+    }
+
+    for (;;)
+    {
+        uint64_t child;
+        if (view.bplus && !view_is_leaf(&view))
+        {
+            child = view_route(&view, key);
+        }
+        else
+        {
+            uint64_t i = view_lower_bound(&view, key);
+            if (i < view.num_keys && view_key(&view, i) == key)
+            {
+                *value = view_value(&view, i);
+                view_close(&view);
+                return 0;
+            }
+            if (view_is_leaf(&view))
+            {
+                view_close(&view);
+                return -1; // Key not found
+            }
+            child = view_child(&view, i);
+        }
+
+        // Crab: latch the child before releasing its parent
+        NodeView child_view;
+        result = view_open(tree, child, &child_view);
+        view_close(&view);
+        if (result != 0)
+        {
+            return -1;
+        }
+        view = child_view;
+    }
+}
+
+/**
+ * Optimistic lock coupling: descend with pinned but unlatched pages. A child
+ * pointer is used only after its parent validates, and the parent is
+ * validated again once the child's version has been read, so a split that
+ * lands in between sends the reader back to the root. Returns 0 or -1 like
+ * search_key(), or 1 when the descent has to restart.
+ */
+static int search_optimistic(BTree *tree, uint64_t key, uint64_t *value)
+{
+    uint64_t root = __atomic_load_n(&tree->header.root_block_id, __ATOMIC_ACQUIRE);
+    if (root == 0)
+        return -1;
+
+    NodeView view;
+    if (view_open_mode(tree, root, PAGE_OPTIMISTIC, &view) != 0)
+        return 1;
+    if (__atomic_load_n(&tree->header.root_block_id, __ATOMIC_ACQUIRE) != root)
+    {
+        view_close(&view);
+        return 1;
+    }
+
+    for (;;)
+    {
+        uint64_t child;
+        if (view.bplus && !view_is_leaf(&view))
+        {
+            child = view_route(&view, key);
+        }
+        else
+        {
+            uint64_t i = view_lower_bound(&view, key);
+            int hit = i < view.num_keys && view_key(&view, i) == key;
+            uint64_t found = hit ? view_value(&view, i) : 0;
+            int leaf = view_is_leaf(&view);
+            child = hit || leaf ? 0 : view_child(&view, i);
+
+            if (hit || leaf)
+            {
+                int valid = page_validate(&view.page);
+                view_close(&view);
+                if (!valid)
+                    return 1;
+                if (!hit)
+                    return -1; // Key not found
+                *value = found;
+                return 0;
+            }
+        }
+
+        if (!page_validate(&view.page))
+        {
+            view_close(&view);
+            return 1;
+        }
+
+        NodeView child_view;
+        if (view_open_mode(tree, child, PAGE_OPTIMISTIC, &child_view) != 0)
+        {
+            view_close(&view);
+            return 1;
+        }
+        int valid = page_validate(&view.page);
+        view_close(&view);
+        if (!valid)
+        {
+            view_close(&child_view);
+            return 1;
+        }
+        view = child_view;
+    }
+}
+
+// Search function
+int search_key(BTree *tree, uint64_t key, uint64_t *value)
+{
+    if (!tree->is_open)
+    {
+        return -1;
+    }
+
+    // Mapped pages have no versions; a reader that keeps losing to the
+    // writer falls back to latching
+    if (tree->read_mode == BTREE_READS_OPTIMISTIC && !tree->map)
+    {
+        for (int attempt = 0; attempt < OPTIMISTIC_RETRIES; attempt++)
+        {
+            int result = search_optimistic(tree, key, value);
+            if (result != 1)
+                return result;
+        }
+    }
+    return search_latched(tree, key, value);
+}
+
+/**
+ * Keyed writes
+ * ------------
+ * insert_key(), insert_if_absent() and upsert_key() look the key up first
+ * with a plain descent. A key that is already there is left alone or has
+ * its value replaced where it lies, so replaying pairs the tree already
+ * holds never splits a node or grows the file. A new key whose leaf has
+ * room goes straight into that leaf. Only a full leaf sends the insert
+ * down again through insert_unsynced(), which splits full nodes.
+ */
+#define PUT_IF_ABSENT 0 // Leave an existing pair alone
+#define PUT_UPSERT 1    // Replace an existing pair's value
+
+typedef struct
+{
+    uint64_t block_id; // Node holding the key, or the leaf a new key goes in
+    uint64_t index;    // Position of the key in that node, when found
+    int found;
+    int leaf_full;     // The leaf has no room for a new key
+} KeyLocation;
+
+// Find the key, or the leaf it belongs in. The caller holds writer_lock.
+static int locate_key(BTree *tree, uint64_t key, KeyLocation *loc)
+{
+    uint64_t block_id = tree->header.root_block_id;
+    for (;;)
+    {
+        NodeView view;
+        if (view_open(tree, block_id, &view) != 0)
+            return -1;
+
+        uint64_t i = view_lower_bound(&view, key);
+        int leaf = view_is_leaf(&view);
+        loc->block_id = block_id;
+        loc->index = i;
+        loc->found = i < view.num_keys && view_key(&view, i) == key && (leaf || !view.bplus);
+        loc->leaf_full = leaf && (view.packed ? packed_full(tree, 1, view.num_keys, view.key_bytes, 0)
+                                              : view.num_keys >= tree->header.max_keys);
+        if (loc->found || leaf)
+        {
+            view_close(&view);
+            return 0;
+        }
+
+        block_id = view.bplus ? view_route(&view, key) : view_child(&view, i);
+        view_close(&view);
+    }
+}
+
+// Returns 0 once the pair is in the tree, or 1 if PUT_IF_ABSENT found the key
+static int put_unsynced(BTree *tree, uint64_t key, uint64_t value, int mode)
+{
+    if (tree->header.root_block_id == 0)
+        return insert_unsynced(tree, key, value);
+
+    KeyLocation loc;
+    if (locate_key(tree, key, &loc) != 0)
+        return -1;
+    if (loc.found && mode == PUT_IF_ABSENT)
+        return 1;
+    if (!loc.found && loc.leaf_full)
+        return insert_unsynced(tree, key, value);
+
+    BTreeNode *node = alloc_node(tree);
+    int result = -1;
+    if (node && read_node(tree, loc.block_id, node) == 0)
+    {
+        if (loc.found && node->values[loc.index] == value)
+        {
+            result = 0; // Nothing to write
+        }
+        else if (writes_shadow(tree) && shadow_path(tree, key, &node) != 0)
+        {
+            result = -1;
+        }
+        else if (!loc.found)
+        {
+            result = insert_nonfull(tree, node, key, value);
+            if (result == WRITE_RESTART)
+                result = insert_unsynced(tree, key, value);
+        }
+        else
+        {
+            node->values[loc.index] = value;
+            result = write_node(tree, node);
+        }
+    }
+    free_node(node);
+    return result;
+}
+
+static int put_key(BTree *tree, uint64_t key, uint64_t value, int mode)
+{
+    if (!tree->is_open || tree->read_only)
+        return -1;
+
+    pthread_mutex_lock(&tree->writer_lock);
+    int result = put_unsynced(tree, key, value, mode);
+    if (result == 0)
+    {
+        result = commit_write(tree);
+    }
+    else if (result < 0 && tree->log)
+    {
+        log_rollback(tree);
+    }
+    writer_unlock(tree);
+    return result;
+}
+
+// Main insert function; fails if the key is already in the tree
+int insert_key(BTree *tree, uint64_t key, uint64_t value)
+{
+    return put_key(tree, key, value, PUT_IF_ABSENT) == 0 ? 0 : -1;
+}
+
+// Insert unless the key is present: 0 if inserted, 1 if it was already there
+int insert_if_absent(BTree *tree, uint64_t key, uint64_t value)
+{
+    return put_key(tree, key, value, PUT_IF_ABSENT);
+}
+
+// Insert the pair, or give an existing key the new value
+int upsert_key(BTree *tree, uint64_t key, uint64_t value)
+{
+    return put_key(tree, key, value, PUT_UPSERT);
+}
+
+/**
+ * Deletion
+ * --------
+ * delete_key() walks down from the root once and never backs up. Before it
+ * descends into a child holding min_keys() keys or fewer, it tops the child
+ * up: it borrows a key through the parent from a sibling with keys to spare,
+ * or else merges the child with a sibling. The pair can then be taken out of
+ * its leaf without the leaf underflowing. The root is the exception; when
+ * it runs out of keys its only child becomes the root, or the tree empties.
+ *
+ * A classic interior node holding the key swaps in the largest pair of the
+ * subtree on its left (or the smallest on its right) and deletes that pair
+ * further down instead. When both neighbouring children are at the minimum
+ * they are merged around the key, and the deletion goes on in the merged node.
+ *
+ * Writes follow the order a split uses: the node gaining keys first, then
+ * the parent, then the node losing them, so a reader crabbing down at the
+ * same time finds every key that is not being deleted. A node merged away
+ * goes on the free list once nothing points at it.
+ */
+#define DELETE_KEY 0 // The pair with the given key
+#define DELETE_MIN 1 // The subtree's smallest pair
+#define DELETE_MAX 2 // The subtree's largest pair
+
+// Remove key i and child child_index from a node's arrays
+static void node_remove(BTreeNode *node, uint64_t i, uint64_t child_index)
+{
+    uint64_t n = node->num_keys;
+    memmove(&node->keys[i], &node->keys[i + 1], (n - i - 1) * sizeof(uint64_t));
+    memmove(&node->values[i], &node->values[i + 1], (n - i - 1) * sizeof(uint64_t));
+    memmove(&node->children[child_index], &node->children[child_index + 1],
+            (n - child_index) * sizeof(uint64_t));
+    node->keys[n - 1] = 0;
+    node->values[n - 1] = 0;
+    node->children[n] = 0;
+    node->num_keys--;
+}
+
+// Insert a key and the child left of it at the front of a node's arrays
+static void node_prepend(BTreeNode *node, uint64_t key, uint64_t value, uint64_t child)
+{
+    uint64_t n = node->num_keys;
+    memmove(&node->keys[1], &node->keys[0], n * sizeof(uint64_t));
+    memmove(&node->values[1], &node->values[0], n * sizeof(uint64_t));
+    memmove(&node->children[1], &node->children[0], (n + 1) * sizeof(uint64_t));
+    node->keys[0] = key;
+    node->values[0] = value;
+    node->children[0] = child;
+    node->num_keys++;
+}
+
+/**
+ * Rotate the last key of child i - 1 into child i. A B+ leaf takes the pair
+ * itself and its first key becomes the new separator; otherwise the
+ * separator comes down and the sibling's last key goes up in its place.
+ */
+static void borrow_from_left(BTree *tree, BTreeNode *parent, uint64_t i, BTreeNode *left,
+                             BTreeNode *child)
+{
+    uint64_t last = left->num_keys - 1;
+    if (is_bplus(tree) && is_leaf(child))
+    {
+        node_prepend(child, left->keys[last], left->values[last], 0);
+        parent->keys[i - 1] = child->keys[0];
+    }
+    else
+    {
+        node_prepend(child, parent->keys[i - 1], parent->values[i - 1], left->children[last + 1]);
+        parent->keys[i - 1] = left->keys[last];
+        parent->values[i - 1] = left->values[last];
+    }
+    node_remove(left, last, last + 1);
+}
+
+// Rotate the first key of child i + 1 into child i
+static void borrow_from_right(BTree *tree, BTreeNode *parent, uint64_t i, BTreeNode *child,
+                              BTreeNode *right)
+{
+    uint64_t n = child->num_keys;
+    if (is_bplus(tree) && is_leaf(child))
+    {
+        child->keys[n] = right->keys[0];
+        child->values[n] = right->values[0];
+        child->num_keys++;
+        node_remove(right, 0, 0);
+        parent->keys[i] = right->keys[0];
+    }
+    else
+    {
+        child->keys[n] = parent->keys[i];
+        child->values[n] = parent->values[i];
+        child->children[n + 1] = right->children[0];
+        child->num_keys++;
+        parent->keys[i] = right->keys[0];
+        parent->values[i] = right->values[0];
+        node_remove(right, 0, 0);
+    }
+}
+
+/**
+ * Merge children i and i + 1 of parent into the left one, with separator i
+ * between them (a B+ leaf drops the separator), and write the result. The
+ * right node is unlinked from the leaf chain and freed last.
+ */
+static int merge_children(BTree *tree, BTreeNode *parent, uint64_t i, BTreeNode *left,
+                          BTreeNode *right)
+{
+    int bplus_leaf = is_bplus(tree) && is_leaf(left);
+    uint64_t n = left->num_keys;
+    if (!bplus_leaf)
+    {
+        left->keys[n] = parent->keys[i];
+        left->values[n] = parent->values[i];
+        n++;
+    }
+    memcpy(&left->keys[n], right->keys, right->num_keys * sizeof(uint64_t));
+    memcpy(&left->values[n], right->values, right->num_keys * sizeof(uint64_t));
+    memcpy(&left->children[n], right->children, (right->num_keys + 1) * sizeof(uint64_t));
+    left->num_keys = n + right->num_keys;
+    if (bplus_leaf)
+        left->next_leaf = right->next_leaf;
+    node_remove(parent, i, i + 1);
+
+    if (write_node(tree, left) != 0)
+        return -1;
+
+    if (bplus_leaf && left->next_leaf != 0)
+    {
+        BTreeNode *next = alloc_node(tree);
+        int result = next && read_node(tree, left->next_leaf, next) == 0 ? 0 : -1;
+        if (result == 0)
+        {
+            next->prev_leaf = left->block_id;
+            result = write_node(tree, next);
+        }
+        free_node(next);
+        if (result != 0)
+            return -1;
+    }
+
+    if (write_node(tree, parent) != 0)
+        return -1;
+    return release_block(tree, right->block_id);
+}
+
+/**
+ * Top up child *index of parent, which holds min_keys() keys or fewer,
+ * before the deletion descends into it. Afterwards *child is the node to
+ * descend into and *index its position; both move one to the left when the
+ * last child is merged into its left sibling.
+ */
+static int fix_child(BTree *tree, BTreeNode *parent, uint64_t *index, BTreeNode **child)
+{
+    uint64_t i = *index;
+    uint64_t min = min_keys(tree);
+    BTreeNode *left = NULL;
+    BTreeNode *right = NULL;
+    int result = -1;
+
+    if (i > 0)
+    {
+        left = alloc_node(tree);
+        if (!left || read_node(tree, parent->children[i - 1], left) != 0)
+            goto done;
+        if (left->num_keys > min)
+        {
+            if (shadow_child(tree, parent, i - 1, left) != 0)
+                goto done;
+            borrow_from_left(tree, parent, i, left, *child);
+            result = write_node(tree, *child) == 0 && write_node(tree, parent) == 0 &&
+                             write_node(tree, left) == 0
+                         ? 0
+                         : -1;
+            goto done;
+        }
+    }
+
+    if (i < parent->num_keys)
+    {
+        right = alloc_node(tree);
+        if (!right || read_node(tree, parent->children[i + 1], right) != 0)
+            goto done;
+        if (right->num_keys > min)
+        {
+            if (shadow_child(tree, parent, i + 1, right) != 0)
+                goto done;
+            borrow_from_right(tree, parent, i, *child, right);
+            result = write_node(tree, *child) == 0 && write_node(tree, parent) == 0 &&
+                             write_node(tree, right) == 0
+                         ? 0
+                         : -1;
+        }
+        else
+        {
+            result = merge_children(tree, parent, i, *child, right);
+        }
+        goto done;
+    }
+
+    // The last child merges into its left sibling
+    if (!left || shadow_child(tree, parent, i - 1, left) != 0)
+        goto done;
+    result = merge_children(tree, parent, i - 1, left, *child);
+    BTreeNode *merged = left;
+    left = *child;
+    *child = merged;
+    *index = i - 1;
+
+done:
+    free_node(left);
+    free_node(right);
+    return result;
+}
+
+/**
+ * Compressed trees: split child *index of parent before the deletion
+ * descends into it if it is full, since a rebalance below may rewrite one
+ * of its separators. *child becomes the half key belongs in, topped up if
+ * it is at the minimum. Returns WRITE_RESTART when that half is full as
+ * well, so the parent would need a second split it may have no room for.
+ */
+static int make_room(BTree *tree, BTreeNode *parent, uint64_t *index, BTreeNode **child, uint64_t key)
+{
+    if (!is_compressed(tree) || !node_full(tree, *child))
+        return 0;
+
+    BTreeNode *right = alloc_node(tree);
+    int result = right ? split_child(tree, parent, (int)*index, *child, right) : -1;
+    if (result == 0 && goes_right(tree, key, parent->keys[*index]))
+    {
+        BTreeNode *swap = *child;
+        *child = right;
+        right = swap;
+        (*index)++;
+    }
+    free_node(right);
+
+    if (result != 0)
+        return result;
+    if ((*child)->num_keys <= min_keys(tree))
+        return fix_child(tree, parent, index, child);
+    return node_full(tree, *child) ? WRITE_RESTART : 0;
+}
+
+// Leftmost or rightmost pair of the subtree under block_id
+static int subtree_edge(BTree *tree, uint64_t block_id, int rightmost, uint64_t *key, uint64_t *value)
+{
+    for (;;)
+    {
+        NodeView view;
+        if (view_open(tree, block_id, &view) != 0)
+            return -1;
+        if (view.num_keys == 0)
+        {
+            view_close(&view);
+            return -1;
+        }
+        if (view_is_leaf(&view))
+        {
+            uint64_t i = rightmost ? view.num_keys - 1 : 0;
+            *key = view_key(&view, i);
+            *value = view_value(&view, i);
+            view_close(&view);
+            return 0;
+        }
+        block_id = view_child(&view, rightmost ? view.num_keys : 0);
+        view_close(&view);
+    }
+}
+
+static int delete_from(BTree *tree, BTreeNode *node, uint64_t key, int target);
+
+/**
+ * Delete key i of a classic interior node. A neighbouring child with keys to
+ * spare gives up its nearest pair to take the key's place; otherwise the two
+ * children are merged around the key.
+ */
+static int delete_interior(BTree *tree, BTreeNode *node, uint64_t i)
+{
+    uint64_t key = node->keys[i];
+    BTreeNode *left = alloc_node(tree);
+    BTreeNode *right = alloc_node(tree);
+    BTreeNode *donor = NULL;
+    int target = DELETE_MAX;
+    int result = -1;
+
+    if (!left || !right || read_node(tree, node->children[i], left) != 0)
+        goto done;
+    if (left->num_keys > min_keys(tree))
+    {
+        donor = left;
+    }
+    else
+    {
+        if (read_node(tree, node->children[i + 1], right) != 0)
+            goto done;
+        if (right->num_keys > min_keys(tree))
+        {
+            donor = right;
+            target = DELETE_MIN;
+        }
+    }
+
+    if (donor)
+    {
+        // The replacement is written before it is removed below, so it never goes missing
+        if (shadow_child(tree, node, donor == left ? i : i + 1, donor) != 0 ||
+            subtree_edge(tree, donor->block_id, target == DELETE_MAX, &node->keys[i], &node->values[i]) != 0 ||
+            write_node(tree, node) != 0)
+            goto done;
+        result = delete_from(tree, donor, 0, target);
+    }
+    else if (shadow_child(tree, node, i, left) == 0 && merge_children(tree, node, i, left, right) == 0)
+    {
+        result = delete_from(tree, left, key, DELETE_KEY);
+    }
+
+done:
+    free_node(left);
+    free_node(right);
+    return result;
+}
+
+/**
+ * Delete the target pair from the subtree rooted at node, which may lose a
+ * key without underflowing. Returns 0 once the pair is gone, 1 if the key is
+ * not in the subtree, or -1 on error.
+ */
+static int delete_from(BTree *tree, BTreeNode *node, uint64_t key, int target)
+{
+    uint64_t n = node->num_keys;
+    uint64_t i;
+
+    if (is_leaf(node))
+    {
+        if (n == 0)
+            return 1;
+        if (target == DELETE_MIN)
+            i = 0;
+        else if (target == DELETE_MAX)
+            i = n - 1;
+        else
+        {
+            i = keysearch_lower_bound(node->keys, n, key, 0);
+            if (i == n || node->keys[i] != key)
+                return 1;
+        }
+        node_remove(node, i, i);
+        return write_node(tree, node);
+    }
+
+    if (target == DELETE_MIN)
+        i = 0;
+    else if (target == DELETE_MAX)
+        i = n;
+    else if (is_bplus(tree))
+        i = keysearch_upper_bound(node->keys, n, key, 0);
+    else
+    {
+        i = keysearch_lower_bound(node->keys, n, key, 0);
+        if (i < n && node->keys[i] == key)
+            return delete_interior(tree, node, i);
+    }
+
+    BTreeNode *child = alloc_node(tree);
+    int result = -1;
+    if (child && read_node(tree, node->children[i], child) == 0 &&
+        shadow_child(tree, node, i, child) == 0)
+    {
+        result = child->num_keys > min_keys(tree) ? make_room(tree, node, &i, &child, key)
+                                                  : fix_child(tree, node, &i, &child);
+        if (result == 0)
+            result = delete_from(tree, child, key, target);
+    }
+    free_node(child);
+    return result;
+}
+
+// Delete without syncing; 0 if the key was deleted, 1 if it was not there
+static int delete_unsynced(BTree *tree, uint64_t key)
+{
+    if (tree->header.root_block_id == 0)
+        return 1;
+
+    // A tree that shadows its writes would copy a whole path only to rebalance it
+    KeyLocation loc;
+    if (writes_shadow(tree))
+    {
+        if (locate_key(tree, key, &loc) != 0)
+            return -1;
+        if (!loc.found)
+            return 1;
+    }
+
+    BTreeNode *root = alloc_node(tree);
+    if (!root)
+        return -1;
+
+    int result;
+    do
+    {
+        result = read_node(tree, tree->header.root_block_id, root) == 0 &&
+                         shadow_root(tree, root) == 0
+                     ? 0
+                     : -1;
+
+        // A full compressed root is split first, like a full child (see make_room())
+        if (result == 0 && is_compressed(tree) && node_full(tree, root))
+            result = grow_root(tree, &root, key) == 0 ? WRITE_RESTART : -1;
+        if (result == 0)
+            result = delete_from(tree, root, key, DELETE_KEY);
+    } while (result == WRITE_RESTART);
+
+    // Merges below the root may empty it even when the key turns out to be missing
+    if (result >= 0 && root->num_keys == 0)
+    {
+        pthread_rwlock_wrlock(&tree->root_latch);
+        __atomic_store_n(&tree->header.root_block_id, root->children[0], __ATOMIC_RELEASE); // 0 for a leaf
+        pthread_rwlock_unlock(&tree->root_latch);
+        tree->header_dirty = 1;
+        if (release_block(tree, root->block_id) != 0)
+            result = -1;
+    }
+
+    free_node(root);
+    return result;
+}
+
+// Delete a key; -1 if it is not in the tree or the delete failed
+int delete_key(BTree *tree, uint64_t key)
+{
+    if (!tree->is_open || tree->read_only)
+        return -1;
+
+    pthread_mutex_lock(&tree->writer_lock);
+    int result = delete_unsynced(tree, key);
+
+    // Rebalancing can change the tree even when the key is missing
+    if (result < 0 && tree->log)
+        log_rollback(tree);
+    else if (result >= 0 && commit_write(tree) != 0)
+        result = -1;
+    writer_unlock(tree);
+    return result == 0 ? 0 : -1;
+}
+
+/**
+ * Batched lookup
+ * --------------
+ * search_keys_batch() sorts the probes once and walks the tree with the whole
+ * batch. At each node the sorted probes that continue downwards fall into
+ * contiguous runs, one per child, so every node on the way is opened once
+ * however many probes pass through it. The children of a node are visited
+ * in block order after a readahead hint for each of them.
+ */
+typedef struct
+{
+    uint64_t key;
+    size_t index; // Position in the caller's arrays
+} BatchProbe;
+
+typedef struct
+{
+    uint64_t block_id;
+    size_t lo, hi; // Probes [lo, hi) continue into this child
+} BatchGroup;
+
+static int compare_probes(const void *a, const void *b)
+{
+    uint64_t ka = ((const BatchProbe *)a)->key;
+    uint64_t kb = ((const BatchProbe *)b)->key;
+    return (ka > kb) - (ka < kb);
+}
+
+static int compare_groups(const void *a, const void *b)
+{
+    uint64_t ba = ((const BatchGroup *)a)->block_id;
+    uint64_t bb = ((const BatchGroup *)b)->block_id;
+    return (ba > bb) - (ba < bb);
+}
+
+static int batch_descend(BTree *tree, uint64_t block_id, const BatchProbe *probes, size_t lo, size_t hi,
+                         uint64_t *values, int *found, size_t *num_found)
+{
+    NodeView view;
+    if (view_open(tree, block_id, &view) != 0)
+        return -1;
+
+    uint64_t num_keys = view.num_keys;
+    int leaf = view_is_leaf(&view);
+    int separators = view.bplus && !leaf;
+
+    BatchGroup *groups = NULL;
+    size_t num_groups = 0;
+    if (!leaf && !(groups = (BatchGroup *)malloc((num_keys + 1) * sizeof(BatchGroup))))
+    {
+        view_close(&view);
+        return -1;
+    }
+
+    size_t i = lo;
+    while (i < hi)
+    {
+        uint64_t key = probes[i].key;
+        uint64_t pos = separators ? keysearch_upper_bound(view.keys, num_keys, key, view.swap)
+                                  : view_lower_bound(&view, key);
+
+        if (!separators && pos < num_keys && view_key(&view, pos) == key)
+        {
+            values[probes[i].index] = view_value(&view, pos);
+            found[probes[i].index] = 1;
+            (*num_found)++;
+            i++;
+            continue;
+        }
+        if (leaf)
+        {
+            i++;
+            continue;
+        }
+
+        // Child pos covers every following probe below key pos, in both layouts
+        size_t j = i + 1;
+        if (pos < num_keys)
+        {
+            uint64_t bound = view_key(&view, pos);
+            while (j < hi && probes[j].key < bound)
+                j++;
+        }
+        else
+        {
+            j = hi;
+        }
+
+        groups[num_groups].block_id = view_child(&view, pos);
+        groups[num_groups].lo = i;
+        groups[num_groups].hi = j;
+        num_groups++;
+        i = j;
+    }
+    view_close(&view);
+
+    if (num_groups > 1)
+        qsort(groups, num_groups, sizeof(BatchGroup), compare_groups);
+    for (size_t g = 0; g < num_groups; g++)
+    {
+        page_prefetch(tree, groups[g].block_id);
+    }
+
+    int result = 0;
+    for (size_t g = 0; g < num_groups && result == 0; g++)
+    {
+        result = batch_descend(tree, groups[g].block_id, probes, groups[g].lo, groups[g].hi,
+                               values, found, num_found);
+    }
+
+    free(groups);
+    return result;
+}
+
+/**
+ * Look up n keys at once. found[i] is set to 1 and values[i] to the value
+ * when keys[i] is present, and found[i] to 0 otherwise. Returns the number
+ * of keys found, or -1 on error.
+ */
+int search_keys_batch(BTree *tree, const uint64_t *keys, size_t n, uint64_t *values, int *found)
+{
+    if (!tree->is_open)
+        return -1;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        found[i] = 0;
+    }
+    if (n == 0 || tree->header.root_block_id == 0)
+        return 0;
+
+    BatchProbe *probes = (BatchProbe *)malloc(n * sizeof(BatchProbe));
+    if (!probes)
+        return -1;
+    for (size_t i = 0; i < n; i++)
+    {
+        probes[i].key = keys[i];
+        probes[i].index = i;
+    }
+    qsort(probes, n, sizeof(BatchProbe), compare_probes);
+
+    size_t num_found = 0;
+    int result = batch_descend(tree, tree->header.root_block_id, probes, 0, n, values, found, &num_found);
+
+    free(probes);
+    return result == 0 ? (int)num_found : -1;
+}
+
+/**
+ * Cursors
+ * -------
+ * The last path entry is the current pair (node, key index). Every entry
+ * above it records which child the walk descended into. The in-order
+ * successor of key i in an interior node is the leftmost pair under child
+ * i + 1; past the last key of a leaf it is the first ancestor entered
+ * through a child left of its last key. Predecessors mirror this.
+ *
+ * In the B+ layout every pair is in a leaf, so past either end of a leaf
+ * the cursor follows the sibling link instead of climbing, and asks for the
+ * leaf after that to be read ahead.
+ */
+static int cursor_push(BTreeCursor *cursor, uint64_t block_id, uint64_t index, uint64_t num_keys)
+{
+    if (cursor->depth == BTREE_CURSOR_MAX_DEPTH)
+        return -1;
+
+    cursor->path[cursor->depth].block_id = block_id;
+    cursor->path[cursor->depth].index = index;
+    cursor->path[cursor->depth].num_keys = num_keys;
+    cursor->depth++;
+    return 0;
+}
+
+// Result of a cursor move; anything but a pair leaves the cursor off the tree
+static int cursor_settle(BTreeCursor *cursor, int result)
+{
+    if (result != 1)
+        cursor->depth = 0;
+    return result;
+}
+
+// Read the pair the last path entry points at
+static int cursor_load(BTreeCursor *cursor)
+{
+    NodeView view;
+    if (view_open(cursor->tree, cursor->path[cursor->depth - 1].block_id, &view) != 0)
+        return -1;
+
+    uint64_t index = cursor->path[cursor->depth - 1].index;
+    int result = -1;
+    if (index < view.num_keys)
+    {
+        cursor->key = view_key(&view, index);
+        cursor->value = view_value(&view, index);
+        result = 1;
+    }
+    view_close(&view);
+    return result;
+}
+
+// Push the path to the leftmost (or rightmost) pair under block_id
+static int cursor_descend(BTreeCursor *cursor, uint64_t block_id, int rightmost)
+{
+    for (;;)
+    {
+        NodeView view;
+        if (view_open(cursor->tree, block_id, &view) != 0)
+            return -1;
+
+        uint64_t num_keys = view.num_keys;
+        int leaf = view_is_leaf(&view);
+        if (num_keys == 0)
+        {
+            view_close(&view);
+            return leaf ? 0 : -1; // Only an empty root leaf has no keys
+        }
+
+        uint64_t index = !rightmost ? 0 : leaf ? num_keys - 1 : num_keys;
+        uint64_t child = leaf ? 0 : view_child(&view, index);
+        if (leaf)
+        {
+            cursor->key = view_key(&view, index);
+            cursor->value = view_value(&view, index);
+        }
+        view_close(&view);
+
+        if (cursor_push(cursor, block_id, index, num_keys) != 0)
+            return -1;
+        if (leaf)
+            return 1;
+        block_id = child;
+    }
+}
+
+// Pop finished levels until an ancestor has a key right of the child walked
+static int cursor_climb_next(BTreeCursor *cursor)
+{
+    while (--cursor->depth > 0)
+    {
+        if (cursor->path[cursor->depth - 1].index < cursor->path[cursor->depth - 1].num_keys)
+            return cursor_load(cursor);
+    }
+    return 0;
+}
+
+// Pop finished levels until an ancestor has a key left of the child walked
+static int cursor_climb_prev(BTreeCursor *cursor)
+{
+    while (--cursor->depth > 0)
+    {
+        if (cursor->path[cursor->depth - 1].index > 0)
+        {
+            cursor->path[cursor->depth - 1].index--;
+            return cursor_load(cursor);
+        }
+    }
+    return 0;
+}
+
+// B+ layout: move to the first (or last) pair of the leaf chain starting at block_id
+static int cursor_follow_leaf(BTreeCursor *cursor, uint64_t block_id, int backward)
+{
+    while (block_id != 0)
+    {
+        NodeView view;
+        if (view_open(cursor->tree, block_id, &view) != 0)
+            return -1;
+
+        uint64_t num_keys = view.num_keys;
+        uint64_t ahead = backward ? view_prev_leaf(&view) : view_next_leaf(&view);
+        if (num_keys > 0)
+        {
+            uint64_t index = backward ? num_keys - 1 : 0;
+            cursor->key = view_key(&view, index);
+            cursor->value = view_value(&view, index);
+        }
+        view_close(&view);
+
+        if (num_keys > 0)
+        {
+            cursor->depth = 0;
+            cursor_push(cursor, block_id, backward ? num_keys - 1 : 0, num_keys);
+            page_prefetch(cursor->tree, ahead);
+            return 1;
+        }
+        block_id = ahead; // Skip a leaf that has been emptied
+    }
+    return 0;
+}
+
+// Position the cursor on the first pair whose key is >= key
+int btree_seek(BTree *tree, BTreeCursor *cursor, uint64_t key)
+{
+    cursor->tree = tree;
+    cursor->depth = 0;
+    if (!tree->is_open)
+        return -1;
+
+    uint64_t block_id = tree->header.root_block_id;
+    while (block_id != 0)
+    {
+        NodeView view;
+        if (view_open(tree, block_id, &view) != 0)
+            return cursor_settle(cursor, -1);
+
+        uint64_t num_keys = view.num_keys;
+        int leaf = view_is_leaf(&view);
+        int bplus = view.bplus;
+        int separators = bplus && !leaf;
+        uint64_t i = separators ? keysearch_upper_bound(view.keys, num_keys, key, view.swap)
+                                : view_lower_bound(&view, key);
+        int found = !separators && i < num_keys && view_key(&view, i) == key;
+        if (found)
+            cursor->value = view_value(&view, i);
+        uint64_t child = found || leaf ? 0 : view_child(&view, i);
+        uint64_t next_leaf = view_next_leaf(&view);
+        view_close(&view);
+
+        if (cursor_push(cursor, block_id, i, num_keys) != 0)
+            return cursor_settle(cursor, -1);
+        if (found)
+        {
+            cursor->key = key;
+            return 1;
+        }
+        if (leaf)
+        {
+            // Keys from i on are all greater; past the end the answer is further right
+            if (i < num_keys)
+                return cursor_settle(cursor, cursor_load(cursor));
+            if (bplus)
+                return cursor_settle(cursor, cursor_follow_leaf(cursor, next_leaf, 0));
+            return cursor_settle(cursor, cursor_climb_next(cursor));
+        }
+        block_id = child;
+    }
+    return 0; // Empty tree
+}
+
+// Position the cursor on the pair with the largest key
+int btree_seek_last(BTree *tree, BTreeCursor *cursor)
+{
+    cursor->tree = tree;
+    cursor->depth = 0;
+    if (!tree->is_open)
+        return -1;
+    if (tree->header.root_block_id == 0)
+        return 0;
+
+    return cursor_settle(cursor, cursor_descend(cursor, tree->header.root_block_id, 1));
+}
+
+int cursor_next(BTreeCursor *cursor)
+{
+    if (cursor->depth == 0)
+        return 0;
+
+    NodeView view;
+    if (view_open(cursor->tree, cursor->path[cursor->depth - 1].block_id, &view) != 0)
+        return cursor_settle(cursor, -1);
+
+    uint64_t index = ++cursor->path[cursor->depth - 1].index;
+    int leaf = view_is_leaf(&view);
+    int bplus = view.bplus;
+
+    // Stepping within a leaf is the common case; read the pair from this view
+    if (leaf && index < view.num_keys)
+    {
+        cursor->key = view_key(&view, index);
+        cursor->value = view_value(&view, index);
+        view_close(&view);
+        return 1;
+    }
+
+    uint64_t next = leaf ? view_next_leaf(&view) : view_child(&view, index);
+    view_close(&view);
+
+    if (!leaf)
+        return cursor_settle(cursor, cursor_descend(cursor, next, 0));
+    if (bplus)
+        return cursor_settle(cursor, cursor_follow_leaf(cursor, next, 0));
+    return cursor_settle(cursor, cursor_climb_next(cursor));
+}
+
+int cursor_prev(BTreeCursor *cursor)
+{
+    if (cursor->depth == 0)
+        return 0;
+
+    NodeView view;
+    if (view_open(cursor->tree, cursor->path[cursor->depth - 1].block_id, &view) != 0)
+        return cursor_settle(cursor, -1);
+
+    uint64_t index = cursor->path[cursor->depth - 1].index;
+    int leaf = view_is_leaf(&view);
+    int bplus = view.bplus;
+
+    if (leaf && index > 0)
+    {
+        cursor->path[cursor->depth - 1].index--;
+        cursor->key = view_key(&view, index - 1);
+        cursor->value = view_value(&view, index - 1);
+        view_close(&view);
+        return 1;
+    }
+
+    // An interior key's predecessor is the rightmost pair of the child to its left
+    uint64_t prev = leaf ? view_prev_leaf(&view) : view_child(&view, index);
+    view_close(&view);
+
+    if (!leaf)
+        return cursor_settle(cursor, cursor_descend(cursor, prev, 1));
+    if (bplus)
+        return cursor_settle(cursor, cursor_follow_leaf(cursor, prev, 1));
+    return cursor_settle(cursor, cursor_climb_prev(cursor));
+}
+
+/**
+ * Visit every pair with lo <= key <= hi in ascending order. Returns 0 when
+ * the range is exhausted, -1 on error, or the callback's nonzero result.
+ */
+int range_scan(BTree *tree, uint64_t lo, uint64_t hi, BTreeScanCallback callback, void *ctx)
+{
+    BTreeCursor cursor;
+    if (lo > hi)
+        return 0;
+
+    int result = btree_seek(tree, &cursor, lo);
+    while (result == 1 && cursor.key <= hi)
+    {
+        int stop = callback(ctx, cursor.key, cursor.value);
+        if (stop != 0)
+            return stop;
+        result = cursor_next(&cursor);
+    }
+    return result < 0 ? -1 : 0;
+}
+
+/**
+ * Write-ahead log
+ * ---------------
+ * Under BTREE_DURABILITY_WAL a write ends in a log commit instead of a
+ * flush. The blocks it changed, and the header if that changed, are
+ * appended to the redo log next to the file as full images, and the log is
+ * synced once. The blocks stay dirty in the pool and reach the file when
+ * they are evicted or at the next checkpoint. A checkpoint writes every
+ * dirty block and the header, syncs the file and empties the log.
+ *
+ * Each commit takes the next LSN. A logged block image carries the LSN of
+ * its commit in the block's spare last word, big-endian like the header,
+ * and the header records the LSN of the last checkpoint. Recovery in
+ * open_btree() replays the committed images newer than both, in log order,
+ * so a crash during recovery only means replaying again.
+ */
+struct BTreeLog
+{
+    Wal *wal;
+    uint64_t lsn;              // LSN of the last commit
+    BufferFrame **pending;     // Frames changed since the last commit
+    size_t num_pending;
+    size_t max_pending;        // Frames in the pool; a frame is pending at most once
+    BTreeHeader logged_header; // Header as of the last commit
+    unsigned char *block;      // Scratch image of the header
+    char *path;                // Log file, read back by log_rollback()
+    size_t retired;            // Blocks retired for snapshots since the last commit
+    int failed;                // 1 once a rollback could not restore the file
+};
+
+#define HEADER_CHECKPOINT_LSN 64 // Byte offset of checkpoint_lsn in the header block
+
+static char *log_path(const char *filename)
+{
+    char *path = (char *)malloc(strlen(filename) + sizeof(WAL_SUFFIX));
+    if (path)
+    {
+        strcpy(path, filename);
+        strcat(path, WAL_SUFFIX);
+    }
+    return path;
+}
+
+static void stamp_lsn(const BTree *tree, unsigned char *block, uint64_t lsn)
+{
+    ((uint64_t *)block)[tree->header.block_size / sizeof(uint64_t) - 1] = to_big_endian(lsn);
+}
+
+static void log_track(BTree *tree, BufferFrame *frame)
+{
+    BTreeLog *log = tree->log;
+    frame->unlogged = 1;
+    log->pending[log->num_pending++] = frame;
+}
+
+// A block retired for snapshots goes back into the tree if its write is rolled back
+static void log_track_retired(BTree *tree)
+{
+    tree->log->retired++;
+}
+
+// Log the pending frames and the header as one transaction and sync the log
+static int log_write(BTree *tree)
+{
+    BTreeLog *log = tree->log;
+    size_t block_size = tree->header.block_size;
+    int header_changed = memcmp(&log->logged_header, &tree->header, sizeof(BTreeHeader)) != 0;
+    if (log->failed)
+        return -1; // Only recovery at the next open can tell what was committed
+    if (log->num_pending == 0 && !header_changed)
+        return 0;
+
+    // The writer is the only thread that touches the last word of a block
+    uint64_t lsn = log->lsn + 1;
+    int result = 0;
+    for (size_t i = 0; result == 0 && i < log->num_pending; i++)
+    {
+        BufferFrame *frame = log->pending[i];
+        stamp_lsn(tree, frame->data, lsn);
+        result = wal_append(log->wal, lsn, WAL_PAGE, frame->block_id, frame->data, block_size);
+    }
+    if (result == 0 && header_changed)
+    {
+        encode_header(tree, log->block);
+        stamp_lsn(tree, log->block, lsn);
+        result = wal_append(log->wal, lsn, WAL_PAGE, 0, log->block, block_size);
+    }
+    if (result == 0)
+        result = wal_append(log->wal, lsn, WAL_COMMIT, 0, NULL, 0);
+    if (result == 0)
+        result = wal_sync(log->wal);
+    if (result != 0)
+        return -1; // The frames stay pending and go out with the next commit
+
+    // Logged frames may now be evicted, and written back, like any dirty frame
+    pthread_mutex_lock(&tree->pool->lock);
+    for (size_t i = 0; i < log->num_pending; i++)
+    {
+        log->pending[i]->unlogged = 0;
+    }
+    pthread_mutex_unlock(&tree->pool->lock);
+    log->num_pending = 0;
+    log->retired = 0;
+    log->lsn = lsn;
+    log->logged_header = tree->header;
+    return 0;
+}
+
+/**
+ * Checkpoint: commit, write every dirty block and sync the file, then record
+ * the last LSN in the header, sync again and empty the log. The header goes
+ * out only once the blocks are on disk, since recovery skips every record
+ * up to its LSN. A crash before the log is emptied leaves records the file
+ * already holds, which recovery writes again or skips.
+ */
+static int log_checkpoint(BTree *tree)
+{
+    BTreeLog *log = tree->log;
+    if (log_write(tree) != 0 || flush_tree(tree, 1) != 0)
+        return -1;
+
+    tree->header.checkpoint_lsn = log->lsn;
+    tree->header_dirty = 1;
+    if (flush_tree(tree, 1) != 0)
+        return -1;
+    log->logged_header = tree->header;
+    return wal_reset(log->wal);
+}
+
+static int log_commit(BTree *tree)
+{
+    if (log_write(tree) != 0)
+        return -1;
+
+    // A long log makes recovery slow; the commit stands even if this fails,
+    // and the next commit tries again
+    uint64_t limit = tree->checkpoint_bytes ? tree->checkpoint_bytes : BTREE_DEFAULT_CHECKPOINT_BYTES;
+    if (wal_size(tree->log->wal) >= limit)
+        log_checkpoint(tree);
+    return 0;
+}
+
+// Commit early once pending frames fill a quarter of the pool, which a batch
+// of writes would otherwise pin in place until it ends
+static int log_commit_if_full(BTree *tree)
+{
+    if (!tree->log || tree->log->num_pending < tree->log->max_pending / 4)
+        return 0;
+    return log_commit(tree);
+}
+
+// Make a finished write as durable as the handle's durability mode asks
+static int commit_write(BTree *tree)
+{
+    if (tree->log)
+        return log_commit(tree);
+    return tree->durability == BTREE_DURABILITY_PER_OP ? flush_tree(tree, 1) : 0;
+}
+
+static int log_open(BTree *tree, const char *filename)
+{
+    // A shared pool too small for one logged write is refused, not resized
+    if (tree->pool->num_frames < BTREE_MIN_WAL_CACHE_FRAMES)
+        return -1;
+
+    BTreeLog *log = (BTreeLog *)calloc(1, sizeof(BTreeLog));
+    char *path = log_path(filename);
+    if (log && path)
+    {
+        log->max_pending = tree->pool->num_frames;
+        log->pending = (BufferFrame **)malloc(log->max_pending * sizeof(BufferFrame *));
+        log->block = (unsigned char *)malloc(tree->header.block_size);
+        log->path = path;
+        log->wal = log->pending && log->block ? wal_open(path) : NULL;
+    }
+    if (!log || !log->wal)
+    {
+        if (log)
+        {
+            free(log->pending);
+            free(log->block);
+        }
+        free(log);
+        free(path);
+        return -1;
+    }
+
+    log->lsn = tree->header.checkpoint_lsn;
+    log->logged_header = tree->header;
+    tree->log = log;
+    return 0;
+}
+
+// Close the log, removing it only once a checkpoint has made it redundant
+static void log_close(BTree *tree, int remove)
+{
+    BTreeLog *log = tree->log;
+    if (!log)
+        return;
+    wal_close(log->wal, remove);
+    free(log->pending);
+    free(log->block);
+    free(log->path);
+    free(log);
+    tree->log = NULL;
+}
+
+typedef struct
+{
+    int fd;
+    uint64_t checkpoint_lsn;
+    int skip_header; // 1 to leave block 0 alone
+} LogReplay;
+
+// Write one committed block image unless the file already holds it or a newer one
+static int replay_block(void *ctx, uint64_t lsn, uint64_t block_id, const void *data, size_t len)
+{
+    LogReplay *replay = (LogReplay *)ctx;
+    if (lsn <= replay->checkpoint_lsn || (block_id == 0 && replay->skip_header))
+        return 0;
+
+    // A block stamped with a later LSN has a later image in the log too; one
+    // stamped with this LSN is written again in case its write was torn
+    off_t offset = (off_t)(block_id * len);
+    uint64_t word;
+    if (pread(replay->fd, &word, sizeof(word), offset + (off_t)len - 8) == sizeof(word) &&
+        from_big_endian(word) > lsn)
+        return 0;
+    return pwrite(replay->fd, data, len, offset) == (ssize_t)len ? 0 : -1;
+}
+
+/**
+ * Undo a write that failed under the log, taking the tree back to its last
+ * commit. The log holds the committed image of every block a pending frame
+ * may have changed, so those images go back into the file first; then the
+ * pending frames are dropped and their next access reads the file, and the
+ * header fields a write changes return to their logged values. Under a
+ * batch this also undoes the writes since the batch last committed, and
+ * blocks that snapshot reclamation freed in that time stay dead. If the log
+ * cannot be read, the handle stops writing and the log is left for
+ * recovery at the next open.
+ */
+static void log_rollback(BTree *tree)
+{
+    BTreeLog *log = tree->log;
+    LogReplay replay = {fileno(tree->fp), tree->header.checkpoint_lsn, 1};
+    uint64_t last_lsn;
+    if (wal_replay(log->path, replay_block, &replay, &last_lsn) != 0)
+    {
+        log->failed = 1;
+        tree->read_only = 1;
+        return;
+    }
+
+    pthread_mutex_lock(&tree->pool->lock);
+    for (size_t i = 0; i < log->num_pending; i++)
+    {
+        // Readers may still hold the frame; the version makes optimistic ones retry
+        BufferFrame *frame = log->pending[i];
+        frame->unlogged = 0;
+        frame->is_dirty = 0;
+        __atomic_store_n(&frame->version, frame->version + 2, __ATOMIC_RELEASE);
+        pool_unlink(tree->pool, frame);
+    }
+    pthread_mutex_unlock(&tree->pool->lock);
+    log->num_pending = 0;
+
+    tree->header.next_block_id = log->logged_header.next_block_id;
+    tree->header.free_block_id = log->logged_header.free_block_id;
+    pthread_rwlock_wrlock(&tree->root_latch);
+    __atomic_store_n(&tree->header.root_block_id, log->logged_header.root_block_id, __ATOMIC_RELEASE);
+    pthread_rwlock_unlock(&tree->root_latch);
+
+    // Blocks retired since the commit are still part of the tree
+    if (tree->snapshots && log->retired > 0)
+    {
+        pthread_mutex_lock(&tree->snapshot_lock);
+        BTreeSnapshots *snapshots = tree->snapshots;
+        size_t queued = snapshots->num_retired - snapshots->first_retired;
+        snapshots->num_retired -= log->retired < queued ? log->retired : queued;
+        pthread_mutex_unlock(&tree->snapshot_lock);
+    }
+    log->retired = 0;
+}
+
+/**
+ * Recovery: replay the log a handle left behind when it did not close
+ * cleanly, record in the header how far the file now goes, and remove the
+ * log. This runs before the header is read, since the log may hold a newer
+ * one. A read-only handle cannot replay, so it refuses a file with a log.
+ */
+static int recover_tree(BTree *tree, const char *filename)
+{
+    char *path = log_path(filename);
+    if (!path)
+        return -1;
+    if (tree->read_only)
+    {
+        int pending = wal_has_records(path);
+        free(path);
+        return pending ? -1 : 0;
+    }
+
+    int fd = fileno(tree->fp);
+    LogReplay replay = {fd, 0, 0};
+    uint64_t field;
+    if (pread(fd, &field, sizeof(field), HEADER_CHECKPOINT_LSN) == sizeof(field))
+        replay.checkpoint_lsn = from_big_endian(field);
+
+    uint64_t last_lsn;
+    int result = wal_replay(path, replay_block, &replay, &last_lsn);
+    if (result == 0 && last_lsn > replay.checkpoint_lsn)
+    {
+        // A replayed header carries an older checkpoint LSN
+        field = to_big_endian(last_lsn);
+        if (pwrite(fd, &field, sizeof(field), HEADER_CHECKPOINT_LSN) != sizeof(field) || fsync(fd) != 0)
+            result = -1;
+    }
+    if (result == 0)
+        unlink(path);
+    free(path);
+    return result;
+}
+
+/**
+ * Tree locks (see BTree). writer_lock is recursive because the public
+ * writers call each other: load_data() ends in bulk_load_sorted() and
+ * btree_sync(), and insert_key() syncs.
+ */
+static void tree_locks_init(BTree *tree)
+{
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&tree->writer_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    pthread_rwlock_init(&tree->root_latch, NULL);
+    pthread_mutex_init(&tree->snapshot_lock, NULL);
+    pthread_cond_init(&tree->snapshot_taken, NULL);
+}
+
+static void tree_locks_destroy(BTree *tree)
+{
+    pthread_mutex_destroy(&tree->writer_lock);
+    pthread_rwlock_destroy(&tree->root_latch);
+    pthread_mutex_destroy(&tree->snapshot_lock);
+    pthread_cond_destroy(&tree->snapshot_taken);
+}
+
+// Tree operations
+int create_btree(BTree *tree, const char *filename)
+{
+    return create_btree_ex(tree, filename, NULL);
+}
+
+int create_btree_ex(BTree *tree, const char *filename, const BTreeCreateOptions *options)
+{
+    uint64_t format_version = options && options->format_version ? options->format_version
+                                                                  : BTREE_FORMAT_V1;
+    uint64_t block_size = options && options->block_size ? options->block_size : BLOCK_SIZE;
+    BTreeLayout layout = options ? options->layout : BTREE_LAYOUT_BTREE;
+    int append_only = options && options->append_only;
+    int compressed = options && options->compressed;
+    if (format_version != BTREE_FORMAT_V1 && format_version != BTREE_FORMAT_V2)
+        return -1;
+    if (!valid_block_size(block_size))
+        return -1;
+    if (layout != BTREE_LAYOUT_BTREE && layout != BTREE_LAYOUT_BPLUS)
+        return -1;
+    if (append_only && (layout != BTREE_LAYOUT_BTREE || tree->durability == BTREE_DURABILITY_WAL))
+        return -1;
+    if (compressed && layout != BTREE_LAYOUT_BPLUS)
+        return -1;
+
+    // First close any currently open tree
+    if (tree->is_open)
+    {
+        close_btree(tree);
+    }
+
+    if (tree->io_mode == BTREE_IO_MMAP_READONLY)
+        return -1;
+    if (tree->durability == BTREE_DURABILITY_WAL && tree->io_mode != BTREE_IO_STDIO)
+        return -1; // Mapped pages reach the file whenever the kernel likes
+
+    FILE *fp = fopen(filename, "wb+");
+    if (!fp)
+        return -1;
+
+    // A log left by an earlier file of this name must never be replayed into this one
+    char *stale_log = log_path(filename);
+    if (stale_log)
+        unlink(stale_log);
+    free(stale_log);
+
+    tree->fp = fp;
+    tree->is_open = 1;
+    tree->read_only = 0;
+    memcpy(tree->header.magic, MAGIC_NUMBER, 8);
+    tree->header.root_block_id = 0;
+    tree->header.next_block_id = 1;
+    tree->header.format_version = format_version;
+    tree->header.flags = (layout == BTREE_LAYOUT_BPLUS ? BTREE_FLAG_BPLUS : 0) |
+                         (append_only ? BTREE_FLAG_APPEND_ONLY : 0) |
+                         (compressed ? BTREE_FLAG_COMPRESSED : 0);
+    tree->header.block_size = block_size;
+    tree->header.max_keys = keys_for_block_size(block_size, tree->header.flags);
+    tree->header.free_block_id = 0;
+    tree->header.checkpoint_lsn = 0;
+    tree->swap_words = format_swaps(format_version);
+    tree->header_dirty = 0;
+    tree->committed_blocks = tree->header.next_block_id;
+
+    int result = tree->io_mode == BTREE_IO_STDIO
+                     ? attach_pool(tree)
+                     : map_ensure(tree, 0);
+    if (result == 0)
+        result = write_header(tree);
+    if (result == 0 && tree->durability == BTREE_DURABILITY_WAL)
+        result = log_open(tree, filename);
+    if (result != 0)
+    {
+        clear_node_cache(tree);
+        map_close(tree);
+        fclose(fp);
+        tree->is_open = 0;
+        return -1;
+    }
+
+    fflush(fp);
+    tree_locks_init(tree);
+    return 0;
+}
+
+int open_btree(BTree *tree, const char *filename)
+{
+    // First close any currently open tree properly
+    if (tree->is_open)
+    {
+        close_btree(tree);
+    }
+
+    tree->read_only = tree->io_mode == BTREE_IO_MMAP_READONLY;
+    if (tree->durability == BTREE_DURABILITY_WAL && tree->io_mode != BTREE_IO_STDIO)
+        return -1;
+
+    FILE *fp = fopen(filename, tree->read_only ? "rb" : "rb+");
+    if (!fp)
+        return -1;
+
+    tree->fp = fp;
+    tree->is_open = 1;
+    tree->header_dirty = 0;
+
+    // The block size is in the header, so the pool is sized after reading it
+    tree->header.block_size = BTREE_MIN_BLOCK_SIZE;
+    int result = recover_tree(tree, filename);
+    if (result == 0 && tree->io_mode != BTREE_IO_STDIO)
+        result = map_ensure(tree, 0);
+    if (result == 0)
+        result = read_header(tree);
+    if (result == 0 && (memcmp(tree->header.magic, MAGIC_NUMBER, 8) != 0 ||
+                        tree->header.format_version > BTREE_FORMAT_V2 ||
+                        (tree->header.flags & ~(uint64_t)BTREE_KNOWN_FLAGS) != 0))
+        result = -1;
+    if (result == 0 && is_append_only(tree) && tree->durability == BTREE_DURABILITY_WAL)
+        result = -1;
+    tree->committed_blocks = tree->header.next_block_id;
+    if (result == 0 && tree->io_mode == BTREE_IO_STDIO)
+        result = attach_pool(tree);
+    if (result == 0 && tree->durability == BTREE_DURABILITY_WAL)
+        result = log_open(tree, filename);
+    if (result != 0)
+    {
+        clear_node_cache(tree);
+        tree->read_only = 1; // Leave the file size alone
+        map_close(tree);
+        fclose(fp);
+        tree->is_open = 0;
+        return -1;
+    }
+
+    tree_locks_init(tree);
+    return 0;
+}
+
+/**
+ * Group commit: write every dirty block in ascending block order, then the
+ * header, then fsync once. Blocks go out before the header so the header
+ * never points at a root or next_block_id that is not yet on disk. An
+ * append-only tree also syncs between the two, so that the header write
+ * is the commit: until it lands, the header on disk still points at the
+ * previous tree, whose blocks nothing has touched.
+ */
+static int flush_tree(BTree *tree, int do_fsync)
+{
+    int result = 0;
+
+    if (tree->read_only)
+        return 0;
+
+    // Blocks appended through stdio (bulk load, convert) reach the file before
+    // the pool and header go out with pwrite()
+    if (fflush(tree->fp) != 0)
+        result = -1;
+    if (tree->pool && pool_flush(tree->pool, tree) != 0)
+        result = -1;
+
+    // Mapped node pages go out ahead of the header, which shares the first page
+    if (tree->map && do_fsync &&
+        msync(tree->map, tree->map_size, MS_SYNC) != 0)
+        result = -1;
+    if (!tree->map && do_fsync && tree->header_dirty && is_append_only(tree) &&
+        fsync(fileno(tree->fp)) != 0)
+        result = -1;
+
+    if (tree->header_dirty)
+    {
+        // An append-only header must not point at blocks that failed to go out
+        if ((result != 0 && is_append_only(tree)) || write_header(tree) != 0)
+        {
+            result = -1;
+        }
+        else
+        {
+            tree->header_dirty = 0;
+            if (is_append_only(tree))
+                tree->committed_blocks = tree->header.next_block_id;
+        }
+    }
+
+    if (tree->map && do_fsync && msync(tree->map, tree->header.block_size, MS_SYNC) != 0)
+        result = -1;
+
+    if (fflush(tree->fp) != 0)
+        result = -1;
+    if (do_fsync && fsync(fileno(tree->fp)) != 0)
+        result = -1;
+
+    return result;
+}
+
+int btree_sync(BTree *tree)
+{
+    if (!tree->is_open)
+        return -1;
+
+    pthread_mutex_lock(&tree->writer_lock);
+    int result = tree->log ? log_checkpoint(tree) : flush_tree(tree, 1);
+    writer_unlock(tree);
+    return result;
+}
+
+/**
+ * Take a snapshot (see btree.h). A snapshot that finds the writer idle takes
+ * itself; otherwise it waits for the writer to take it at its next pause.
+ */
+int btree_snapshot(BTree *tree, BTree *snapshot)
+{
+    if (!tree->is_open || tree->base || tree->map || is_bplus(tree))
+        return -1;
+
+    memset(snapshot, 0, sizeof(BTree));
+    pthread_mutex_lock(&tree->snapshot_lock);
+    BTreeSnapshots *snapshots = tree->snapshots;
+    if (!snapshots)
+    {
+        snapshots = (BTreeSnapshots *)calloc(1, sizeof(BTreeSnapshots));
+        if (snapshots)
+            __atomic_store_n(&tree->snapshots, snapshots, __ATOMIC_RELEASE);
+    }
+
+    int result = -1;
+    if (snapshots &&
+        reserve_items((void **)&snapshots->waiting, &snapshots->max_waiting,
+                      snapshots->num_waiting + 1, sizeof(BTree *)) == 0 &&
+        reserve_items((void **)&snapshots->live, &snapshots->max_live,
+                      snapshots->num_live + snapshots->num_waiting + 1, sizeof(uint64_t)) == 0)
+    {
+        snapshots->waiting[snapshots->num_waiting++] = snapshot;
+        if (pthread_mutex_trylock(&tree->writer_lock) == 0)
+        {
+            take_snapshots(tree);
+            pthread_mutex_unlock(&tree->writer_lock);
+        }
+        while (snapshot->snapshot_version == 0)
+            pthread_cond_wait(&tree->snapshot_taken, &tree->snapshot_lock);
+        result = 0;
+    }
+    pthread_mutex_unlock(&tree->snapshot_lock);
+    if (result != 0)
+        return -1;
+
+    snapshot->fp = tree->fp;
+    snapshot->is_open = 1;
+    snapshot->read_only = 1;
+    snapshot->durability = BTREE_DURABILITY_NONE;
+    snapshot->io_mode = tree->io_mode;
+    snapshot->read_mode = tree->read_mode;
+    snapshot->cache_frames = tree->cache_frames;
+    snapshot->pool = tree->pool;
+    snapshot->swap_words = tree->swap_words;
+    snapshot->base = tree;
+    tree_locks_init(snapshot);
+    return 0;
+}
+
+// Close a snapshot; the writer frees the blocks only it could reach at its next pause
+static void close_snapshot(BTree *snapshot)
+{
+    BTree *tree = snapshot->base;
+    pthread_mutex_lock(&tree->snapshot_lock);
+    BTreeSnapshots *snapshots = tree->snapshots;
+    size_t i = 0;
+    while (i < snapshots->num_live && snapshots->live[i] != snapshot->snapshot_version)
+        i++;
+    if (i < snapshots->num_live)
+    {
+        memmove(snapshots->live + i, snapshots->live + i + 1,
+                (snapshots->num_live - i - 1) * sizeof(uint64_t));
+        __atomic_store_n(&snapshots->num_live, snapshots->num_live - 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&tree->snapshot_lock);
+    tree_locks_destroy(snapshot);
+    snapshot->pool = NULL;
+    snapshot->fp = NULL;
+}
+
+// Free every retired block and the snapshot state once no snapshot is left
+static void release_snapshots(BTree *tree)
+{
+    BTreeSnapshots *snapshots = tree->snapshots;
+    if (!snapshots)
+        return;
+    if (!tree->read_only)
+        reclaim_blocks(tree);
+    free(snapshots->waiting);
+    free(snapshots->live);
+    free(snapshots->retired);
+    free(snapshots);
+    tree->snapshots = NULL;
+}
+
+void close_btree(BTree *tree)
+{
+    if (tree->is_open && tree->base)
+    {
+        close_snapshot(tree);
+    }
+    else if (tree->is_open)
+    {
+        release_snapshots(tree);
+
+        // Write any dirty nodes and the header in one ordered flush. A log
+        // is kept for recovery unless its checkpoint succeeded.
+        if (tree->log)
+            log_close(tree, log_checkpoint(tree) == 0);
+        else
+            flush_tree(tree, tree->durability != BTREE_DURABILITY_NONE);
+        clear_node_cache(tree);
+        map_close(tree);
+
+        if (tree->fp)
+        {
+            fclose(tree->fp);
+            tree->fp = NULL;
+        }
+        tree_locks_destroy(tree);
+    }
+    tree->is_open = 0;
+}
+
+/**
+ * Offline format conversion: copy src to dst, rewriting every block in the
+ * requested format version. v1 and v2 share a layout and differ only in the
+ * byte order of each 8-byte word, so each block is converted word by word and
+ * appended in block order; block IDs are unchanged. The words of a compressed
+ * node sit at any byte offset, so such a node is decoded and encoded again.
+ */
+int convert_btree(const char *src_filename, const char *dst_filename, uint64_t format_version)
+{
+    BTree src = {0}, dst = {0};
+    BTreeCreateOptions options = {0};
+    options.format_version = format_version;
+
+    if (open_btree(&src, src_filename) != 0)
+        return -1;
+
+    options.block_size = src.header.block_size;
+    options.layout = is_bplus(&src) ? BTREE_LAYOUT_BPLUS : BTREE_LAYOUT_BTREE;
+    options.append_only = is_append_only(&src);
+    options.compressed = is_compressed(&src);
+    dst.durability = BTREE_DURABILITY_PER_BATCH;
+    if (create_btree_ex(&dst, dst_filename, &options) != 0)
+    {
+        close_btree(&src);
+        return -1;
+    }
+    dst.header.max_keys = src.header.max_keys;
+
+    size_t block_size = src.header.block_size;
+    size_t num_words = block_size / sizeof(uint64_t);
+    uint64_t *words = (uint64_t *)malloc(block_size);
+    BTreeNode *node = is_compressed(&src) ? alloc_node(&src) : NULL;
+    int swap = src.swap_words != dst.swap_words;
+    int result = words && (node || !is_compressed(&src)) ? fseek(dst.fp, block_size, SEEK_SET) : -1;
+
+    for (uint64_t id = 1; result == 0 && id < src.header.next_block_id; id++)
+    {
+        if (read_block(&src, id, words) != 0)
+        {
+            result = -1;
+            break;
+        }
+
+        // The last word is the block's LSN, big-endian in every version.
+        // A free block has no keys and only whole words.
+        uint64_t lsn = words[num_words - 1];
+        if (node && words[2] != 0)
+        {
+            if (decode_node(&src, (unsigned char *)words, node) != 0 ||
+                encode_node(&dst, node, (unsigned char *)words) != 0)
+            {
+                result = -1;
+                break;
+            }
+            words[num_words - 1] = lsn;
+        }
+        else
+        {
+            for (size_t i = 0; i + 1 < num_words; i++)
+            {
+                words[i] = swap_word(swap, words[i]);
+            }
+        }
+
+        if (fwrite(words, 1, block_size, dst.fp) != block_size)
+            result = -1;
+    }
+    free(words);
+    free_node(node);
+
+    if (result == 0)
+    {
+        dst.header.root_block_id = src.header.root_block_id;
+        dst.header.next_block_id = src.header.next_block_id;
+        dst.header.free_block_id = src.header.free_block_id;
+        dst.header.checkpoint_lsn = src.header.checkpoint_lsn; // LSNs keep rising in the copy
+        dst.header_dirty = 1;
+        result = btree_sync(&dst);
+    }
+
+    close_btree(&src);
+    close_btree(&dst);
+    return result;
+}
+
+// Pairs of a tree in key order, read with a cursor
+typedef struct
+{
+    BTreeCursor cursor;
+    int state; // Result of the last cursor move
+} CursorStream;
+
+static int cursor_stream_next(void *ctx, uint64_t *key, uint64_t *value)
+{
+    CursorStream *stream = (CursorStream *)ctx;
+    if (stream->state != 1)
+        return stream->state;
+    *key = stream->cursor.key;
+    *value = stream->cursor.value;
+    stream->state = cursor_next(&stream->cursor);
+    return 1;
+}
+
+/**
+ * Offline compaction: rebuild src into dst from the pairs it holds, with
+ * the same format, block size, layout and keys per node. Blocks no node
+ * uses any more (the replaced copies of an append-only file, or a free
+ * list) are left behind, and the nodes are bulk-built in key order. To
+ * compact a file in place, compact it to a new name and rename that over it.
+ */
+int compact_btree(const char *src_filename, const char *dst_filename)
+{
+    BTree src = {0}, dst = {0};
+    BTreeCreateOptions options = {0};
+
+    if (open_btree(&src, src_filename) != 0)
+        return -1;
+
+    options.format_version = src.header.format_version;
+    options.block_size = src.header.block_size;
+    options.layout = is_bplus(&src) ? BTREE_LAYOUT_BPLUS : BTREE_LAYOUT_BTREE;
+    options.append_only = is_append_only(&src);
+    options.compressed = is_compressed(&src);
+    dst.durability = BTREE_DURABILITY_PER_BATCH;
+    if (create_btree_ex(&dst, dst_filename, &options) != 0)
+    {
+        close_btree(&src);
+        return -1;
+    }
+    dst.header.max_keys = src.header.max_keys;
+
+    CursorStream stream;
+    stream.state = btree_seek(&src, &stream.cursor, 0);
+    int result = bulk_load_sorted(&dst, cursor_stream_next, &stream, LOAD_FILL_FACTOR);
+
+    close_btree(&src);
+    close_btree(&dst);
+    return result;
+}
+
+// Print function
+void print_tree(BTree *tree)
+{
+    if (!tree->is_open || tree->header.root_block_id == 0)
+    {
+        printf("Tree is empty.\n");
+        return;
+    }
+
+    printf("B-Tree Contents:\n");
+    printf("---------------\n");
+    print_node_recursive(tree, tree->header.root_block_id, 0);
+}
+
+// Data load/extract functions
+
+/**
+ * Load pipeline
+ * -------------
+ * load_data() runs as three stages joined by bounded queues:
+ * - a parse thread reads the input and cuts it into batches of LOAD_BATCH pairs
+ * - a sort thread orders each batch by key (input order among equal keys)
+ * - the calling thread applies the batches to the tree
+ * A full queue blocks the stage feeding it, so at most LOAD_QUEUE_DEPTH
+ * batches wait between two stages. Applying a batch in key order walks
+ * neighbouring keys down the same path, so its nodes stay hot in the pool
+ * and every dirty block takes many updates before it is written back.
+ * An empty tree skips the sort stage: its pairs go to the external sorter
+ * and the bulk loader, which sort everything anyway.
+ */
+typedef struct
+{
+    uint64_t key, value;
+    uint64_t line; // Input line (or record), for reporting and to keep sorts stable
+} LoadPair;
+
+typedef struct
+{
+    LoadPair *pairs;
+    size_t count;
+} LoadBatch;
+
+typedef struct
+{
+    LoadBatch *slots[LOAD_QUEUE_DEPTH];
+    size_t head, count;
+    int closed;  // The producer is done
+    int aborted; // The consumer gave up; producers stop
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty, not_full;
+} BatchQueue;
+
+typedef struct
+{
+    Ingest *in;
+    BatchQueue *parsed; // Parse stage output
+    BatchQueue *sorted; // Sort stage output (unused for bulk loads)
+    int read_error;
+} LoadPipeline;
+
+static void queue_init(BatchQueue *q)
+{
+    memset(q, 0, sizeof(*q));
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+}
+
+static void queue_destroy(BatchQueue *q)
+{
+    // Batches left behind by an aborted load
+    for (; q->count > 0; q->count--, q->head = (q->head + 1) % LOAD_QUEUE_DEPTH)
+    {
+        free(q->slots[q->head]->pairs);
+        free(q->slots[q->head]);
+    }
+    pthread_cond_destroy(&q->not_full);
+    pthread_cond_destroy(&q->not_empty);
+    pthread_mutex_destroy(&q->lock);
+}
+
+// Block while the queue is full; -1 if the consumer has aborted
+static int queue_push(BatchQueue *q, LoadBatch *batch)
+{
+    pthread_mutex_lock(&q->lock);
+    while (q->count == LOAD_QUEUE_DEPTH && !q->aborted)
+        pthread_cond_wait(&q->not_full, &q->lock);
+    int result = q->aborted ? -1 : 0;
+    if (result == 0)
+    {
+        q->slots[(q->head + q->count) % LOAD_QUEUE_DEPTH] = batch;
+        q->count++;
+        pthread_cond_signal(&q->not_empty);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return result;
+}
+
+// Block until a batch arrives; NULL once the producer has closed the queue and it is drained
+static LoadBatch *queue_pop(BatchQueue *q)
+{
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0 && !q->closed)
+        pthread_cond_wait(&q->not_empty, &q->lock);
+    LoadBatch *batch = NULL;
+    if (q->count > 0)
+    {
+        batch = q->slots[q->head];
+        q->head = (q->head + 1) % LOAD_QUEUE_DEPTH;
+        q->count--;
+        pthread_cond_signal(&q->not_full);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return batch;
+}
+
+static void queue_close(BatchQueue *q)
+{
+    pthread_mutex_lock(&q->lock);
+    q->closed = 1;
+    pthread_cond_broadcast(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+static void queue_abort(BatchQueue *q)
+{
+    pthread_mutex_lock(&q->lock);
+    q->aborted = 1;
+    pthread_cond_broadcast(&q->not_full);
+    pthread_mutex_unlock(&q->lock);
+}
+
+static void free_batch(LoadBatch *batch)
+{
+    if (batch)
+        free(batch->pairs);
+    free(batch);
+}
+
+static void *parse_stage(void *arg)
+{
+    LoadPipeline *pipe = (LoadPipeline *)arg;
+    for (;;)
+    {
+        LoadBatch *batch = (LoadBatch *)malloc(sizeof(LoadBatch));
+        LoadPair *pairs = (LoadPair *)malloc(LOAD_BATCH * sizeof(LoadPair));
+        if (!batch || !pairs)
+        {
+            free(batch);
+            free(pairs);
+            pipe->read_error = 1;
+            break;
+        }
+        batch->pairs = pairs;
+        batch->count = 0;
+
+        int more = 1;
+        while (batch->count < LOAD_BATCH &&
+               (more = ingest_next(pipe->in, &pairs[batch->count].key, &pairs[batch->count].value)) == 1)
+        {
+            pairs[batch->count++].line = ingest_stats(pipe->in)->records;
+        }
+        if (more < 0)
+            pipe->read_error = 1;
+
+        if (batch->count == 0 || more < 0 || queue_push(pipe->parsed, batch) != 0)
+        {
+            free_batch(batch);
+            break;
+        }
+        if (more == 0)
+            break;
+    }
+    queue_close(pipe->parsed);
+    return NULL;
+}
+
+static int compare_load_pairs(const void *a, const void *b)
+{
+    const LoadPair *x = (const LoadPair *)a;
+    const LoadPair *y = (const LoadPair *)b;
+    if (x->key != y->key)
+        return (x->key > y->key) - (x->key < y->key);
+    return (x->line > y->line) - (x->line < y->line);
+}
+
+static void *sort_stage(void *arg)
+{
+    LoadPipeline *pipe = (LoadPipeline *)arg;
+    LoadBatch *batch;
+    while ((batch = queue_pop(pipe->parsed)) != NULL)
+    {
+        qsort(batch->pairs, batch->count, sizeof(LoadPair), compare_load_pairs);
+        if (queue_push(pipe->sorted, batch) != 0)
+        {
+            free_batch(batch);
+            queue_abort(pipe->parsed); // Let the parse stage stop too
+            break;
+        }
+    }
+    queue_close(pipe->sorted);
+    return NULL;
+}
+
+static double elapsed_since(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// One summary for the whole file instead of a warning per line
+static void print_load_report(const BTreeLoadReport *report)
+{
+    if (report->malformed > 0)
+    {
+        printf("Warning: %llu malformed line(s), first at line",
+               (unsigned long long)report->malformed);
+        uint64_t shown = report->malformed < BTREE_LOAD_REPORTED_LINES ? report->malformed
+                                                                       : BTREE_LOAD_REPORTED_LINES;
+        for (uint64_t i = 0; i < shown; i++)
+        {
+            printf("%s %llu", i ? "," : "", (unsigned long long)report->malformed_lines[i]);
+        }
+        printf("%s\n", report->malformed > shown ? ", ..." : "");
+    }
+    if (report->failed > 0)
+    {
+        printf("Warning: Failed to insert %llu pair(s), first at line %llu\n",
+               (unsigned long long)report->failed, (unsigned long long)report->first_failed);
+    }
+}
+
+static int load_data_unlocked(BTree *tree, const char *filename, BTreeInputFormat format,
+                              BTreeLoadReport *report)
+{
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    memset(report, 0, sizeof(*report));
+    if (!tree->is_open || tree->read_only)
+        return -1;
+
+    int bulk = tree->header.root_block_id == 0;
+    ExternalSorter *sorter = bulk ? extsort_create(EXTSORT_DEFAULT_MEMORY) : NULL;
+    Ingest *in = ingest_open(filename, format == BTREE_INPUT_BINARY ? INGEST_BINARY : INGEST_CSV);
+    if (!in || (bulk && !sorter))
+    {
+        ingest_close(in);
+        extsort_destroy(sorter);
+        return -1;
+    }
+
+    BatchQueue parsed, sorted;
+    LoadPipeline pipe = {in, &parsed, &sorted, 0};
+    queue_init(&parsed);
+    queue_init(&sorted);
+    BatchQueue *output = bulk ? &parsed : &sorted;
+
+    pthread_t parser, sorter_thread;
+    int have_parser = pthread_create(&parser, NULL, parse_stage, &pipe) == 0;
+    int have_sorter = !bulk && have_parser &&
+                      pthread_create(&sorter_thread, NULL, sort_stage, &pipe) == 0;
+    int result = have_parser && (bulk || have_sorter) ? 0 : -1;
+    if (result != 0)
+        queue_abort(&parsed);
+
+    double last_progress = 0;
+    uint64_t committed = 0; // Pairs loaded as of the last log commit
+    LoadBatch *batch;
+    while (result == 0 && (batch = queue_pop(output)) != NULL)
+    {
+        for (size_t i = 0; result == 0 && i < batch->count; i++)
+        {
+            LoadPair *pair = &batch->pairs[i];
+            if (bulk)
+            {
+                if (extsort_add(sorter, pair->key, pair->value) != 0)
+                {
+                    result = -1;
+                    break;
+                }
+            }
+            else if (put_unsynced(tree, pair->key, pair->value, PUT_UPSERT) != 0)
+            {
+                if (report->failed++ == 0)
+                    report->first_failed = pair->line;
+                if (!tree->log)
+                    continue;
+
+                // The rollback also undoes the pairs loaded since the last commit
+                log_rollback(tree);
+                report->failed += report->loaded - committed;
+                report->loaded = committed;
+                result = -1;
+                break;
+            }
+            else if (log_commit_if_full(tree) != 0)
+            {
+                result = -1;
+                break;
+            }
+            report->loaded++;
+            if (tree->log && tree->log->num_pending == 0)
+                committed = report->loaded;
+        }
+        free_batch(batch);
+
+        // Snapshots asked for during the batch get the tree as it ends
+        snapshot_point(tree);
+
+        report->seconds = elapsed_since(&start);
+        if (tree->load_progress && report->seconds - last_progress >= LOAD_PROGRESS_INTERVAL)
+        {
+            last_progress = report->seconds;
+            tree->load_progress(tree->load_progress_ctx, report);
+        }
+    }
+
+    // Stop the stages early if the tree gave up, then wait for them
+    if (result != 0)
+    {
+        queue_abort(&sorted);
+        queue_abort(&parsed);
+    }
+    if (have_sorter)
+        pthread_join(sorter_thread, NULL);
+    if (have_parser)
+        pthread_join(parser, NULL);
+    if (pipe.read_error)
+        result = -1;
+
+    if (result == 0 && bulk)
+    {
+        result = extsort_finish(sorter) == 0
+                     ? bulk_load_sorted(tree, extsort_next, sorter, LOAD_FILL_FACTOR)
+                     : -1;
+    }
+    else if (result == 0 && tree->log)
+    {
+        result = log_commit(tree);
+    }
+    else if (result == 0 && tree->durability != BTREE_DURABILITY_NONE)
+    {
+        // The whole file is one batch: a single ordered flush at the end
+        result = btree_sync(tree);
+    }
+
+    const IngestStats *stats = ingest_stats(in);
+    report->records = stats->records;
+    report->malformed = stats->malformed;
+    memcpy(report->malformed_lines, stats->first_malformed, sizeof(report->malformed_lines));
+    report->seconds = elapsed_since(&start);
+    if (tree->load_progress)
+        tree->load_progress(tree->load_progress_ctx, report);
+
+    queue_destroy(&sorted);
+    queue_destroy(&parsed);
+    extsort_destroy(sorter);
+    ingest_close(in);
+    return result;
+}
+
+int load_data(BTree *tree, const char *filename)
+{
+    BTreeLoadReport report;
+    int result = load_data_ex(tree, filename, BTREE_INPUT_CSV, &report);
+    print_load_report(&report);
+    return result;
+}
+
+int load_data_ex(BTree *tree, const char *filename, BTreeInputFormat format,
+                 BTreeLoadReport *report)
+{
+    BTreeLoadReport scratch;
+    if (!report)
+        report = &scratch;
+    if (!tree->is_open)
+    {
+        memset(report, 0, sizeof(*report));
+        return -1;
+    }
+
+    pthread_mutex_lock(&tree->writer_lock);
+    int result = load_data_unlocked(tree, filename, format, report);
+    writer_unlock(tree);
+    return result;
+}
+
+/**
+ * Bulk loading
+ * ------------
+ * bulk_load_sorted() builds a tree bottom-up from a sorted stream instead of
+ * inserting one key at a time. Leaves are packed to the fill factor and written
+ * first, then each interior level is built from the separators the level below
+ * produced. Every block is written exactly once, in ascending block_id order, by
+ * plain sequential writes that bypass the buffer pool.
+ *
+ * Separators between levels are spilled to a temporary file as
+ * (key, value, right child) records, so memory use does not grow with the input.
+ * Bulk-built nodes have parent_block_id 0: a node is written before its parent's
+ * block_id is known, and nothing in the library reads the field. In the B+
+ * layout the leaves land in consecutive blocks, so the leaf chain is a
+ * sequential run of the file.
+ */
+
+typedef struct
+{
+    uint64_t key;
+    uint64_t value;
+    uint64_t child; // Block to the right of this separator
+} SeparatorRecord;
+
+typedef struct
+{
+    BTreeKVSource next;
+    void *ctx;
+    int has_pending;
+    uint64_t pending_key;
+    uint64_t pending_value;
+} SortedStream;
+
+typedef struct
+{
+    BTree *tree;
+    FILE *up;             // Separator records for the level above
+    uint64_t first_child; // First node written at this level
+    uint64_t num_nodes;   // Nodes written at this level
+    unsigned char *block; // Scratch block image for level_emit()
+    uint64_t node_bytes;  // Compressed trees: bytes a node may fill
+    uint64_t min_keys;    // Compressed trees: min_keys() of the tree
+} LevelWriter;
+
+// Next pair from the stream; equal keys collapse to the last value (last writer wins)
+static int sorted_stream_next(SortedStream *stream, uint64_t *key, uint64_t *value)
+{
+    uint64_t k, v;
+    int result;
+
+    while ((result = stream->next(stream->ctx, &k, &v)) == 1)
+    {
+        if (!stream->has_pending)
+        {
+            stream->pending_key = k;
+            stream->pending_value = v;
+            stream->has_pending = 1;
+        }
+        else if (k == stream->pending_key)
+        {
+            stream->pending_value = v;
+        }
+        else if (k < stream->pending_key)
+        {
+            return -1; // Input is not sorted
+        }
+        else
+        {
+            *key = stream->pending_key;
+            *value = stream->pending_value;
+            stream->pending_key = k;
+            stream->pending_value = v;
+            return 1;
+        }
+    }
+
+    if (result < 0)
+        return -1;
+    if (!stream->has_pending)
+        return 0;
+
+    *key = stream->pending_key;
+    *value = stream->pending_value;
+    stream->has_pending = 0;
+    return 1;
+}
+
+// Keys per node for a fill factor, kept between the minimum and max_keys
+static uint64_t keys_for_fill(const BTree *tree, double fill_factor)
+{
+    if (fill_factor <= 0.0 || fill_factor > 1.0)
+        fill_factor = 1.0;
+
+    uint64_t keys = (uint64_t)(fill_factor * tree->header.max_keys + 0.5);
+    if (keys < min_keys(tree))
+        keys = min_keys(tree);
+    if (keys > tree->header.max_keys)
+        keys = tree->header.max_keys;
+    return keys;
+}
+
+/**
+ * Assign the next block to a finished node and append it to the file.
+ * `separator` is the key/value between this node and the previous one at
+ * the same level; it is passed up unless this is the level's first node.
+ */
+static int level_emit(LevelWriter *level, BTreeNode *node, uint64_t sep_key, uint64_t sep_value)
+{
+    size_t block_size = level->tree->header.block_size;
+
+    node->block_id = level->tree->header.next_block_id++;
+    node->parent_block_id = 0;
+    if (encode_node(level->tree, node, level->block) != 0)
+        return -1;
+
+    if (fwrite(level->block, 1, block_size, level->tree->fp) != block_size)
+        return -1;
+
+    if (level->num_nodes == 0)
+    {
+        level->first_child = node->block_id;
+    }
+    else
+    {
+        SeparatorRecord record = {sep_key, sep_value, node->block_id};
+        if (fwrite(&record, sizeof(record), 1, level->up) != 1)
+            return -1;
+    }
+    level->num_nodes++;
+    return 0;
+}
+
+/**
+ * Emit a leaf. The leaf level is written to consecutive blocks before any
+ * interior node, so a B+ leaf's siblings are simply the blocks on either
+ * side of it.
+ */
+static int leaf_emit(LevelWriter *level, BTreeNode *leaf, uint64_t sep_key, uint64_t sep_value, int last)
+{
+    if (is_bplus(level->tree))
+    {
+        uint64_t block_id = level->tree->header.next_block_id;
+        leaf->prev_leaf = level->num_nodes > 0 ? block_id - 1 : 0;
+        leaf->next_leaf = last ? 0 : block_id + 1;
+    }
+    return level_emit(level, leaf, sep_key, sep_value);
+}
+
+/**
+ * Compressed trees: 1 if a node of this shape stays within the bytes a
+ * bulk-built node may fill. A node of min_keys() keys or fewer always
+ * does, since it fits the block whatever its keys.
+ */
+static int bulk_fits(const LevelWriter *level, int leaf, uint64_t num_keys, uint64_t key_bytes, unsigned bits)
+{
+    return num_keys <= level->min_keys || packed_size(leaf, num_keys, key_bytes, bits) <= level->node_bytes;
+}
+
+// Compressed trees: key section length once key follows the num_keys keys of section key_bytes long
+static uint64_t key_bytes_after(const uint64_t *keys, uint64_t num_keys, uint64_t key_bytes, uint64_t key)
+{
+    return key_bytes + (num_keys > 0 ? varint_size(key - keys[num_keys - 1]) : sizeof(uint64_t));
+}
+
+// Append key/value pairs to a leaf under construction
+static void leaf_append(BTreeNode *leaf, uint64_t key, uint64_t value)
+{
+    leaf->keys[leaf->num_keys] = key;
+    leaf->values[leaf->num_keys] = value;
+    leaf->num_keys++;
+}
+
+/**
+ * Emit the final two leaves, merging a short last leaf into prev or splitting
+ * the pairs evenly. In the classic layout the pair between the two leaves is
+ * a separator and not stored in either; a B+ separator is a copy of the first
+ * key of the right-hand leaf.
+ */
+static int finish_leaf_level(LevelWriter *level, BTreeNode *prev, BTreeNode *cur,
+                             uint64_t prev_sep_key, uint64_t prev_sep_value,
+                             uint64_t mid_key, uint64_t mid_value)
+{
+    BTree *tree = level->tree;
+    int bplus = is_bplus(tree);
+    int compressed = is_compressed(tree);
+
+    if (cur->num_keys >= min_keys(tree))
+    {
+        if (leaf_emit(level, prev, prev_sep_key, prev_sep_value, 0) != 0)
+            return -1;
+        return leaf_emit(level, cur, mid_key, mid_value, 1);
+    }
+
+    uint64_t capacity = 2 * tree->header.max_keys + 1;
+    uint64_t *keys = (uint64_t *)malloc(2 * capacity * sizeof(uint64_t));
+    if (!keys)
+        return -1;
+    uint64_t *values = keys + capacity;
+
+    uint64_t total = 0;
+    for (uint64_t i = 0; i < prev->num_keys; i++, total++)
+    {
+        keys[total] = prev->keys[i];
+        values[total] = prev->values[i];
+    }
+    if (!bplus)
+    {
+        keys[total] = mid_key;
+        values[total++] = mid_value;
+    }
+    for (uint64_t i = 0; i < cur->num_keys; i++, total++)
+    {
+        keys[total] = cur->keys[i];
+        values[total] = cur->values[i];
+    }
+
+    clear_node(tree, prev);
+    clear_node(tree, cur);
+
+    int result;
+    if (total <= tree->header.max_keys &&
+        (!compressed || packed_size(1, total, key_section_bytes(keys, total), 0) <= packed_room(tree)))
+    {
+        for (uint64_t i = 0; i < total; i++)
+            leaf_append(prev, keys[i], values[i]);
+        result = leaf_emit(level, prev, prev_sep_key, prev_sep_value, 1);
+    }
+    else
+    {
+        // The left half is part of prev, so it fits. A compressed right half
+        // can hold wider gaps than prev did; it gives up keys until it fits.
+        uint64_t left = bplus ? total / 2 : (total - 1) / 2;
+        while (compressed &&
+               packed_size(1, total - left, key_section_bytes(keys + left, total - left), 0) > packed_room(tree))
+        {
+            left++;
+        }
+        for (uint64_t i = 0; i < left; i++)
+            leaf_append(prev, keys[i], values[i]);
+        for (uint64_t i = bplus ? left : left + 1; i < total; i++)
+            leaf_append(cur, keys[i], values[i]);
+
+        result = leaf_emit(level, prev, prev_sep_key, prev_sep_value, 0);
+        if (result == 0)
+            result = leaf_emit(level, cur, keys[left], values[left], 1);
+    }
+
+    free(keys);
+    return result;
+}
+
+// Pack the stream into leaves; the last two leaves are rebalanced so both meet the minimum
+static int build_leaf_level(LevelWriter *level, SortedStream *stream, uint64_t keys_per_leaf)
+{
+    BTreeNode *prev = alloc_node(level->tree);
+    BTreeNode *cur = alloc_node(level->tree);
+    uint64_t prev_sep_key = 0, prev_sep_value = 0; // Separator before prev
+    uint64_t mid_key = 0, mid_value = 0;           // Separator between prev and cur
+    int have_prev = 0;
+    int bplus = is_bplus(level->tree);
+    int compressed = is_compressed(level->tree);
+    uint64_t key_bytes = 0; // Compressed trees: key section of cur
+    uint64_t key, value;
+    int result = -1;
+
+    if (!prev || !cur)
+        goto done;
+
+    while ((result = sorted_stream_next(stream, &key, &value)) == 1)
+    {
+        uint64_t grown = compressed ? key_bytes_after(cur->keys, cur->num_keys, key_bytes, key) : 0;
+        if (cur->num_keys < keys_per_leaf &&
+            (!compressed || bulk_fits(level, 1, cur->num_keys + 1, grown, 0)))
+        {
+            leaf_append(cur, key, value);
+            key_bytes = grown;
+            continue;
+        }
+
+        // cur is complete and this pair separates it from the next leaf
+        if (have_prev && leaf_emit(level, prev, prev_sep_key, prev_sep_value, 0) != 0)
+        {
+            result = -1;
+            goto done;
+        }
+
+        BTreeNode *done_leaf = cur;
+        cur = prev;
+        prev = done_leaf;
+        clear_node(level->tree, cur);
+
+        prev_sep_key = mid_key;
+        prev_sep_value = mid_value;
+        mid_key = key;
+        mid_value = value;
+        have_prev = 1;
+
+        // A B+ leaf keeps the pair; the separator is only a copy of its key
+        key_bytes = 0;
+        if (bplus)
+        {
+            leaf_append(cur, key, value);
+            key_bytes = sizeof(uint64_t);
+        }
+    }
+    if (result < 0)
+        goto done;
+
+    if (!have_prev)
+        result = cur->num_keys == 0 ? 0 : leaf_emit(level, cur, 0, 0, 1);
+    else
+        result = finish_leaf_level(level, prev, cur, prev_sep_key, prev_sep_value, mid_key, mid_value);
+
+done:
+    free_node(prev);
+    free_node(cur);
+    return result;
+}
+
+/**
+ * Compressed trees: children of each node of an interior level, packed by
+ * bytes like the leaves in one pass over the separators in `down`. A short
+ * last node is merged into the one before it if they fit one block, or
+ * else takes children from it until it has at least min_keys() + 1.
+ */
+static int packed_shares(LevelWriter *level, FILE *down, uint64_t first_child, uint64_t num_children,
+                         uint64_t keys_per_node, uint64_t **shares, uint64_t *num_nodes)
+{
+    BTree *tree = level->tree;
+    uint64_t max_keys = tree->header.max_keys;
+    size_t max_shares = 0;
+    uint64_t *keys = (uint64_t *)malloc(2 * max_keys * sizeof(uint64_t));
+    uint64_t *prev_keys = keys, *cur_keys = keys + max_keys; // Separators inside each node
+    uint64_t prev_sep = 0;                                    // Separator between the two
+    uint64_t cur_count = 0, key_bytes = 0, last_child = first_child;
+    SeparatorRecord record;
+    int result = keys ? 0 : -1;
+
+    *shares = NULL;
+    *num_nodes = 0;
+    rewind(down);
+    for (uint64_t i = 1; result == 0 && i < num_children; i++)
+    {
+        if (fread(&record, sizeof(record), 1, down) != 1)
+        {
+            result = -1;
+            break;
+        }
+
+        // The record's child joins cur along with its separator, or starts the next node
+        uint64_t grown = key_bytes_after(cur_keys, cur_count, key_bytes, record.key);
+        if (cur_count < keys_per_node &&
+            bulk_fits(level, 0, cur_count + 1, grown, bits_for(record.child)))
+        {
+            cur_keys[cur_count++] = record.key;
+            key_bytes = grown;
+            last_child = record.child;
+            continue;
+        }
+
+        if (reserve_items((void **)shares, &max_shares, *num_nodes + 1, sizeof(uint64_t)) != 0)
+        {
+            result = -1;
+            break;
+        }
+        (*shares)[(*num_nodes)++] = cur_count + 1;
+        uint64_t *swap = prev_keys;
+        prev_keys = cur_keys;
+        cur_keys = swap;
+        prev_sep = record.key;
+        cur_count = 0;
+        key_bytes = 0;
+        last_child = record.child;
+    }
+    if (result == 0 && reserve_items((void **)shares, &max_shares, *num_nodes + 1, sizeof(uint64_t)) != 0)
+        result = -1;
+    if (result == 0)
+        (*shares)[(*num_nodes)++] = cur_count + 1;
+
+    uint64_t n = *num_nodes;
+    if (result == 0 && n > 1 && (*shares)[n - 1] < level->min_keys + 1)
+    {
+        // The separators of the last two nodes in order, with the one between them
+        uint64_t total = (*shares)[n - 2] + (*shares)[n - 1];
+        uint64_t prev_count = (*shares)[n - 2] - 1;
+        uint64_t *all = (uint64_t *)malloc((total - 1) * sizeof(uint64_t));
+        if (!all)
+        {
+            result = -1;
+        }
+        else
+        {
+            memcpy(all, prev_keys, prev_count * sizeof(uint64_t));
+            all[prev_count] = prev_sep;
+            memcpy(all + prev_count + 1, cur_keys, cur_count * sizeof(uint64_t));
+
+            unsigned bits = bits_for(last_child);
+            if (total - 1 <= max_keys &&
+                packed_size(0, total - 1, key_section_bytes(all, total - 1), bits) <= packed_room(tree))
+            {
+                (*shares)[n - 2] = total;
+                (*num_nodes)--;
+            }
+            else
+            {
+                // The left node is a prefix of the old one and fits; the right one
+                // fits by the time it is down to min_keys() + 1 children
+                uint64_t left = total / 2;
+                while (packed_size(0, total - left - 1, key_section_bytes(all + left, total - left - 1), bits) >
+                       packed_room(tree))
+                {
+                    left++;
+                }
+                (*shares)[n - 2] = left;
+                (*shares)[n - 1] = total - left;
+            }
+            free(all);
+        }
+    }
+
+    free(keys);
+    if (result != 0)
+    {
+        free(*shares);
+        *shares = NULL;
+    }
+    return result;
+}
+
+// Build one interior level over num_children nodes whose separators are in `down`
+static int build_interior_level(LevelWriter *level, FILE *down, uint64_t first_child,
+                                uint64_t num_children, uint64_t keys_per_node)
+{
+    BTree *tree = level->tree;
+    uint64_t target = keys_per_node + 1;
+    uint64_t num_nodes = (num_children + target - 1) / target;
+    uint64_t most = num_children / (min_keys(tree) + 1);
+    uint64_t *shares = NULL; // Compressed trees: children of each node
+
+    // Even shares must stay within [min_keys + 1, max_keys + 1] children per node
+    if (num_nodes > most)
+        num_nodes = most;
+    if (num_nodes == 0 || num_children <= tree->header.max_keys + 1)
+        num_nodes = 1;
+    if (is_compressed(tree) &&
+        packed_shares(level, down, first_child, num_children, keys_per_node, &shares, &num_nodes) != 0)
+        return -1;
+
+    BTreeNode *node = alloc_node(tree);
+    if (!node)
+    {
+        free(shares);
+        return -1;
+    }
+
+    rewind(down);
+
+    uint64_t next_child = first_child;
+    uint64_t sep_key = 0, sep_value = 0;
+    SeparatorRecord record;
+    int result = 0;
 
-    while (current_block != 0)
+    for (uint64_t n = 0; n < num_nodes && result == 0; n++)
     {
-        read_node(tree, current_block, &node);
+        uint64_t share = shares ? shares[n]
+                                : num_children / num_nodes + (n < num_children % num_nodes ? 1 : 0);
+        clear_node(tree, node);
 
-        for (int i = 0; i < node.num_keys; i++)
+        node->children[0] = next_child;
+        for (uint64_t i = 1; i < share && result == 0; i++)
         {
-            if (key == node.keys[i])
+            if (fread(&record, sizeof(record), 1, down) != 1)
             {
-                *value = node.values[i];
-                return 0;
-            }
-            if (key < node.keys[i])
-            {
-                current_block = node.children[i];
-                goto next_iteration;
+                result = -1;
+                break;
             }
+            node->keys[node->num_keys] = record.key;
+            node->values[node->num_keys] = record.value;
+            node->num_keys++;
+            node->children[i] = record.child;
         }
 
-        current_block = node.children[node.num_keys];
+        if (result != 0 || level_emit(level, node, sep_key, sep_value) != 0)
+        {
+            result = -1;
+            break;
+        }
 
-    next_iteration:
-        continue;
+        // The record after this node's last child separates it from the next node
+        if (n + 1 < num_nodes)
+        {
+            if (fread(&record, sizeof(record), 1, down) != 1)
+            {
+                result = -1;
+                break;
+            }
+            sep_key = record.key;
+            sep_value = record.value;
+            next_child = record.child;
+        }
     }
 
-    return -1; // Key not found
+    free_node(node);
+    free(shares);
+    return result;
 }
 
-// Block I/O operations
-static int write_block(FILE *fp, uint64_t block_id, const void *buf)
+static int bulk_load_unlocked(BTree *tree, BTreeKVSource next, void *ctx, double fill_factor)
 {
-    if (fseek(fp, block_id * BLOCK_SIZE, SEEK_SET) != 0)
+    if (!tree->is_open || tree->read_only || tree->header.root_block_id != 0)
+        return -1;
+
+    uint64_t keys_per_node = keys_for_fill(tree, fill_factor);
+    SortedStream stream = {next, ctx, 0, 0, 0};
+    LevelWriter level = {tree, tmpfile(), 0, 0, (unsigned char *)malloc(tree->header.block_size), 0, 0};
+    if (!level.up || !level.block)
     {
+        if (level.up)
+            fclose(level.up);
+        free(level.block);
         return -1;
     }
-    if (fwrite(buf, 1, BLOCK_SIZE, fp) != BLOCK_SIZE)
+
+    if (is_compressed(tree))
     {
-        return -1;
+        if (fill_factor <= 0.0 || fill_factor > 1.0)
+            fill_factor = 1.0;
+        level.node_bytes = (uint64_t)(fill_factor * packed_room(tree));
+        level.min_keys = min_keys(tree);
     }
-    fflush(fp);
-    return 0;
-}
 
-static int read_block(FILE *fp, uint64_t block_id, void *buf)
-{
-    if (fseek(fp, block_id * BLOCK_SIZE, SEEK_SET) != 0)
+    // Blocks are appended one after another from header.next_block_id (blocks
+    // on the free list are left for later inserts)
+    int result = -1;
+    if (fseek(tree->fp, tree->header.next_block_id * tree->header.block_size, SEEK_SET) != 0 ||
+        build_leaf_level(&level, &stream, keys_per_node) != 0)
     {
-        return -1;
+        goto done;
     }
-    if (fread(buf, 1, BLOCK_SIZE, fp) != BLOCK_SIZE)
+
+    // Each pass reads the separators of one level and writes the level above it
+    while (level.num_nodes > 1)
     {
-        return -1;
+        FILE *down = level.up;
+        uint64_t first_child = level.first_child;
+        uint64_t num_children = level.num_nodes;
+
+        level.up = tmpfile();
+        level.first_child = 0;
+        level.num_nodes = 0;
+
+        int built = level.up &&
+                    build_interior_level(&level, down, first_child, num_children, keys_per_node) == 0;
+        fclose(down);
+        if (!built)
+            goto done;
+    }
+
+    result = fflush(tree->fp) == 0 ? 0 : -1; // Readers must see the appends
+    if (result == 0)
+    {
+        pthread_rwlock_wrlock(&tree->root_latch);
+        __atomic_store_n(&tree->header.root_block_id, level.first_child, __ATOMIC_RELEASE); // 0 if the stream was empty
+        pthread_rwlock_unlock(&tree->root_latch);
+    }
+    tree->header_dirty = 1;
+
+done:
+    if (level.up)
+        fclose(level.up);
+    free(level.block);
+    if (result != 0)
+    {
+        tree->header_dirty = 1; // Blocks were consumed even though the build failed
+        return result;
+    }
+    // The appended blocks bypass the log, so a WAL handle checkpoints here
+    if (tree->durability != BTREE_DURABILITY_NONE)
+    {
+        return btree_sync(tree);
     }
     return 0;
 }
 
-// Header I/O operations
-static int write_header(BTree *tree)
+int bulk_load_sorted(BTree *tree, BTreeKVSource next, void *ctx, double fill_factor)
 {
-    unsigned char block[BLOCK_SIZE] = {0};
-    memcpy(block, tree->header.magic, 8);
-
-    uint64_t *fields = (uint64_t *)(block + 8);
-    fields[0] = to_big_endian(tree->header.root_block_id);
-    fields[1] = to_big_endian(tree->header.next_block_id);
+    if (!tree->is_open)
+        return -1;
 
-    return write_block(tree->fp, 0, block);
+    pthread_mutex_lock(&tree->writer_lock);
+    int result = bulk_load_unlocked(tree, next, ctx, fill_factor);
+    writer_unlock(tree);
+    return result;
 }
 
-static int read_header(BTree *tree)
+/**
+ * Parallel export
+ * ---------------
+ * The tree is cut into tasks in key order: each task is one subtree,
+ * optionally followed by a single pair that sits after it (a key of a
+ * classic interior node above it). Splitting a subtree task replaces it with
+ * its children, so the tasks always cover every pair exactly once and in
+ * the same order as a serial in-order walk. Worker threads render tasks into
+ * private buffers and the calling thread writes the buffers out in task
+ * order, so the file matches a serial export byte for byte.
+ */
+typedef struct
 {
-    unsigned char block[BLOCK_SIZE];
-    if (read_block(tree->fp, 0, block) != 0)
-    {
-        return -1;
-    }
+    uint64_t block_id; // Subtree root
+    int has_pair;      // 1 if a pair follows the subtree
+    uint64_t key, value;
+} ExportTask;
 
-    memcpy(tree->header.magic, block, 8);
-    uint64_t *fields = (uint64_t *)(block + 8);
-    tree->header.root_block_id = from_big_endian(fields[0]);
-    tree->header.next_block_id = from_big_endian(fields[1]);
-
-    return 0;
-}
+typedef struct
+{
+    char *data;
+    size_t len, cap;
+    FILE *sink; // If set, flushed here whenever EXPORT_CHUNK bytes are waiting
+} OutBuf;
 
-// Node I/O operations
-static int write_node(BTree *tree, BTreeNode *node)
+typedef struct
 {
-    unsigned char block[BLOCK_SIZE] = {0};
-    uint64_t *fields = (uint64_t *)block;
+    BTree *tree;
+    ExportTask *tasks;
+    OutBuf *outputs;
+    int *done;
+    size_t num_tasks;
+    size_t next_task; // Next task a worker claims
+    size_t written;   // Tasks already written to the file
+    size_t window;    // Tasks a worker may run ahead of the writer
+    int failed;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} ExportJob;
 
-    // Pack the node data
-    fields[0] = to_big_endian(node->block_id);
-    fields[1] = to_big_endian(node->parent_block_id);
-    fields[2] = to_big_endian(node->num_keys);
+static const char digit_pairs[201] =
+    "00010203040506070809101112131415161718192021222324"
+    "25262728293031323334353637383940414243444546474849"
+    "50515253545556575859606162636465666768697071727374"
+    "75767778798081828384858687888990919293949596979899";
 
-    for (int i = 0; i < MAX_KEYS; i++)
+// Write v in decimal so that it ends just before `end`; returns its first digit
+static char *format_u64(char *end, uint64_t v)
+{
+    while (v >= 100)
     {
-        fields[3 + i] = to_big_endian(node->keys[i]);
-        fields[3 + MAX_KEYS + i] = to_big_endian(node->values[i]);
+        end -= 2;
+        memcpy(end, digit_pairs + 2 * (v % 100), 2);
+        v /= 100;
     }
-
-    for (int i = 0; i < MAX_CHILDREN; i++)
+    if (v >= 10)
     {
-        fields[3 + 2 * MAX_KEYS + i] = to_big_endian(node->children[i]);
+        end -= 2;
+        memcpy(end, digit_pairs + 2 * v, 2);
     }
-
-    // Write the block and flush
-    int result = write_block(tree->fp, node->block_id, block);
-    if (result == 0)
+    else
     {
-        fflush(tree->fp);
+        *--end = (char)('0' + v);
     }
-    return result;
+    return end;
 }
 
-int read_node(BTree *tree, uint64_t block_id, BTreeNode *node)
+static int out_flush(OutBuf *out)
 {
-    BTreeNode *cached = get_cached_node(block_id);
-    if (cached)
-    {
-        *node = *cached;
-        return 0;
-    }
-
-    unsigned char block[BLOCK_SIZE];
-    if (read_block(tree->fp, block_id, block) != 0)
-    {
+    if (out->len > 0 && fwrite(out->data, 1, out->len, out->sink) != out->len)
         return -1;
-    }
-
-    uint64_t *fields = (uint64_t *)block;
-    node->block_id = from_big_endian(fields[0]);
-    node->parent_block_id = from_big_endian(fields[1]);
-    node->num_keys = from_big_endian(fields[2]);
+    out->len = 0;
+    return 0;
+}
 
-    for (int i = 0; i < MAX_KEYS; i++)
-    {
-        node->keys[i] = from_big_endian(fields[3 + i]);
-        node->values[i] = from_big_endian(fields[3 + MAX_KEYS + i]);
-    }
+// Append "key,value\n", the same text extract_data() always wrote
+static int out_pair(OutBuf *out, uint64_t key, uint64_t value)
+{
+    char line[EXPORT_MAX_LINE];
+    char *end = line + sizeof(line);
+    *--end = '\n';
+    end = format_u64(end, value);
+    *--end = ',';
+    char *start = format_u64(end, key);
+    size_t n = (size_t)(line + sizeof(line) - start);
 
-    for (int i = 0; i < MAX_CHILDREN; i++)
+    if (out->len + n > out->cap)
     {
-        node->children[i] = from_big_endian(fields[3 + 2 * MAX_KEYS + i]);
+        if (out->sink && out->len > 0)
+        {
+            if (out_flush(out) != 0)
+                return -1;
+        }
+        else
+        {
+            size_t cap = out->cap ? 2 * out->cap : EXPORT_CHUNK;
+            char *data = (char *)realloc(out->data, cap);
+            if (!data)
+                return -1;
+            out->data = data;
+            out->cap = cap;
+        }
     }
-
+    memcpy(out->data + out->len, start, n);
+    out->len += n;
     return 0;
 }
 
-// Tree operations
-int create_btree(BTree *tree, const char *filename)
+// In-order walk of one subtree into `out`
+static int export_subtree(BTree *tree, uint64_t block_id, OutBuf *out)
 {
-    // First close any currently open tree
-    if (tree->is_open)
-    {
-        close_btree(tree);
-    }
-
-    FILE *fp = fopen(filename, "wb+");
-    if (!fp)
+    NodeView view;
+    if (view_open(tree, block_id, &view) != 0)
         return -1;
 
-    tree->fp = fp;
-    tree->is_open = 1;
-    memcpy(tree->header.magic, MAGIC_NUMBER, 8);
-    tree->header.root_block_id = 0;
-    tree->header.next_block_id = 1;
-
-    init_node_cache(); // Reset the cache
+    if (view_is_leaf(&view))
+    {
+        int result = 0;
+        for (uint64_t i = 0; result == 0 && i < view.num_keys; i++)
+        {
+            result = out_pair(out, view_key(&view, i), view_value(&view, i));
+        }
+        view_close(&view);
+        return result;
+    }
+    view_close(&view);
 
-    if (write_header(tree) != 0)
+    // Copy the node out so no frame stays pinned across the recursion
+    BTreeNode *node = alloc_node(tree);
+    if (!node || read_node(tree, block_id, node) != 0)
     {
-        fclose(fp);
-        tree->is_open = 0;
+        free_node(node);
         return -1;
     }
 
-    fflush(fp); // Force write to disk
-    return 0;
+    int pairs = !is_bplus(tree); // B+ interior keys are only separators
+    int result = 0;
+    for (uint64_t i = 0; result == 0 && i <= node->num_keys; i++)
+    {
+        result = export_subtree(tree, node->children[i], out);
+        if (result == 0 && pairs && i < node->num_keys)
+            result = out_pair(out, node->keys[i], node->values[i]);
+    }
+    free_node(node);
+    return result;
 }
 
-int open_btree(BTree *tree, const char *filename)
+/**
+ * Cut the tree into at least `target` tasks where it can, one level at a
+ * time, stopping once the tasks are single leaves. Returns the task count,
+ * or 0 on error.
+ */
+static size_t plan_export(BTree *tree, size_t target, ExportTask **tasks)
 {
-    // First close any currently open tree properly
-    if (tree->is_open)
+    size_t num_tasks = 1;
+    *tasks = (ExportTask *)calloc(1, sizeof(ExportTask));
+    BTreeNode *node = alloc_node(tree);
+    if (!*tasks || !node)
     {
-        close_btree(tree);
+        free(*tasks);
+        free_node(node);
+        return 0;
     }
+    (*tasks)[0].block_id = tree->header.root_block_id;
 
-    FILE *fp = fopen(filename, "rb+");
-    if (!fp)
-        return -1;
+    while (num_tasks < target)
+    {
+        // Every task grows by at most max_keys + 1 children
+        ExportTask *next = (ExportTask *)malloc(num_tasks * (tree->header.max_keys + 1) * sizeof(ExportTask));
+        size_t n = 0;
+        int split_any = 0;
+        for (size_t t = 0; next && t < num_tasks; t++)
+        {
+            ExportTask *task = &(*tasks)[t];
+            if (read_node(tree, task->block_id, node) != 0)
+            {
+                free(next);
+                next = NULL;
+                break;
+            }
+            if (is_leaf(node))
+            {
+                next[n++] = *task;
+                continue;
+            }
 
-    tree->fp = fp;
-    tree->is_open = 1;
+            split_any = 1;
+            for (uint64_t i = 0; i <= node->num_keys; i++)
+            {
+                ExportTask child = {node->children[i], 0, 0, 0};
+                if (i < node->num_keys && !is_bplus(tree))
+                {
+                    child.has_pair = 1;
+                    child.key = node->keys[i];
+                    child.value = node->values[i];
+                }
+                else if (i == node->num_keys)
+                {
+                    child.has_pair = task->has_pair;
+                    child.key = task->key;
+                    child.value = task->value;
+                }
+                next[n++] = child;
+            }
+        }
 
-    if (read_header(tree) != 0 || memcmp(tree->header.magic, MAGIC_NUMBER, 8) != 0)
-    {
-        fclose(fp);
-        tree->is_open = 0;
-        return -1;
+        if (!next)
+        {
+            free(*tasks);
+            free_node(node);
+            return 0;
+        }
+        free(*tasks);
+        *tasks = next;
+        num_tasks = n;
+        if (!split_any)
+            break;
     }
 
-    return 0;
+    free_node(node);
+    return num_tasks;
 }
 
-void close_btree(BTree *tree)
+static void *export_worker(void *arg)
 {
-    if (tree->is_open)
+    ExportJob *job = (ExportJob *)arg;
+    pthread_mutex_lock(&job->lock);
+    for (;;)
     {
-        // Write any dirty nodes in cache
-        clear_node_cache(tree);
+        // Stay within the window so finished buffers do not pile up
+        while (job->next_task < job->num_tasks && job->next_task >= job->written + job->window &&
+               !job->failed)
+            pthread_cond_wait(&job->changed, &job->lock);
+        if (job->next_task >= job->num_tasks || job->failed)
+            break;
+        size_t t = job->next_task++;
+        pthread_mutex_unlock(&job->lock);
 
-        // Ensure header is written
-        write_header(tree);
+        ExportTask *task = &job->tasks[t];
+        OutBuf *out = &job->outputs[t];
+        int result = export_subtree(job->tree, task->block_id, out);
+        if (result == 0 && task->has_pair)
+            result = out_pair(out, task->key, task->value);
 
-        if (tree->fp)
-        {
-            fclose(tree->fp);
-            tree->fp = NULL;
-        }
+        pthread_mutex_lock(&job->lock);
+        if (result != 0)
+            job->failed = 1;
+        job->done[t] = 1;
+        pthread_cond_broadcast(&job->changed);
     }
-    tree->is_open = 0;
+    pthread_mutex_unlock(&job->lock);
+    return NULL;
 }
 
-// Print function
-void print_tree(BTree *tree)
+// Render the tasks on num_threads workers and write them to fp in order
+static int export_parallel(BTree *tree, FILE *fp, ExportTask *tasks, size_t num_tasks, int num_threads)
 {
-    if (!tree->is_open || tree->header.root_block_id == 0)
+    ExportJob job;
+    memset(&job, 0, sizeof(job));
+    job.tree = tree;
+    job.tasks = tasks;
+    job.num_tasks = num_tasks;
+    job.window = 2 * (size_t)num_threads;
+    job.outputs = (OutBuf *)calloc(num_tasks, sizeof(OutBuf));
+    job.done = (int *)calloc(num_tasks, sizeof(int));
+    pthread_t *threads = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+    if (!job.outputs || !job.done || !threads)
     {
-        printf("Tree is empty.\n");
-        return;
-    }
-
-    printf("B-Tree Contents:\n");
-    printf("---------------\n");
-    print_node_recursive(tree, tree->header.root_block_id, 0);
-}
-
-// Data load/extract functions
-int load_data(BTree *tree, const char *filename)
-{
-    if (!tree->is_open)
+        free(job.outputs);
+        free(job.done);
+        free(threads);
         return -1;
+    }
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.changed, NULL);
 
-    FILE *fp = fopen(filename, "r");
-    if (!fp)
-        return -1;
+    int started = 0;
+    while (started < num_threads &&
+           pthread_create(&threads[started], NULL, export_worker, &job) == 0)
+        started++;
 
-    char line[256];
-    int line_num = 0;
-    while (fgets(line, sizeof(line), fp))
+    int result = started > 0 ? 0 : -1;
+    pthread_mutex_lock(&job.lock);
+    if (started == 0)
+        job.failed = 1;
+    while (job.written < num_tasks && !job.failed)
     {
-        line_num++;
-        uint64_t key, value;
+        size_t t = job.written;
+        while (!job.done[t] && !job.failed)
+            pthread_cond_wait(&job.changed, &job.lock);
+        if (job.failed)
+            break;
+        pthread_mutex_unlock(&job.lock);
 
-        if (sscanf(line, "%llu,%llu",
-                   (unsigned long long *)&key,
-                   (unsigned long long *)&value) != 2)
-        {
-            printf("Warning: Invalid format at line %d\n", line_num);
-            continue;
-        }
+        OutBuf *out = &job.outputs[t];
+        int ok = out->len == 0 || fwrite(out->data, 1, out->len, fp) == out->len;
+        free(out->data);
+        out->data = NULL;
 
-        if (insert_key(tree, key, value) != 0)
-        {
-            printf("Warning: Failed to insert key %llu at line %d\n",
-                   (unsigned long long)key, line_num);
-        }
+        pthread_mutex_lock(&job.lock);
+        if (!ok)
+            job.failed = 1;
+        job.written++;
+        pthread_cond_broadcast(&job.changed);
     }
+    if (job.failed)
+        result = -1;
+    pthread_cond_broadcast(&job.changed);
+    pthread_mutex_unlock(&job.lock);
 
-    fclose(fp);
-    return 0;
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    for (size_t t = 0; t < num_tasks; t++)
+    {
+        free(job.outputs[t].data);
+    }
+    pthread_cond_destroy(&job.changed);
+    pthread_mutex_destroy(&job.lock);
+    free(job.outputs);
+    free(job.done);
+    free(threads);
+    return result;
 }
 
+// Write every pair to a CSV file in ascending key order
 int extract_data(BTree *tree, const char *filename)
+{
+    return extract_data_ex(tree, filename, 0);
+}
+
+// extract_data() on num_threads workers (0 = one per CPU)
+int extract_data_ex(BTree *tree, const char *filename, int num_threads)
 {
     if (!tree->is_open || tree->header.root_block_id == 0)
         return -1;
 
+    if (num_threads <= 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        num_threads = cpus > 0 ? (int)cpus : 1;
+    }
+    // A worker pins a frame at a time; leave the pool room for all of them
+    if (tree->pool && (size_t)num_threads > tree->pool->num_frames / 2)
+        num_threads = (int)(tree->pool->num_frames / 2);
+    if (num_threads < 1)
+        num_threads = 1;
+
     FILE *fp = fopen(filename, "w");
     if (!fp)
         return -1;
 
-    write_node_recursive(fp, tree, tree->header.root_block_id);
-
-    fclose(fp);
-    return 0;
-}
-
-static void write_node_recursive(FILE *fp, BTree *tree, uint64_t block_id)
-{
-    if (block_id == 0)
-        return;
-
-    BTreeNode node = {0};
-    read_node(tree, block_id, &node);
-
-    // Write current node's key-value pairs
-    for (int i = 0; i < node.num_keys; i++)
+    int result;
+    ExportTask *tasks = NULL;
+    size_t num_tasks = num_threads > 1 ? plan_export(tree, (size_t)num_threads * EXPORT_TASKS_PER_THREAD, &tasks) : 0;
+    if (num_tasks > 1)
     {
-        fprintf(fp, "%llu,%llu\n",
-                (unsigned long long)node.keys[i],
-                (unsigned long long)node.values[i]);
+        if ((size_t)num_threads > num_tasks)
+            num_threads = (int)num_tasks;
+        result = export_parallel(tree, fp, tasks, num_tasks, num_threads);
     }
-
-    // Recursively process children if not a leaf
-    if (!is_leaf(&node))
+    else
     {
-        for (int i = 0; i <= node.num_keys; i++)
-        {
-            write_node_recursive(fp, tree, node.children[i]);
-        }
+        // One thread, or a tree that is a single leaf: stream straight to the file
+        OutBuf out = {NULL, 0, 0, fp};
+        result = export_subtree(tree, tree->header.root_block_id, &out);
+        if (result == 0)
+            result = out_flush(&out);
+        free(out.data);
     }
+    free(tasks);
+
+    if (fclose(fp) != 0)
+        result = -1;
+    return result;
 }
 
 static void print_node_recursive(BTree *tree, uint64_t block_id, int level)
@@ -595,33 +5656,52 @@ static void print_node_recursive(BTree *tree, uint64_t block_id, int level)
     if (block_id == 0)
         return;
 
-    BTreeNode node = {0};
-    read_node(tree, block_id, &node);
+    NodeView view;
+    if (view_open(tree, block_id, &view) != 0)
+        return;
 
     // Print current node with proper indentation
-    for (int i = 0; i < node.num_keys; i++)
+    for (uint64_t i = 0; i < view.num_keys; i++)
     {
         for (int j = 0; j < level; j++)
         {
             printf("  "); // Two spaces per level for indentation
         }
+        if (view.bplus && !view_is_leaf(&view))
+        {
+            printf("Key: %llu\n", (unsigned long long)view_key(&view, i)); // Separator only
+            continue;
+        }
         printf("Key: %llu, Value: %llu\n",
-               (unsigned long long)node.keys[i],
-               (unsigned long long)node.values[i]);
+               (unsigned long long)view_key(&view, i),
+               (unsigned long long)view_value(&view, i));
     }
 
+    uint64_t *children, num_children;
+    view_take_children(&view, &children, &num_children);
+
     // Recursively print children
-    if (!is_leaf(&node))
+    for (uint64_t i = 0; i < num_children; i++)
     {
-        for (int i = 0; i <= node.num_keys; i++)
-        {
-            print_node_recursive(tree, node.children[i], level + 1);
-        }
+        print_node_recursive(tree, children[i], level + 1);
     }
+    free(children);
 }
 
-// Additional utility function to validate B-tree properties
-static int validate_node(BTree *tree, uint64_t block_id, uint64_t *min_key, uint64_t *max_key)
+// B+ leaves seen so far in key order, to check the sibling links
+typedef struct
+{
+    uint64_t last;      // Last leaf visited (0 before the first)
+    uint64_t last_next; // Its next_leaf link
+} LeafChain;
+
+/**
+ * Additional utility function to validate B-tree properties. min_key and
+ * max_key return the node's key range; for a B+ interior node that is the
+ * range of its subtree, since its own keys are only separators.
+ */
+static int validate_node(BTree *tree, uint64_t block_id, uint64_t *min_key, uint64_t *max_key,
+                         LeafChain *chain)
 {
     if (block_id == 0)
     {
@@ -630,67 +5710,86 @@ static int validate_node(BTree *tree, uint64_t block_id, uint64_t *min_key, uint
         return 1;
     }
 
-    BTreeNode node = {0};
-    read_node(tree, block_id, &node);
-
-    // Check number of keys
-    if (node.num_keys < 0 || node.num_keys > MAX_KEYS)
+    // view_open() rejects a node with more than max_keys keys
+    NodeView view;
+    if (view_open(tree, block_id, &view) != 0)
+    {
+        return 0;
+    }
+    if (view.num_keys == 0)
     {
+        view_close(&view);
         return 0;
     }
 
+    // Each leaf must link back to the one before it, which must link forward to it
+    int bplus = view.bplus;
+    if (bplus && view_is_leaf(&view))
+    {
+        if (view_prev_leaf(&view) != chain->last || (chain->last != 0 && chain->last_next != block_id))
+        {
+            view_close(&view);
+            return 0;
+        }
+        chain->last = block_id;
+        chain->last_next = view_next_leaf(&view);
+    }
+
     // Check key ordering
-    for (int i = 1; i < node.num_keys; i++)
+    uint64_t num_keys = view.num_keys;
+    uint64_t *keys = (uint64_t *)malloc(num_keys * sizeof(uint64_t));
+    if (!keys)
     {
-        if (node.keys[i] <= node.keys[i - 1])
+        view_close(&view);
+        return 0;
+    }
+    keys[0] = view_key(&view, 0);
+    for (uint64_t i = 1; i < num_keys; i++)
+    {
+        keys[i] = view_key(&view, i);
+        if (keys[i] <= keys[i - 1])
         {
+            view_close(&view);
+            free(keys);
             return 0;
         }
     }
 
-    *min_key = node.keys[0];
-    *max_key = node.keys[node.num_keys - 1];
+    *min_key = keys[0];
+    *max_key = keys[num_keys - 1];
+
+    uint64_t *children, num_children;
+    int valid = view_take_children(&view, &children, &num_children) == 0;
 
-    // Recursively validate children
-    if (!is_leaf(&node))
+    // Recursively validate children. Classic separators lie strictly between
+    // their subtrees; a B+ separator is the smallest key of its right subtree.
+    if (valid && num_children > 0)
     {
         uint64_t child_min, child_max;
 
         // Validate leftmost child
-        if (!validate_node(tree, node.children[0], &child_min, &child_max))
-        {
-            return 0;
-        }
-        if (child_max >= node.keys[0])
-        {
-            return 0;
-        }
+        valid = validate_node(tree, children[0], &child_min, &child_max, chain) &&
+                child_max < keys[0];
+        if (bplus)
+            *min_key = child_min;
 
         // Validate middle children
-        for (int i = 1; i < node.num_keys; i++)
+        for (uint64_t i = 1; valid && i < num_keys; i++)
         {
-            if (!validate_node(tree, node.children[i], &child_min, &child_max))
-            {
-                return 0;
-            }
-            if (child_min <= node.keys[i - 1] || child_max >= node.keys[i])
-            {
-                return 0;
-            }
+            valid = validate_node(tree, children[i], &child_min, &child_max, chain) &&
+                    (bplus ? child_min >= keys[i - 1] : child_min > keys[i - 1]) && child_max < keys[i];
         }
 
         // Validate rightmost child
-        if (!validate_node(tree, node.children[node.num_keys], &child_min, &child_max))
-        {
-            return 0;
-        }
-        if (child_min <= node.keys[node.num_keys - 1])
-        {
-            return 0;
-        }
+        valid = valid && validate_node(tree, children[num_keys], &child_min, &child_max, chain) &&
+                (bplus ? child_min >= keys[num_keys - 1] : child_min > keys[num_keys - 1]);
+        if (bplus)
+            *max_key = child_max;
     }
 
-    return 1;
+    free(children);
+    free(keys);
+    return valid;
 }
 
 // Public function to validate entire B-tree
@@ -702,7 +5801,9 @@ int validate_btree(BTree *tree)
         return 1; // Empty tree is valid
 
     uint64_t min_key, max_key;
-    return validate_node(tree, tree->header.root_block_id, &min_key, &max_key);
+    LeafChain chain = {0, 0};
+    return validate_node(tree, tree->header.root_block_id, &min_key, &max_key, &chain) &&
+           chain.last_next == 0;
 }
 
 // Additional helper function to get tree statistics
@@ -721,18 +5822,44 @@ void get_tree_stats(BTree *tree, int *height, int *total_nodes, int *total_keys)
 }
 
 // Function to get cache statistics
-void get_cache_stats(int *num_cached, int *num_dirty)
+void get_cache_stats(BTree *tree, int *num_cached, int *num_dirty)
 {
-    *num_cached = node_cache.count;
+    *num_cached = 0;
     *num_dirty = 0;
+    if (!tree->pool)
+        return;
 
-    for (int i = 0; i < node_cache.count; i++)
+    BufferPool *pool = tree->pool;
+    pthread_mutex_lock(&pool->lock);
+    for (size_t i = 0; i < pool->num_used; i++)
     {
-        if (node_cache.entries[i].is_dirty)
+        if (pool->frames[i].owner == tree)
         {
-            (*num_dirty)++;
+            (*num_cached)++;
+            if (pool->frames[i].is_dirty)
+            {
+                (*num_dirty)++;
+            }
         }
     }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Function to get the hit/miss counters of the pool serving a tree
+void get_pool_stats(BTree *tree, uint64_t *hits, uint64_t *misses, uint64_t *evictions,
+                    uint64_t *writebacks)
+{
+    *hits = *misses = *evictions = *writebacks = 0;
+    if (!tree->pool)
+        return;
+
+    BufferPool *pool = tree->pool;
+    pthread_mutex_lock(&pool->lock);
+    *hits = pool->hits;
+    *misses = pool->misses;
+    *evictions = pool->evictions;
+    *writebacks = pool->writebacks;
+    pthread_mutex_unlock(&pool->lock);
 }
 
 static void count_nodes_recursive(uint64_t block_id, int level, int *height,
@@ -741,19 +5868,22 @@ static void count_nodes_recursive(uint64_t block_id, int level, int *height,
     if (block_id == 0)
         return;
 
-    BTreeNode node = {0};
-    read_node(tree, block_id, &node);
+    NodeView view;
+    if (view_open(tree, block_id, &view) != 0)
+        return;
 
     (*total_nodes)++;
-    (*total_keys) += node.num_keys;
+    if (!view.bplus || view_is_leaf(&view))
+        (*total_keys) += view.num_keys; // B+ separators are copies, not pairs
     if (level > *height)
         *height = level;
 
-    if (!is_leaf(&node))
+    uint64_t *children, num_children;
+    view_take_children(&view, &children, &num_children);
+
+    for (uint64_t i = 0; i < num_children; i++)
     {
-        for (int i = 0; i <= node.num_keys; i++)
-        {
-            count_nodes_recursive(node.children[i], level + 1, height, total_nodes, total_keys, tree);
-        }
+        count_nodes_recursive(children[i], level + 1, height, total_nodes, total_keys, tree);
     }
-}
\ No newline at end of file
+    free(children);
+}
@@ -2,21 +2,25 @@
 #ifndef BTREE_H
 #define BTREE_H
 
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 /**
- * Size of each disk block in bytes.
+ * Default size of each disk block in bytes.
  */
 #define BLOCK_SIZE 512
 
 /**
- * B-Tree order parameters:
+ * B-Tree order parameters for the default BLOCK_SIZE:
  * - MAX_KEYS (19): Maximum number of keys per node, derived from minimal degree t=10
  * - MAX_CHILDREN (20): Maximum number of children per node (always MAX_KEYS + 1)
  *
+ * Trees created with a larger block size store header.max_keys keys per node
+ * instead, the largest odd count whose node still fits the block.
+ *
  * These values ensure that:
  * - Each node (except root) is at least half full
  * - A non-leaf node with k keys must have k+1 children
@@ -25,12 +29,86 @@
 #define MAX_KEYS 19
 #define MAX_CHILDREN (MAX_KEYS + 1)
 
+/**
+ * Block sizes accepted by create_btree_ex(): powers of two in this range.
+ * The header always fits in the smallest block, which is how open_btree()
+ * reads it before it knows the tree's real block size.
+ */
+#define BTREE_MIN_BLOCK_SIZE 512
+#define BTREE_MAX_BLOCK_SIZE 65536
+
 /**
  * Magic number used to identify valid B-Tree files.
  * This helps prevent accidental processing of non-B-Tree files.
  */
 #define MAGIC_NUMBER "4337PRJ3"
 
+/**
+ * On-disk format versions:
+ * - BTREE_FORMAT_V1: every node word big-endian (the original project format)
+ * - BTREE_FORMAT_V2: every node word little-endian, so x86 hosts read nodes
+ *   without byte-swapping
+ *
+ * Both versions share the same block layout. Header fields are big-endian in
+ * every version so that any reader can detect which one it is looking at.
+ */
+#define BTREE_FORMAT_V1 1
+#define BTREE_FORMAT_V2 2
+
+/**
+ * Header flags. open_btree() rejects a file with any flag outside
+ * BTREE_KNOWN_FLAGS rather than misreading it.
+ * - BTREE_FLAG_BPLUS: nodes use the B+tree layout (BTREE_LAYOUT_BPLUS)
+ * - BTREE_FLAG_APPEND_ONLY: committed blocks are never rewritten (see
+ *   BTreeCreateOptions.append_only)
+ * - BTREE_FLAG_COMPRESSED: nodes use the compressed encoding (see
+ *   BTreeCreateOptions.compressed)
+ */
+#define BTREE_FLAG_BPLUS 0x1
+#define BTREE_FLAG_APPEND_ONLY 0x2
+#define BTREE_FLAG_COMPRESSED 0x4
+#define BTREE_KNOWN_FLAGS (BTREE_FLAG_BPLUS | BTREE_FLAG_APPEND_ONLY | BTREE_FLAG_COMPRESSED)
+
+/**
+ * Node layouts, chosen when a file is created:
+ * - BTREE_LAYOUT_BTREE: every node holds key/value pairs and interior pairs
+ *   sit between their children (the original layout)
+ * - BTREE_LAYOUT_BPLUS: pairs live only in leaves, which link to their
+ *   neighbours; interior nodes hold separator keys and child pointers. A
+ *   512-byte block fits 28 keys per node instead of 19, and ordered scans
+ *   walk the leaf chain instead of climbing back up the tree.
+ */
+typedef enum
+{
+    BTREE_LAYOUT_BTREE = 0,
+    BTREE_LAYOUT_BPLUS
+} BTreeLayout;
+
+/**
+ * Buffer pool sizing:
+ * - BTREE_DEFAULT_CACHE_FRAMES: frames allocated when BTree.cache_frames is 0
+ * - BTREE_MIN_CACHE_FRAMES: smallest pool accepted (an insert touches up to 3 nodes)
+ * - BTREE_MIN_WAL_CACHE_FRAMES: smallest pool a BTREE_DURABILITY_WAL handle
+ *   uses. A logged write keeps every block it changes in the pool until it
+ *   commits; this leaves room for a write on a tree a dozen levels deep.
+ *
+ * Each frame holds one block, so the default pool uses 128 KiB with 512-byte
+ * blocks and 1 MiB with 4 KiB blocks.
+ */
+#define BTREE_DEFAULT_CACHE_FRAMES 256
+#define BTREE_MIN_CACHE_FRAMES 3
+#define BTREE_MIN_WAL_CACHE_FRAMES 64
+
+/**
+ * Buffer pool shared by several handles, made with create_buffer_pool().
+ * Its frames are keyed by (tree, block), so one process can keep many index
+ * files open within a single memory budget. frame_size is the largest block
+ * size the pool serves; opening a file with bigger blocks through it fails.
+ * Handles on one pool can be used from different threads. Close them all
+ * before destroy_buffer_pool().
+ */
+typedef struct BufferPool BufferPool;
+
 /**
  * B-Tree Node Structure
  * --------------------
@@ -38,15 +116,21 @@
  * - Metadata (block ID, parent reference)
  * - Keys and associated values
  * - Child pointers
+ *
+ * The arrays are sized by the tree's max_keys and live in the same
+ * allocation as the node itself. In the B+tree layout interior nodes leave
+ * values unused and leaves leave children unused.
  */
 typedef struct
 {
-    uint64_t block_id;               // Unique identifier for this node's disk block
-    uint64_t parent_block_id;        // Block ID of this node's parent (0 if root)
-    uint64_t num_keys;               // Current number of keys stored in this node
-    uint64_t keys[MAX_KEYS];         // Array of keys in ascending order
-    uint64_t values[MAX_KEYS];       // Array of values corresponding to keys
-    uint64_t children[MAX_CHILDREN]; // Block IDs of child nodes
+    uint64_t block_id;        // Unique identifier for this node's disk block
+    uint64_t parent_block_id; // Block ID of this node's parent (0 if root)
+    uint64_t num_keys;        // Current number of keys stored in this node
+    uint64_t *keys;           // max_keys keys in ascending order
+    uint64_t *values;         // max_keys values corresponding to keys
+    uint64_t *children;       // max_keys + 1 block IDs of child nodes
+    uint64_t prev_leaf;       // B+tree leaves: previous leaf in key order (0 if first)
+    uint64_t next_leaf;       // B+tree leaves: next leaf in key order (0 if last)
 } BTreeNode;
 
 /**
@@ -56,14 +140,173 @@ typedef struct
  * - Magic number for file verification
  * - Root node location
  * - Block allocation tracking
+ * - Format version and feature flags
+ * - Block size and keys per node
+ *
+ * The later fields follow the original ones, in bytes that early files left
+ * zero; zeros there are read as BTREE_FORMAT_V1, BLOCK_SIZE, MAX_KEYS, an
+ * empty free list and no checkpoint.
+ *
+ * Blocks released by delete_key() form the free list: a free block is zero
+ * except for its second word, the next free block (0 ends the list). New
+ * nodes are taken from the list before the file grows. An append-only file
+ * never reuses a block, so its list stays empty.
  */
 typedef struct
 {
-    char magic[8];          // Magic number to identify valid B-Tree files
-    uint64_t root_block_id; // Block ID of the root node
-    uint64_t next_block_id; // Next available block ID for allocation
+    char magic[8];           // Magic number to identify valid B-Tree files
+    uint64_t root_block_id;  // Block ID of the root node
+    uint64_t next_block_id;  // Next available block ID for allocation
+    uint64_t format_version; // BTREE_FORMAT_V1 or BTREE_FORMAT_V2
+    uint64_t flags;          // Feature flags; files with unknown flags are rejected
+    uint64_t block_size;     // Bytes per block, header included
+    uint64_t max_keys;       // Keys per full node
+    uint64_t free_block_id;  // First block on the free list (0 if the list is empty)
+    uint64_t checkpoint_lsn; // Every logged change up to this LSN is in the file
 } BTreeHeader;
 
+/**
+ * Options for create_btree_ex(). Zeroed fields select the defaults.
+ *
+ * append_only makes every write copy-on-write. A changed node and each of
+ * its ancestors up to the root go to new blocks at the end of the file,
+ * and a commit rewrites only the header, whose root_block_id then points at
+ * the new tree. Blocks the header on disk can reach are never overwritten,
+ * so a crash leaves the tree as of the last commit, and the replaced blocks
+ * stay dead until compact_btree() copies the live tree out. Only the
+ * BTREE_LAYOUT_BTREE layout can be append-only: B+ leaves link to their
+ * neighbours, so moving one would move the whole leaf level. The log of
+ * BTREE_DURABILITY_WAL is not used with it.
+ *
+ * compressed stores each node's keys as its first key followed by varint
+ * gaps, and its child block IDs in as few bits as the largest one needs.
+ * Values stay whole words. How many pairs a node holds then depends on the
+ * keys: dense keys fit several times the plain fanout, so the tree is
+ * shallower and a scan reads fewer blocks, at the cost of decoding each
+ * node's keys when it is read. header.max_keys is the most any node can
+ * hold. Compressed trees need the BTREE_LAYOUT_BPLUS layout and cannot be
+ * append-only.
+ */
+typedef struct
+{
+    uint64_t format_version; // On-disk format (default BTREE_FORMAT_V1)
+    uint64_t block_size;     // Bytes per block (default BLOCK_SIZE)
+    BTreeLayout layout;      // Node layout (default BTREE_LAYOUT_BTREE)
+    int append_only;         // 1 to write copy-on-write (default 0, update in place)
+    int compressed;          // 1 for compressed nodes (default 0, fixed-size arrays)
+} BTreeCreateOptions;
+
+/**
+ * Durability Modes
+ * ----------------
+ * Controls when modified blocks and the header are written and fsync'd:
+ * - PER_OP: every insert or delete is synced before it returns (default)
+ * - PER_BATCH: synced once at the end of load_data(), by btree_sync() and on close
+ * - NONE: written back only on eviction, btree_sync() or close; close does not fsync
+ * - WAL: every insert or delete is appended to a redo log next to the file
+ *   (its name plus "-wal") and the log is synced before it returns. Blocks
+ *   reach the file itself at checkpoints: when the log passes
+ *   BTree.checkpoint_bytes, on btree_sync() and on close. Only STDIO handles
+ *   can use it.
+ *
+ * open_btree() replays a log left by a WAL handle that did not close, in
+ * any mode, so the tree comes back as of its last commit. A read-only
+ * handle cannot replay and refuses such a file.
+ */
+typedef enum
+{
+    BTREE_DURABILITY_PER_OP = 0,
+    BTREE_DURABILITY_PER_BATCH,
+    BTREE_DURABILITY_NONE,
+    BTREE_DURABILITY_WAL
+} BTreeDurability;
+
+/**
+ * Log size at which a BTREE_DURABILITY_WAL handle checkpoints when
+ * BTree.checkpoint_bytes is 0.
+ */
+#define BTREE_DEFAULT_CHECKPOINT_BYTES (16u * 1024 * 1024)
+
+/**
+ * Redo log state of a BTREE_DURABILITY_WAL handle, private to btree.c.
+ */
+typedef struct BTreeLog BTreeLog;
+
+/**
+ * Open snapshots of a handle and the blocks they keep alive, private to
+ * btree.c.
+ */
+typedef struct BTreeSnapshots BTreeSnapshots;
+
+/**
+ * I/O Modes
+ * ---------
+ * Chosen when a file is created or opened:
+ * - STDIO: blocks are read and written through the buffer pool (default)
+ * - MMAP_READONLY: the file is mapped read-only and lookups read mapped pages
+ *   directly; inserts fail. Several processes can share one index this way.
+ * - MMAP: mapped read-write; node writes go straight to the mapping and
+ *   btree_sync() uses msync(). The file grows with next_block_id.
+ */
+typedef enum
+{
+    BTREE_IO_STDIO = 0,
+    BTREE_IO_MMAP_READONLY,
+    BTREE_IO_MMAP
+} BTreeIOMode;
+
+/**
+ * Input formats accepted by load_data_ex():
+ * - BTREE_INPUT_CSV: "key,value" lines of decimal numbers (what load_data() reads)
+ * - BTREE_INPUT_BINARY: 16-byte records, a little-endian u64 key then value
+ */
+typedef enum
+{
+    BTREE_INPUT_CSV = 0,
+    BTREE_INPUT_BINARY
+} BTreeInputFormat;
+
+#define BTREE_LOAD_REPORTED_LINES 8 // Malformed line numbers kept in a BTreeLoadReport
+
+/**
+ * Outcome of a load_data_ex() call. Bad lines are skipped and summarized
+ * here instead of being reported one at a time; line numbers are 1-based
+ * (record numbers for binary input).
+ */
+typedef struct
+{
+    uint64_t records;   // Lines or records read, bad ones included
+    uint64_t loaded;    // Pairs handed to the tree
+    uint64_t malformed; // Lines that did not parse, or a truncated final record
+    uint64_t malformed_lines[BTREE_LOAD_REPORTED_LINES]; // The first few of them
+    uint64_t failed;       // Pairs the tree rejected
+    uint64_t first_failed; // Line of the first rejected pair
+    double seconds;        // Wall time so far; loaded / seconds is the throughput
+} BTreeLoadReport;
+
+/**
+ * Called by load_data() about once a second while pairs are applied, and
+ * once more when the load ends. Until that last call only loaded, failed
+ * and seconds are filled in.
+ */
+typedef void (*BTreeLoadProgress)(void *ctx, const BTreeLoadReport *report);
+
+/**
+ * Read Modes
+ * ----------
+ * How search_key() keeps out of the writer's way; may be changed at any time:
+ * - LATCHED: latch each node shared and crab down the tree (default)
+ * - OPTIMISTIC: pin nodes without latching them, check each node's version
+ *   after reading it and restart from the root if a writer got in between.
+ *   After a few restarts the lookup falls back to latching. Mapped handles
+ *   always latch (they have no versions).
+ */
+typedef enum
+{
+    BTREE_READS_LATCHED = 0,
+    BTREE_READS_OPTIMISTIC
+} BTreeReadMode;
+
 /**
  * B-Tree Handle Structure
  * ----------------------
@@ -71,25 +314,162 @@ typedef struct
  * - File access
  * - Header information
  * - Status tracking
+ * - Configuration read at create/open time
+ * - Locks for concurrent use
+ *
+ * An open handle may be shared by threads: any number of threads can call
+ * search_key() while one thread at a time inserts. Writers (insert_key(),
+ * insert_if_absent(), upsert_key(), delete_key(), load_data(),
+ * bulk_load_sorted(), btree_sync()) are serialized by writer_lock. Readers
+ * latch nodes shared and crab down the tree, holding a node until its child
+ * is latched, so a concurrent split never hides a key (or, with
+ * BTREE_READS_OPTIMISTIC, validate node versions instead).
+ * Cursors, range_scan(), search_keys_batch(), extract_data() and the
+ * walkers hold no latches between nodes and need the writer to be idle.
+ * Open, create and close are not thread-safe, and a BTREE_IO_MMAP handle
+ * is shared only by readers (its mapping can move when the file grows).
+ * A reader pins two frames at once, so give the pool at least two frames
+ * per reader thread plus BTREE_MIN_CACHE_FRAMES for the writer; when every
+ * frame is pinned, operations fail instead of waiting.
+ *
+ * btree_snapshot() fills a second, read-only handle that pins the tree as
+ * it stood between two writes. Lookups, cursors and scans on it see that
+ * tree while the writer carries on (see btree_snapshot()).
  */
-typedef struct
+typedef struct BTree
 {
-    FILE *fp;           // File handle for persistent storage
-    BTreeHeader header; // Cached copy of the file header
-    int is_open;        // Flag indicating if the B-Tree is currently open
+    FILE *fp;            // File handle for persistent storage
+    BTreeHeader header;  // Cached copy of the file header
+    int is_open;         // Flag indicating if the B-Tree is currently open
+    size_t cache_frames; // Buffer pool frames to allocate on create/open (0 = default)
+    BTreeDurability durability; // When changes are synced to disk
+    uint64_t checkpoint_bytes; // WAL: checkpoint once the log reaches this size (0 = default)
+    int header_dirty;    // 1 if the header changed since it was last written
+    BTreeIOMode io_mode; // How the file is accessed
+    BTreeReadMode read_mode; // How search_key() synchronizes with the writer
+    BTreeLoadProgress load_progress; // Optional progress callback for load_data()
+    void *load_progress_ctx;
+    int read_only;       // 1 if the file was opened read-only
+    BufferPool *shared_pool; // Pool to use on create/open (NULL = a private pool of cache_frames)
+    BufferPool *pool;    // Pool serving this handle while it is open (NULL when mapped)
+    unsigned char *scratch; // Block the writer builds before copying it into a frame
+    unsigned char *map;  // Base of the file mapping (NULL in STDIO mode)
+    size_t map_size;     // Bytes currently mapped
+    int swap_words;      // 1 if node words must be byte-swapped on this host
+    uint64_t committed_blocks; // Append-only: blocks below this id are on disk under the header and never rewritten
+    BTreeLog *log;       // Redo log while open with BTREE_DURABILITY_WAL (else NULL)
+    pthread_rwlock_t root_latch; // Guards header.root_block_id while readers find the root
+    pthread_mutex_t writer_lock; // Held (recursively) by the thread changing the tree
+    struct BTree *base;  // Snapshot: the handle it was taken from (else NULL)
+    uint64_t snapshot_version; // Snapshot: its place among the base's snapshots, from 1
+    BTreeSnapshots *snapshots; // Snapshots of this handle, once one has been asked for
+    pthread_mutex_t snapshot_lock; // Guards snapshots
+    pthread_cond_t snapshot_taken; // Signalled when the writer takes waiting snapshots
 } BTree;
 
+/**
+ * Sorted key/value stream consumed by bulk_load_sorted().
+ * Returns 1 and stores the next pair through key and value, 0 at end of stream,
+ * or -1 on error. Keys must be non-decreasing; for repeated keys the last
+ * value wins.
+ */
+typedef int (*BTreeKVSource)(void *ctx, uint64_t *key, uint64_t *value);
+
+/**
+ * Deepest tree a cursor can walk. Non-root nodes have at least 10 children,
+ * so this is far beyond any file the block id space can address.
+ */
+#define BTREE_CURSOR_MAX_DEPTH 32
+
+/**
+ * Ordered Cursor
+ * --------------
+ * Walks the tree's pairs in ascending key order in either direction. The
+ * cursor keeps only the path from the root to its position, one entry per
+ * level, and pins no pages between calls, so its memory use does not depend
+ * on the size of the tree.
+ *
+ * btree_seek(), btree_seek_last(), cursor_next() and cursor_prev() return 1
+ * when the cursor is on a pair (see key and value), 0 when it has run off
+ * the end, or -1 on error. Any insert or delete invalidates the tree's
+ * cursors; seek again afterwards.
+ */
+typedef struct
+{
+    struct
+    {
+        uint64_t block_id;
+        uint64_t index;    // Key index at the last level, child index above it
+        uint64_t num_keys; // Keys in the node when it was visited
+    } path[BTREE_CURSOR_MAX_DEPTH];
+    BTree *tree;    // Tree the cursor walks
+    int depth;      // Levels in path; 0 when the cursor is not on a pair
+    uint64_t key;   // Current pair
+    uint64_t value;
+} BTreeCursor;
+
+/**
+ * Called by range_scan() for each pair in order. Return 0 to continue; any
+ * other value stops the scan and is returned by range_scan().
+ */
+typedef int (*BTreeScanCallback)(void *ctx, uint64_t key, uint64_t value);
+
 /**
  * Function Prototypes
  * ------------------
  */
 int create_btree(BTree *tree, const char *filename);
+int create_btree_ex(BTree *tree, const char *filename, const BTreeCreateOptions *options);
+// Keys per node (the header's max_keys) for a block size and header flags; 0 if invalid
+uint64_t btree_keys_per_node(uint64_t block_size, uint64_t flags);
+int convert_btree(const char *src_filename, const char *dst_filename, uint64_t format_version);
+int compact_btree(const char *src_filename, const char *dst_filename);
 int open_btree(BTree *tree, const char *filename);
 void close_btree(BTree *tree);
+
+/**
+ * btree_snapshot(tree, &snapshot) fills `snapshot` with a read-only handle
+ * on the tree as it stands between two writes, and returns 0 (or -1 on
+ * error). If a write is under way the call waits for the writer's next
+ * pause: the end of the current operation, or of the current batch during
+ * load_data(). The final build of a load into an empty tree has no such
+ * pause. search_key(), search_keys_batch(), cursors, range_scan() and
+ * extract_data() on the snapshot need no idle writer, because the blocks it
+ * reads are never rewritten while it is open: the writer shadows them like
+ * an append-only file does and keeps the blocks it replaces off the free
+ * list until every snapshot that can reach them is closed.
+ *
+ * The snapshot reads through the tree's buffer pool and must be closed with
+ * close_btree() before the tree is. Snapshots need the BTREE_LAYOUT_BTREE
+ * layout and a BTREE_IO_STDIO handle. Blocks kept for snapshots when the
+ * program stops are lost to the file until it is compacted.
+ */
+int btree_snapshot(BTree *tree, BTree *snapshot);
 int insert_key(BTree *tree, uint64_t key, uint64_t value);
+int insert_if_absent(BTree *tree, uint64_t key, uint64_t value);
+int upsert_key(BTree *tree, uint64_t key, uint64_t value);
+int delete_key(BTree *tree, uint64_t key);
 int search_key(BTree *tree, uint64_t key, uint64_t *value);
+int search_keys_batch(BTree *tree, const uint64_t *keys, size_t n, uint64_t *values, int *found);
+int btree_seek(BTree *tree, BTreeCursor *cursor, uint64_t key);
+int btree_seek_last(BTree *tree, BTreeCursor *cursor);
+int cursor_next(BTreeCursor *cursor);
+int cursor_prev(BTreeCursor *cursor);
+int range_scan(BTree *tree, uint64_t lo, uint64_t hi, BTreeScanCallback callback, void *ctx);
+int btree_sync(BTree *tree);
 int load_data(BTree *tree, const char *filename);
+int load_data_ex(BTree *tree, const char *filename, BTreeInputFormat format,
+                 BTreeLoadReport *report);
 int extract_data(BTree *tree, const char *filename);
+int extract_data_ex(BTree *tree, const char *filename, int num_threads);
+int bulk_load_sorted(BTree *tree, BTreeKVSource next, void *ctx, double fill_factor);
 void print_tree(BTree *tree);
+int validate_btree(BTree *tree);
+void get_tree_stats(BTree *tree, int *height, int *total_nodes, int *total_keys);
+BufferPool *create_buffer_pool(size_t num_frames, size_t frame_size);
+void destroy_buffer_pool(BufferPool *pool);
+void get_cache_stats(BTree *tree, int *num_cached, int *num_dirty);
+void get_pool_stats(BTree *tree, uint64_t *hits, uint64_t *misses, uint64_t *evictions,
+                    uint64_t *writebacks);
 
 #endif /* BTREE_H */
\ No newline at end of file
@@ -0,0 +1,218 @@
+// btree_bench.c
+// Lookup throughput with concurrent readers in each read mode, with and without an appending writer
+#define _POSIX_C_SOURCE 200809L
+#include "btree.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NUM_KEYS 1000000      // Keys bulk-loaded before the runs
+#define BENCH_BLOCK_SIZE 4096
+#define BENCH_FRAMES 16384    // Enough frames to keep the whole tree cached
+#define RUN_SECONDS 1.0
+
+typedef struct
+{
+    BTree *tree;
+    uint64_t seed;
+    uint64_t lookups;
+    int failed;
+} ReaderArgs;
+
+typedef struct
+{
+    BTree *tree;
+    uint64_t appends;
+    int failed;
+} WriterArgs;
+
+static int stop;            // Set when a run's time is up
+static uint64_t next_append; // Next key the writer appends, above every loaded key
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t next_random(uint64_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+// Loaded keys are the even numbers below 2 * NUM_KEYS, each mapped to key + 1
+static int even_keys(void *ctx, uint64_t *key, uint64_t *value)
+{
+    uint64_t *i = (uint64_t *)ctx;
+    if (*i == NUM_KEYS)
+        return 0;
+    *key = 2 * (*i)++;
+    *value = *key + 1;
+    return 1;
+}
+
+static void *reader_main(void *arg)
+{
+    ReaderArgs *args = (ReaderArgs *)arg;
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED))
+    {
+        uint64_t key = 2 * (next_random(&args->seed) % NUM_KEYS);
+        uint64_t value;
+        if (search_key(args->tree, key, &value) != 0 || value != key + 1)
+        {
+            args->failed = 1;
+            break;
+        }
+        args->lookups++;
+    }
+    return NULL;
+}
+
+static void *writer_main(void *arg)
+{
+    WriterArgs *args = (WriterArgs *)arg;
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED))
+    {
+        if (insert_key(args->tree, next_append, next_append + 1) != 0)
+        {
+            args->failed = 1;
+            break;
+        }
+        next_append += 2;
+        args->appends++;
+    }
+    return NULL;
+}
+
+/**
+ * Run `num_readers` readers for RUN_SECONDS, plus the writer if asked.
+ * Returns lookups per second, or -1 if a lookup or insert went wrong.
+ */
+static double run(BTree *tree, BTreeReadMode mode, int num_readers, int with_writer,
+                  double *appends_per_sec)
+{
+    ReaderArgs *readers = (ReaderArgs *)calloc(num_readers, sizeof(ReaderArgs));
+    pthread_t *threads = (pthread_t *)malloc(num_readers * sizeof(pthread_t));
+    WriterArgs writer = {tree, 0, 0};
+    pthread_t writer_thread;
+    if (!readers || !threads)
+    {
+        free(readers);
+        free(threads);
+        return -1;
+    }
+
+    tree->read_mode = mode;
+    __atomic_store_n(&stop, 0, __ATOMIC_RELAXED);
+    double start = now_seconds();
+    for (int i = 0; i < num_readers; i++)
+    {
+        readers[i].tree = tree;
+        readers[i].seed = 0x9E3779B97F4A7C15ULL * (i + 1);
+        pthread_create(&threads[i], NULL, reader_main, &readers[i]);
+    }
+    if (with_writer)
+        pthread_create(&writer_thread, NULL, writer_main, &writer);
+
+    struct timespec pause = {0, 10000000};
+    while (now_seconds() - start < RUN_SECONDS)
+        nanosleep(&pause, NULL);
+    __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+
+    uint64_t lookups = 0;
+    int failed = 0;
+    for (int i = 0; i < num_readers; i++)
+    {
+        pthread_join(threads[i], NULL);
+        lookups += readers[i].lookups;
+        failed |= readers[i].failed;
+    }
+    if (with_writer)
+    {
+        pthread_join(writer_thread, NULL);
+        failed |= writer.failed;
+    }
+    double elapsed = now_seconds() - start;
+
+    free(readers);
+    free(threads);
+    *appends_per_sec = writer.appends / elapsed;
+    return failed ? -1 : lookups / elapsed;
+}
+
+// Build a fresh tree, so every writer run starts from the same shape
+static int build_tree(BTree *tree, const char *filename)
+{
+    BTreeCreateOptions options = {0};
+    options.block_size = BENCH_BLOCK_SIZE;
+    tree->cache_frames = BENCH_FRAMES;
+    tree->durability = BTREE_DURABILITY_NONE;
+
+    uint64_t loaded = 0;
+    next_append = 2 * NUM_KEYS;
+    return create_btree_ex(tree, filename, &options) == 0 &&
+                   bulk_load_sorted(tree, even_keys, &loaded, 0.9) == 0
+               ? 0
+               : -1;
+}
+
+int main(void)
+{
+    char filename[] = "/tmp/btree-bench-XXXXXX";
+    int fd = mkstemp(filename);
+    if (fd < 0)
+    {
+        perror("mkstemp");
+        return 1;
+    }
+    close(fd);
+
+    BTree tree = {0};
+    long nproc = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nproc < 1)
+        nproc = 1;
+
+    printf("%d keys, %d-byte blocks, %.1f s per run\n\n", NUM_KEYS, BENCH_BLOCK_SIZE, RUN_SECONDS);
+    printf("lookups/s per read mode, alone and alongside the writer (appends/s)\n");
+    printf("%-8s %14s %14s %12s %14s %14s %12s\n", "readers", "latched", "+writer", "appends/s",
+           "optimistic", "+writer", "appends/s");
+
+    int status = 0;
+    for (long n = 1; status == 0; n = n * 2 > nproc && n < nproc ? nproc : n * 2)
+    {
+        printf("%-8ld", n);
+        for (int mode = BTREE_READS_LATCHED; mode <= BTREE_READS_OPTIMISTIC; mode++)
+        {
+            if (build_tree(&tree, filename) != 0)
+            {
+                fprintf(stderr, "\nFailed to build the benchmark tree\n");
+                status = 1;
+                break;
+            }
+
+            double appends;
+            double alone = run(&tree, (BTreeReadMode)mode, (int)n, 0, &appends);
+            double shared = run(&tree, (BTreeReadMode)mode, (int)n, 1, &appends);
+            if (alone < 0 || shared < 0)
+            {
+                fprintf(stderr, "\nA lookup or insert failed with %ld readers\n", n);
+                status = 1;
+                break;
+            }
+            printf(" %14.0f %14.0f %12.0f", alone, shared, appends);
+        }
+        printf("\n");
+        if (n >= nproc)
+            break;
+    }
+
+    close_btree(&tree);
+    unlink(filename);
+    return status;
+}
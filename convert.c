@@ -0,0 +1,40 @@
+// convert.c
+#define _POSIX_C_SOURCE 200809L // pthread_rwlock_t in btree.h
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "btree.h"
+
+// Offline tool: rewrite an index file in another on-disk format version, or compact it
+int main(int argc, char *argv[])
+{
+    if (argc == 4 && strcmp(argv[1], "--compact") == 0)
+    {
+        if (compact_btree(argv[2], argv[3]) != 0)
+        {
+            fprintf(stderr, "Error compacting %s.\n", argv[2]);
+            return 1;
+        }
+        printf("Compacted %s to %s.\n", argv[2], argv[3]);
+        return 0;
+    }
+
+    if (argc < 3 || argc > 4)
+    {
+        fprintf(stderr, "Usage: %s <source index> <destination index> [format version]\n", argv[0]);
+        fprintf(stderr, "       %s --compact <source index> <destination index>\n", argv[0]);
+        fprintf(stderr, "Format version defaults to %d (little-endian).\n", BTREE_FORMAT_V2);
+        return 1;
+    }
+
+    uint64_t version = argc == 4 ? strtoull(argv[3], NULL, 10) : BTREE_FORMAT_V2;
+
+    if (convert_btree(argv[1], argv[2], version) != 0)
+    {
+        fprintf(stderr, "Error converting %s to format v%llu.\n", argv[1], (unsigned long long)version);
+        return 1;
+    }
+
+    printf("Converted %s to %s (format v%llu).\n", argv[1], argv[2], (unsigned long long)version);
+    return 0;
+}
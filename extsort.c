@@ -0,0 +1,329 @@
+// extsort.c
+#include "extsort.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define RUN_BUFFER_SIZE (256 * 1024) // stdio buffer for each run during a merge
+
+typedef struct
+{
+    uint64_t key;
+    uint64_t value;
+    uint64_t seq; // Position in the input, so later pairs win ties
+} SortRecord;
+
+typedef struct
+{
+    uint64_t key;
+    uint64_t value;
+} RunRecord;
+
+// A sorted, duplicate-free run spilled to a temp file
+typedef struct
+{
+    FILE *fp;
+    char *buffer;     // stdio buffer while the run is being merged
+    RunRecord head;   // Current record
+    int has_head;
+} Run;
+
+// k-way merge over runs; runs with a higher index hold newer pairs
+typedef struct
+{
+    Run *runs;
+    size_t num_runs;
+    size_t *heap;     // Run indices ordered by (head.key, run index)
+    size_t heap_size;
+} Merger;
+
+struct ExternalSorter
+{
+    SortRecord *buffer;
+    size_t capacity;
+    size_t count;
+    uint64_t next_seq;
+    Run *runs;
+    size_t num_runs;
+    size_t runs_capacity;
+    Merger merger;
+    int finished;
+};
+
+static int compare_records(const void *a, const void *b)
+{
+    const SortRecord *x = (const SortRecord *)a;
+    const SortRecord *y = (const SortRecord *)b;
+    if (x->key != y->key)
+        return (x->key > y->key) - (x->key < y->key);
+    return (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+static int run_advance(Run *run)
+{
+    run->has_head = fread(&run->head, sizeof(RunRecord), 1, run->fp) == 1;
+    return run->has_head;
+}
+
+static void run_close(Run *run)
+{
+    if (run->fp)
+        fclose(run->fp);
+    free(run->buffer);
+    memset(run, 0, sizeof(*run));
+}
+
+static int push_run(ExternalSorter *sorter, FILE *fp)
+{
+    if (sorter->num_runs == sorter->runs_capacity)
+    {
+        size_t capacity = sorter->runs_capacity ? sorter->runs_capacity * 2 : 16;
+        Run *runs = (Run *)realloc(sorter->runs, capacity * sizeof(Run));
+        if (!runs)
+            return -1;
+        sorter->runs = runs;
+        sorter->runs_capacity = capacity;
+    }
+
+    memset(&sorter->runs[sorter->num_runs], 0, sizeof(Run));
+    sorter->runs[sorter->num_runs++].fp = fp;
+    return 0;
+}
+
+// Sort the in-memory buffer and write it out as one run, keeping the last of each key
+static int spill_run(ExternalSorter *sorter)
+{
+    if (sorter->count == 0)
+        return 0;
+
+    qsort(sorter->buffer, sorter->count, sizeof(SortRecord), compare_records);
+
+    FILE *fp = tmpfile();
+    if (!fp)
+        return -1;
+
+    for (size_t i = 0; i < sorter->count; i++)
+    {
+        if (i + 1 < sorter->count && sorter->buffer[i + 1].key == sorter->buffer[i].key)
+            continue; // A later pair for the same key follows
+
+        RunRecord record = {sorter->buffer[i].key, sorter->buffer[i].value};
+        if (fwrite(&record, sizeof(record), 1, fp) != 1)
+        {
+            fclose(fp);
+            return -1;
+        }
+    }
+
+    if (push_run(sorter, fp) != 0)
+    {
+        fclose(fp);
+        return -1;
+    }
+    sorter->count = 0;
+    return 0;
+}
+
+// Heap order: smaller key first; for equal keys the newer run first
+static int heap_less(const Merger *merger, size_t a, size_t b)
+{
+    const RunRecord *x = &merger->runs[a].head;
+    const RunRecord *y = &merger->runs[b].head;
+    if (x->key != y->key)
+        return x->key < y->key;
+    return a > b;
+}
+
+static void heap_sift_down(Merger *merger, size_t i)
+{
+    for (;;)
+    {
+        size_t smallest = i;
+        size_t left = 2 * i + 1, right = 2 * i + 2;
+
+        if (left < merger->heap_size && heap_less(merger, merger->heap[left], merger->heap[smallest]))
+            smallest = left;
+        if (right < merger->heap_size && heap_less(merger, merger->heap[right], merger->heap[smallest]))
+            smallest = right;
+        if (smallest == i)
+            return;
+
+        size_t tmp = merger->heap[i];
+        merger->heap[i] = merger->heap[smallest];
+        merger->heap[smallest] = tmp;
+        i = smallest;
+    }
+}
+
+static int merger_open(Merger *merger, Run *runs, size_t num_runs)
+{
+    merger->runs = runs;
+    merger->num_runs = num_runs;
+    merger->heap_size = 0;
+    merger->heap = (size_t *)malloc((num_runs ? num_runs : 1) * sizeof(size_t));
+    if (!merger->heap)
+        return -1;
+
+    for (size_t i = 0; i < num_runs; i++)
+    {
+        runs[i].buffer = (char *)malloc(RUN_BUFFER_SIZE);
+        if (runs[i].buffer)
+            setvbuf(runs[i].fp, runs[i].buffer, _IOFBF, RUN_BUFFER_SIZE);
+
+        rewind(runs[i].fp);
+        if (run_advance(&runs[i]))
+            merger->heap[merger->heap_size++] = i;
+    }
+
+    for (size_t i = merger->heap_size / 2; i-- > 0;)
+        heap_sift_down(merger, i);
+    return 0;
+}
+
+// Pop the smallest key; older runs holding the same key are skipped past
+static int merger_next(Merger *merger, uint64_t *key, uint64_t *value)
+{
+    if (merger->heap_size == 0)
+        return 0;
+
+    Run *top = &merger->runs[merger->heap[0]];
+    *key = top->head.key;
+    *value = top->head.value;
+
+    while (merger->heap_size > 0 && merger->runs[merger->heap[0]].head.key == *key)
+    {
+        Run *run = &merger->runs[merger->heap[0]];
+        if (!run_advance(run))
+        {
+            if (ferror(run->fp))
+                return -1;
+            merger->heap[0] = merger->heap[--merger->heap_size];
+        }
+        heap_sift_down(merger, 0);
+    }
+    return 1;
+}
+
+// Merge consecutive groups of runs until one merge pass can take them all
+static int reduce_runs(ExternalSorter *sorter)
+{
+    while (sorter->num_runs > EXTSORT_MAX_FANIN)
+    {
+        size_t num_groups = (sorter->num_runs + EXTSORT_MAX_FANIN - 1) / EXTSORT_MAX_FANIN;
+
+        for (size_t g = 0; g < num_groups; g++)
+        {
+            size_t first = g * EXTSORT_MAX_FANIN;
+            size_t count = sorter->num_runs - first;
+            if (count > EXTSORT_MAX_FANIN)
+                count = EXTSORT_MAX_FANIN;
+
+            Merger merger;
+            FILE *out = tmpfile();
+            if (!out || merger_open(&merger, &sorter->runs[first], count) != 0)
+            {
+                if (out)
+                    fclose(out);
+                return -1;
+            }
+
+            RunRecord record;
+            int result;
+            while ((result = merger_next(&merger, &record.key, &record.value)) == 1)
+            {
+                if (fwrite(&record, sizeof(record), 1, out) != 1)
+                {
+                    result = -1;
+                    break;
+                }
+            }
+
+            free(merger.heap);
+            for (size_t i = 0; i < count; i++)
+                run_close(&sorter->runs[first + i]);
+            if (result != 0)
+            {
+                fclose(out);
+                return -1;
+            }
+
+            // The merged run takes the group's place, keeping runs in input order
+            sorter->runs[g].fp = out;
+        }
+        sorter->num_runs = num_groups;
+    }
+    return 0;
+}
+
+ExternalSorter *extsort_create(size_t memory_limit)
+{
+    if (memory_limit == 0)
+        memory_limit = EXTSORT_DEFAULT_MEMORY;
+
+    ExternalSorter *sorter = (ExternalSorter *)calloc(1, sizeof(ExternalSorter));
+    if (!sorter)
+        return NULL;
+
+    sorter->capacity = memory_limit / sizeof(SortRecord);
+    if (sorter->capacity < 1024)
+        sorter->capacity = 1024;
+
+    sorter->buffer = (SortRecord *)malloc(sorter->capacity * sizeof(SortRecord));
+    if (!sorter->buffer)
+    {
+        free(sorter);
+        return NULL;
+    }
+    return sorter;
+}
+
+int extsort_add(ExternalSorter *sorter, uint64_t key, uint64_t value)
+{
+    if (sorter->finished)
+        return -1;
+    if (sorter->count == sorter->capacity && spill_run(sorter) != 0)
+        return -1;
+
+    SortRecord *record = &sorter->buffer[sorter->count++];
+    record->key = key;
+    record->value = value;
+    record->seq = sorter->next_seq++;
+    return 0;
+}
+
+int extsort_finish(ExternalSorter *sorter)
+{
+    if (sorter->finished)
+        return -1;
+
+    if (spill_run(sorter) != 0 || reduce_runs(sorter) != 0)
+        return -1;
+
+    // Runs are on disk now; the sort buffer is no longer needed during the merge
+    free(sorter->buffer);
+    sorter->buffer = NULL;
+    sorter->finished = 1;
+
+    return merger_open(&sorter->merger, sorter->runs, sorter->num_runs);
+}
+
+int extsort_next(void *sorter, uint64_t *key, uint64_t *value)
+{
+    ExternalSorter *s = (ExternalSorter *)sorter;
+    if (!s->finished)
+        return -1;
+    return merger_next(&s->merger, key, value);
+}
+
+void extsort_destroy(ExternalSorter *sorter)
+{
+    if (!sorter)
+        return;
+
+    for (size_t i = 0; i < sorter->num_runs; i++)
+        run_close(&sorter->runs[i]);
+    free(sorter->runs);
+    free(sorter->merger.heap);
+    free(sorter->buffer);
+    free(sorter);
+}
@@ -0,0 +1,40 @@
+// extsort.h
+#ifndef EXTSORT_H
+#define EXTSORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Default memory budget for run generation, in bytes.
+ */
+#define EXTSORT_DEFAULT_MEMORY (64u * 1024 * 1024)
+
+/**
+ * Maximum number of runs merged in one pass. Inputs that spill more runs
+ * are merged in several passes, which bounds the number of open temp files.
+ */
+#define EXTSORT_MAX_FANIN 128
+
+/**
+ * External Merge Sorter
+ * ---------------------
+ * Sorts a stream of key/value pairs that may be far larger than memory:
+ * - extsort_add() buffers pairs and spills a sorted run to a temp file
+ *   whenever the memory budget is used up
+ * - extsort_finish() spills the last run and prepares a k-way heap merge
+ * - extsort_next() returns pairs in ascending key order
+ *
+ * Duplicate keys are resolved last-writer-wins: the pair added last is the
+ * only one returned. extsort_next() has the BTreeKVSource signature, so a
+ * finished sorter can be passed straight to bulk_load_sorted().
+ */
+typedef struct ExternalSorter ExternalSorter;
+
+ExternalSorter *extsort_create(size_t memory_limit);
+int extsort_add(ExternalSorter *sorter, uint64_t key, uint64_t value);
+int extsort_finish(ExternalSorter *sorter);
+int extsort_next(void *sorter, uint64_t *key, uint64_t *value);
+void extsort_destroy(ExternalSorter *sorter);
+
+#endif /* EXTSORT_H */
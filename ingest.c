@@ -0,0 +1,268 @@
+// ingest.c
+#define _POSIX_C_SOURCE 200809L // mmap(), posix_madvise()
+#include "ingest.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define BINARY_RECORD 16 // Key and value, eight bytes each
+
+struct Ingest
+{
+    int fd;
+    IngestFormat format;
+    const char *map;  // Whole file when mapped, else NULL
+    size_t map_size;
+    char *buffer;     // INGEST_CHUNK bytes when reading instead of mapping
+    const char *pos;  // Next unparsed byte
+    const char *end;  // End of the bytes available so far
+    int eof;          // 1 once everything up to `end` is all there is
+    int skipping;     // 1 while dropping the rest of an overlong line
+    IngestStats stats;
+};
+
+static void note_malformed(Ingest *in)
+{
+    if (in->stats.malformed < INGEST_REPORTED_LINES)
+        in->stats.first_malformed[in->stats.malformed] = in->stats.records;
+    in->stats.malformed++;
+}
+
+// Move the unparsed tail to the front of the buffer and read more after it
+static int refill(Ingest *in)
+{
+    size_t left = (size_t)(in->end - in->pos);
+    memmove(in->buffer, in->pos, left);
+    in->pos = in->buffer;
+    in->end = in->buffer + left;
+
+    while (!in->eof && in->end < in->buffer + INGEST_CHUNK)
+    {
+        ssize_t n = read(in->fd, in->buffer + left, INGEST_CHUNK - left);
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            in->eof = 1;
+        left += (size_t)n;
+        in->end = in->buffer + left;
+        if (n > 0)
+            break; // Parse what arrived rather than waiting to fill the chunk
+    }
+    return 0;
+}
+
+Ingest *ingest_open(const char *filename, IngestFormat format)
+{
+    if (format != INGEST_CSV && format != INGEST_BINARY)
+        return NULL;
+
+    Ingest *in = (Ingest *)calloc(1, sizeof(Ingest));
+    if (!in)
+        return NULL;
+    in->format = format;
+    in->fd = open(filename, O_RDONLY);
+    if (in->fd < 0)
+    {
+        free(in);
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(in->fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, in->fd, 0);
+        if (map != MAP_FAILED)
+        {
+            posix_madvise(map, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+            in->map = (const char *)map;
+            in->map_size = (size_t)st.st_size;
+            in->pos = in->map;
+            in->end = in->map + in->map_size;
+            in->eof = 1;
+            return in;
+        }
+    }
+
+    in->buffer = (char *)malloc(INGEST_CHUNK);
+    if (!in->buffer)
+    {
+        ingest_close(in);
+        return NULL;
+    }
+    in->pos = in->end = in->buffer;
+    return in;
+}
+
+/**
+ * SWAR digit handling: eight ASCII bytes loaded little-endian into one word
+ * are checked for being all digits and then folded pairwise (2 digits, 4,
+ * then 8) with three multiplies.
+ */
+static int all_digits(uint64_t w)
+{
+    return ((w & 0xF0F0F0F0F0F0F0F0ULL) |
+            (((w + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) >> 4)) == 0x3333333333333333ULL;
+}
+
+static uint64_t eight_digits(uint64_t w)
+{
+    w = ((w & 0x0F0F0F0F0F0F0F0FULL) * 2561) >> 8;
+    w = ((w & 0x00FF00FF00FF00FFULL) * 6553601) >> 16;
+    return ((w & 0x0000FFFF0000FFFFULL) * 42949672960001ULL) >> 32;
+}
+
+// Parse a decimal u64 at p; returns the byte after it, or NULL if there is no number or it overflows
+static const char *parse_u64(const char *p, const char *end, uint64_t *out)
+{
+    const char *start = p;
+    uint64_t v = 0;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    // Sixteen digits never overflow, so the first two blocks need no check
+    for (int i = 0; i < 2 && end - p >= 8; i++)
+    {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        if (!all_digits(w))
+            break;
+        v = v * 100000000 + eight_digits(w);
+        p += 8;
+    }
+#endif
+
+    while (p < end && (unsigned char)(*p - '0') < 10)
+    {
+        unsigned digit = (unsigned)(*p - '0');
+        if (v > (UINT64_MAX - digit) / 10)
+            return NULL;
+        v = v * 10 + digit;
+        p++;
+    }
+
+    if (p == start)
+        return NULL;
+    *out = v;
+    return p;
+}
+
+static const char *skip_blanks(const char *p, const char *end)
+{
+    while (p < end && (*p == ' ' || *p == '\t'))
+        p++;
+    return p;
+}
+
+// Parse "key,value" from one line; 0 on success
+static int parse_line(const char *p, const char *end, uint64_t *key, uint64_t *value)
+{
+    p = parse_u64(skip_blanks(p, end), end, key);
+    if (!p || p == end || *p != ',')
+        return -1;
+    p = parse_u64(skip_blanks(p + 1, end), end, value);
+    return p ? 0 : -1;
+}
+
+static int next_csv(Ingest *in, uint64_t *key, uint64_t *value)
+{
+    for (;;)
+    {
+        const char *nl = (const char *)memchr(in->pos, '\n', (size_t)(in->end - in->pos));
+        if (!nl && !in->eof)
+        {
+            // A line longer than the whole buffer is malformed; drop the rest of it
+            if (in->pos == in->buffer && in->end == in->buffer + INGEST_CHUNK)
+            {
+                if (!in->skipping)
+                {
+                    in->stats.records++;
+                    note_malformed(in);
+                }
+                in->skipping = 1;
+                in->pos = in->end;
+            }
+            if (refill(in) != 0)
+                return -1;
+            continue;
+        }
+        if (!nl && in->pos == in->end)
+            return 0; // Input ends with a newline, or is empty
+
+        const char *line_end = nl ? nl : in->end;
+        const char *line = in->pos;
+        in->pos = nl ? nl + 1 : in->end;
+        if (in->skipping)
+        {
+            in->skipping = 0;
+            continue;
+        }
+
+        in->stats.records++;
+        if (parse_line(line, line_end, key, value) == 0)
+            return 1;
+        note_malformed(in);
+    }
+}
+
+static uint64_t load_le64(const char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, 8);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return v;
+#else
+    return __builtin_bswap64(v);
+#endif
+}
+
+static int next_binary(Ingest *in, uint64_t *key, uint64_t *value)
+{
+    while (in->end - in->pos < BINARY_RECORD && !in->eof)
+    {
+        if (refill(in) != 0)
+            return -1;
+    }
+
+    size_t left = (size_t)(in->end - in->pos);
+    if (left < BINARY_RECORD)
+    {
+        if (left > 0)
+        {
+            in->stats.records++;
+            note_malformed(in); // Truncated final record
+            in->pos = in->end;
+        }
+        return 0;
+    }
+
+    in->stats.records++;
+    *key = load_le64(in->pos);
+    *value = load_le64(in->pos + 8);
+    in->pos += BINARY_RECORD;
+    return 1;
+}
+
+int ingest_next(void *ingest, uint64_t *key, uint64_t *value)
+{
+    Ingest *in = (Ingest *)ingest;
+    return in->format == INGEST_BINARY ? next_binary(in, key, value) : next_csv(in, key, value);
+}
+
+const IngestStats *ingest_stats(const Ingest *ingest)
+{
+    return &ingest->stats;
+}
+
+void ingest_close(Ingest *ingest)
+{
+    if (!ingest)
+        return;
+    if (ingest->map)
+        munmap((void *)ingest->map, ingest->map_size);
+    if (ingest->fd >= 0)
+        close(ingest->fd);
+    free(ingest->buffer);
+    free(ingest);
+}
@@ -0,0 +1,56 @@
+// ingest.h
+#ifndef INGEST_H
+#define INGEST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Bytes read at a time when the input cannot be mapped (pipes, empty files).
+ */
+#define INGEST_CHUNK (1u << 20)
+
+/**
+ * Malformed line numbers remembered for the summary; the rest are counted.
+ */
+#define INGEST_REPORTED_LINES 8
+
+/**
+ * Input formats:
+ * - INGEST_CSV: one "key,value" pair of decimal numbers per line. Blanks
+ *   before either number and anything after the value are ignored.
+ * - INGEST_BINARY: fixed 16-byte records, a little-endian u64 key then a
+ *   little-endian u64 value.
+ */
+typedef enum
+{
+    INGEST_CSV = 0,
+    INGEST_BINARY
+} IngestFormat;
+
+typedef struct
+{
+    uint64_t records;   // Lines (or records) read, malformed ones included
+    uint64_t malformed; // Lines that did not parse, or a trailing partial record
+    uint64_t first_malformed[INGEST_REPORTED_LINES]; // Their 1-based numbers
+} IngestStats;
+
+/**
+ * Input Reader
+ * ------------
+ * Streams key/value pairs out of a file. A regular file is mapped and
+ * parsed in place; anything else is read in INGEST_CHUNK pieces. Numbers are
+ * parsed by hand, eight digits at a time where the host allows it. Bad
+ * lines are skipped and counted instead of being reported one by one.
+ *
+ * ingest_next() has the BTreeKVSource signature: 1 and a pair, 0 at the end
+ * of the input, or -1 on a read error.
+ */
+typedef struct Ingest Ingest;
+
+Ingest *ingest_open(const char *filename, IngestFormat format);
+int ingest_next(void *ingest, uint64_t *key, uint64_t *value);
+const IngestStats *ingest_stats(const Ingest *ingest);
+void ingest_close(Ingest *ingest);
+
+#endif /* INGEST_H */
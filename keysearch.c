@@ -0,0 +1,203 @@
+// keysearch.c
+#include "keysearch.h"
+#include <stddef.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define KEYSEARCH_X86 1
+#include <immintrin.h>
+#endif
+
+#define SIMD_WINDOW 16   // Keys left for the vector compare after narrowing
+#define AVX512_WINDOW 32 // Four 512-bit compares
+
+static inline uint64_t load_key(const uint64_t *keys, uint64_t i, int swap)
+{
+    return swap ? __builtin_bswap64(keys[i]) : keys[i];
+}
+
+/**
+ * Branchless binary search: halve [base, base + n] until at most `window`
+ * keys remain. The answer always stays inside the range, and the select
+ * compiles to a conditional move, so there is no mispredicted branch per
+ * level. Returns the new base and leaves the window length in *n.
+ */
+static inline uint64_t narrow(const uint64_t *keys, uint64_t *n, uint64_t key, int swap,
+                              uint64_t window)
+{
+    uint64_t base = 0;
+    uint64_t len = *n;
+    while (len > window)
+    {
+        uint64_t half = len / 2;
+        base = load_key(keys, base + half, swap) < key ? base + half : base;
+        len -= half;
+    }
+    *n = len;
+    return base;
+}
+
+static uint64_t search_linear(const uint64_t *keys, uint64_t n, uint64_t key, int swap)
+{
+    uint64_t i = 0;
+    while (i < n && load_key(keys, i, swap) < key)
+    {
+        i++;
+    }
+    return i;
+}
+
+static uint64_t search_binary(const uint64_t *keys, uint64_t n, uint64_t key, int swap)
+{
+    uint64_t base = narrow(keys, &n, key, swap, 1);
+    return base + (n > 0 && load_key(keys, base, swap) < key);
+}
+
+#ifdef KEYSEARCH_X86
+
+/**
+ * Vector kernels count the keys in the window that are less than the search
+ * key; the keys are sorted, so that count is the offset of the lower bound.
+ * SSE4.2 and AVX2 only have a signed 64-bit compare, so both sides are
+ * biased by the sign bit first. Byte-swapped keys are fixed up with a
+ * shuffle, which costs one instruction per vector.
+ */
+__attribute__((target("sse4.2,popcnt")))
+static uint64_t search_sse42(const uint64_t *keys, uint64_t n, uint64_t key, int swap)
+{
+    uint64_t base = narrow(keys, &n, key, swap, SIMD_WINDOW);
+    const __m128i bias = _mm_set1_epi64x((long long)0x8000000000000000ULL);
+    const __m128i needle = _mm_xor_si128(_mm_set1_epi64x((long long)key), bias);
+    const __m128i bswap = _mm_set_epi8(8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7);
+
+    uint64_t count = 0, i = 0;
+    for (; i + 2 <= n; i += 2)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(keys + base + i));
+        if (swap)
+            v = _mm_shuffle_epi8(v, bswap);
+        __m128i lt = _mm_cmpgt_epi64(needle, _mm_xor_si128(v, bias));
+        count += __builtin_popcount(_mm_movemask_pd(_mm_castsi128_pd(lt)));
+    }
+    for (; i < n; i++)
+    {
+        count += load_key(keys, base + i, swap) < key;
+    }
+    return base + count;
+}
+
+__attribute__((target("avx2,popcnt")))
+static uint64_t search_avx2(const uint64_t *keys, uint64_t n, uint64_t key, int swap)
+{
+    uint64_t base = narrow(keys, &n, key, swap, SIMD_WINDOW);
+    const __m256i bias = _mm256_set1_epi64x((long long)0x8000000000000000ULL);
+    const __m256i needle = _mm256_xor_si256(_mm256_set1_epi64x((long long)key), bias);
+    const __m256i bswap = _mm256_set_epi8(8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7,
+                                          8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7);
+
+    uint64_t count = 0, i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(keys + base + i));
+        if (swap)
+            v = _mm256_shuffle_epi8(v, bswap);
+        __m256i lt = _mm256_cmpgt_epi64(needle, _mm256_xor_si256(v, bias));
+        count += __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(lt)));
+    }
+    for (; i < n; i++)
+    {
+        count += load_key(keys, base + i, swap) < key;
+    }
+    return base + count;
+}
+
+// AVX-512 compares unsigned words directly, and a masked load covers the tail
+__attribute__((target("avx512f,avx512bw,popcnt")))
+static uint64_t search_avx512(const uint64_t *keys, uint64_t n, uint64_t key, int swap)
+{
+    uint64_t base = narrow(keys, &n, key, swap, AVX512_WINDOW);
+    const __m512i needle = _mm512_set1_epi64((long long)key);
+    const __m512i bswap = _mm512_set_epi8(8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7,
+                                          8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7,
+                                          8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7,
+                                          8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7);
+
+    uint64_t count = 0;
+    for (uint64_t i = 0; i < n; i += 8)
+    {
+        __mmask8 live = n - i >= 8 ? (__mmask8)0xFF : (__mmask8)((1u << (n - i)) - 1);
+        __m512i v = _mm512_maskz_loadu_epi64(live, keys + base + i);
+        if (swap)
+            v = _mm512_shuffle_epi8(v, bswap);
+        count += __builtin_popcount(_mm512_mask_cmplt_epu64_mask(live, v, needle));
+    }
+    return base + count;
+}
+
+#endif /* KEYSEARCH_X86 */
+
+KeySearchFn keysearch_get(KeySearchKind kind)
+{
+#ifdef KEYSEARCH_X86
+    __builtin_cpu_init();
+#endif
+
+    switch (kind)
+    {
+    case KEYSEARCH_AUTO:
+        for (int k = KEYSEARCH_NUM_KINDS - 1; k > KEYSEARCH_AUTO; k--)
+        {
+            KeySearchFn fn = keysearch_get((KeySearchKind)k);
+            if (fn)
+                return fn;
+        }
+        return search_binary;
+    case KEYSEARCH_LINEAR:
+        return search_linear;
+    case KEYSEARCH_BINARY:
+        return search_binary;
+#ifdef KEYSEARCH_X86
+    case KEYSEARCH_SSE42:
+        return __builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("popcnt")
+                   ? search_sse42
+                   : NULL;
+    case KEYSEARCH_AVX2:
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")
+                   ? search_avx2
+                   : NULL;
+    case KEYSEARCH_AVX512:
+        return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") &&
+                       __builtin_cpu_supports("popcnt")
+                   ? search_avx512
+                   : NULL;
+#endif
+    default:
+        return NULL;
+    }
+}
+
+const char *keysearch_name(KeySearchKind kind)
+{
+    static const char *const names[KEYSEARCH_NUM_KINDS] = {
+        "auto", "linear", "binary", "sse4.2", "avx2", "avx512"};
+    return kind < KEYSEARCH_NUM_KINDS ? names[kind] : "unknown";
+}
+
+// Chosen on first use; every thread that races here stores the same pointer,
+// and the atomic accesses keep the race well defined
+static KeySearchFn best_kernel;
+
+uint64_t keysearch_lower_bound(const uint64_t *keys, uint64_t n, uint64_t key, int swap)
+{
+    KeySearchFn fn = __atomic_load_n(&best_kernel, __ATOMIC_RELAXED);
+    if (!fn)
+    {
+        fn = keysearch_get(KEYSEARCH_AUTO);
+        __atomic_store_n(&best_kernel, fn, __ATOMIC_RELAXED);
+    }
+    return fn(keys, n, key, swap);
+}
+
+uint64_t keysearch_upper_bound(const uint64_t *keys, uint64_t n, uint64_t key, int swap)
+{
+    return key == UINT64_MAX ? n : keysearch_lower_bound(keys, n, key + 1, swap);
+}
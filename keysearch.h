@@ -0,0 +1,44 @@
+// keysearch.h
+#ifndef KEYSEARCH_H
+#define KEYSEARCH_H
+
+#include <stdint.h>
+
+/**
+ * In-node key search kernels:
+ * - KEYSEARCH_LINEAR: scalar scan, one comparison per key
+ * - KEYSEARCH_BINARY: branchless binary search, scalar throughout
+ * - KEYSEARCH_SSE42, KEYSEARCH_AVX2, KEYSEARCH_AVX512: branchless binary
+ *   search down to a small window, then a vector compare over the window
+ * - KEYSEARCH_AUTO: the fastest kernel this CPU supports, picked at runtime
+ *
+ * Every kernel returns the lower bound: the index of the first key that is
+ * not less than the search key, or n when all keys are smaller. `swap` says
+ * the stored keys are byte-swapped (format v1 on a little-endian host).
+ */
+typedef enum
+{
+    KEYSEARCH_AUTO = 0,
+    KEYSEARCH_LINEAR,
+    KEYSEARCH_BINARY,
+    KEYSEARCH_SSE42,
+    KEYSEARCH_AVX2,
+    KEYSEARCH_AVX512,
+    KEYSEARCH_NUM_KINDS
+} KeySearchKind;
+
+typedef uint64_t (*KeySearchFn)(const uint64_t *keys, uint64_t n, uint64_t key, int swap);
+
+/**
+ * Returns the kernel for `kind`, or NULL when the CPU lacks the instructions
+ * it needs. KEYSEARCH_AUTO always succeeds.
+ */
+KeySearchFn keysearch_get(KeySearchKind kind);
+const char *keysearch_name(KeySearchKind kind);
+
+uint64_t keysearch_lower_bound(const uint64_t *keys, uint64_t n, uint64_t key, int swap);
+
+// Index of the first key greater than `key`; equal keys stay to its left
+uint64_t keysearch_upper_bound(const uint64_t *keys, uint64_t n, uint64_t key, int swap);
+
+#endif /* KEYSEARCH_H */
@@ -0,0 +1,128 @@
+// keysearch_bench.c
+// Microbenchmark for the in-node key search kernels, one row per node size
+#define _POSIX_C_SOURCE 200809L
+#include "btree.h"
+#include "keysearch.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define NUM_PROBES 4096     // Search keys cycled through each timed loop
+#define TARGET_SEARCHES 4000000
+
+static uint64_t rng_state = 0x2545F4914F6CDD1DULL;
+
+static uint64_t next_random(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(void)
+{
+    uint64_t max_keys = btree_keys_per_node(BTREE_MAX_BLOCK_SIZE, 0);
+    uint64_t *keys = (uint64_t *)malloc(max_keys * sizeof(uint64_t));
+    uint64_t *swapped = (uint64_t *)malloc(max_keys * sizeof(uint64_t));
+    uint64_t *probes = (uint64_t *)malloc(NUM_PROBES * sizeof(uint64_t));
+    if (!keys || !swapped || !probes)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    printf("Best kernel on this CPU: ");
+    for (int k = KEYSEARCH_NUM_KINDS - 1; k > KEYSEARCH_AUTO; k--)
+    {
+        if (keysearch_get((KeySearchKind)k))
+        {
+            printf("%s\n", keysearch_name((KeySearchKind)k));
+            break;
+        }
+    }
+    printf("ns per search (v2 = native words, v1 = byte-swapped words)\n\n");
+
+    printf("%-7s %-6s", "block", "keys");
+    for (int k = KEYSEARCH_LINEAR; k < KEYSEARCH_NUM_KINDS; k++)
+    {
+        printf(" %9s-v2 %9s-v1", keysearch_name((KeySearchKind)k), keysearch_name((KeySearchKind)k));
+    }
+    printf("\n");
+
+    for (uint64_t block_size = BTREE_MIN_BLOCK_SIZE; block_size <= BTREE_MAX_BLOCK_SIZE; block_size *= 2)
+    {
+        uint64_t n = btree_keys_per_node(block_size, 0);
+
+        // Sorted keys with gaps, so about half the probes miss
+        uint64_t key = 0;
+        for (uint64_t i = 0; i < n; i++)
+        {
+            key += 1 + next_random() % 4;
+            keys[i] = key;
+            swapped[i] = __builtin_bswap64(key);
+        }
+        for (int i = 0; i < NUM_PROBES; i++)
+        {
+            probes[i] = next_random() % (key + 2);
+        }
+
+        printf("%-7llu %-6llu", (unsigned long long)block_size, (unsigned long long)n);
+        for (int k = KEYSEARCH_LINEAR; k < KEYSEARCH_NUM_KINDS; k++)
+        {
+            KeySearchFn fn = keysearch_get((KeySearchKind)k);
+            for (int swap = 0; swap <= 1; swap++)
+            {
+                if (!fn)
+                {
+                    printf(" %12s", "n/a");
+                    continue;
+                }
+
+                // Fewer rounds for the linear scan on big nodes
+                uint64_t rounds = TARGET_SEARCHES / NUM_PROBES;
+                if (k == KEYSEARCH_LINEAR && n > 64)
+                    rounds = rounds * 64 / n + 1;
+
+                const uint64_t *data = swap ? swapped : keys;
+                uint64_t sink = 0;
+                double start = now_seconds();
+                for (uint64_t r = 0; r < rounds; r++)
+                {
+                    for (int i = 0; i < NUM_PROBES; i++)
+                    {
+                        sink += fn(data, n, probes[i], swap);
+                    }
+                }
+                double elapsed = now_seconds() - start;
+
+                // Every kernel must agree with the scalar reference
+                uint64_t expect = 0;
+                for (int i = 0; i < NUM_PROBES; i++)
+                {
+                    expect += keysearch_get(KEYSEARCH_LINEAR)(keys, n, probes[i], 0);
+                }
+                if (sink != expect * rounds)
+                {
+                    fprintf(stderr, "%s returned wrong positions\n", keysearch_name((KeySearchKind)k));
+                    return 1;
+                }
+
+                printf(" %12.2f", elapsed * 1e9 / (rounds * NUM_PROBES));
+            }
+        }
+        printf("\n");
+    }
+
+    free(keys);
+    free(swapped);
+    free(probes);
+    return 0;
+}
@@ -1,4 +1,5 @@
 // main.c
+#define _POSIX_C_SOURCE 200809L // pthread_rwlock_t in btree.h
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -131,13 +132,18 @@ static void insertPair()
     }
     clearInputBuffer();
 
-    if (insert_key(&currentTree, key, value) == 0)
+    int result = insert_if_absent(&currentTree, key, value);
+    if (result == 0)
     {
         printf("Key-value pair inserted successfully.\n");
     }
+    else if (result == 1)
+    {
+        printf("Error: Key already exists.\n");
+    }
     else
     {
-        printf("Error: Key already exists or insertion failed.\n");
+        printf("Error: Insertion failed.\n");
     }
 }
 
@@ -0,0 +1,250 @@
+// model.c
+#define _POSIX_C_SOURCE 200809L
+#include "model.h"
+#include <string.h>
+#include <unistd.h>
+
+#define SAMPLE_STRIDE 7  // model_check() looks up every 7th key and gap
+#define BATCH_PROBES 512 // Keys per search_keys_batch() check
+
+void model_init(Model *model)
+{
+    memset(model, 0, sizeof(*model));
+}
+
+void model_free(Model *model)
+{
+    free(model->keys);
+    free(model->values);
+    memset(model, 0, sizeof(*model));
+}
+
+// Index of the first key not less than key
+static size_t model_lower_bound(const Model *model, uint64_t key)
+{
+    size_t lo = 0, hi = model->count;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (model->keys[mid] < key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+long model_find(const Model *model, uint64_t key)
+{
+    size_t i = model_lower_bound(model, key);
+    return i < model->count && model->keys[i] == key ? (long)i : -1;
+}
+
+int model_put(Model *model, uint64_t key, uint64_t value)
+{
+    size_t i = model_lower_bound(model, key);
+    if (i < model->count && model->keys[i] == key)
+    {
+        model->values[i] = value;
+        return 0;
+    }
+
+    if (model->count == model->capacity)
+    {
+        size_t capacity = model->capacity ? model->capacity * 2 : 1024;
+        uint64_t *keys = (uint64_t *)realloc(model->keys, capacity * sizeof(uint64_t));
+        CHECK(keys != NULL);
+        model->keys = keys;
+        uint64_t *values = (uint64_t *)realloc(model->values, capacity * sizeof(uint64_t));
+        CHECK(values != NULL);
+        model->values = values;
+        model->capacity = capacity;
+    }
+
+    size_t tail = model->count - i;
+    memmove(&model->keys[i + 1], &model->keys[i], tail * sizeof(uint64_t));
+    memmove(&model->values[i + 1], &model->values[i], tail * sizeof(uint64_t));
+    model->keys[i] = key;
+    model->values[i] = value;
+    model->count++;
+    return 1;
+}
+
+int model_delete(Model *model, uint64_t key)
+{
+    long i = model_find(model, key);
+    if (i < 0)
+        return 0;
+
+    size_t tail = model->count - (size_t)i - 1;
+    memmove(&model->keys[i], &model->keys[i + 1], tail * sizeof(uint64_t));
+    memmove(&model->values[i], &model->values[i + 1], tail * sizeof(uint64_t));
+    model->count--;
+    return 1;
+}
+
+typedef struct
+{
+    const Model *model;
+    size_t next; // Model index the next pair must match
+    int ok;
+} ScanCheck;
+
+static int scan_check(void *ctx, uint64_t key, uint64_t value)
+{
+    ScanCheck *check = (ScanCheck *)ctx;
+    const Model *model = check->model;
+    if (check->next >= model->count || model->keys[check->next] != key ||
+        model->values[check->next] != value)
+    {
+        check->ok = 0;
+        return 1;
+    }
+    check->next++;
+    return 0;
+}
+
+// The key just after model key i - 1 (0 for i == 0), if the model lacks it
+static int model_gap(const Model *model, size_t i, uint64_t *key)
+{
+    if (i > 0 && model->keys[i - 1] == UINT64_MAX)
+        return 0;
+    *key = i == 0 ? 0 : model->keys[i - 1] + 1;
+    return model_find(model, *key) < 0;
+}
+
+int model_check(BTree *tree, const Model *model)
+{
+    if (validate_btree(tree) != 1)
+    {
+        fprintf(stderr, "validate_btree() failed with %zu keys in the model\n", model->count);
+        return -1;
+    }
+
+    // Every pair, in order, forwards and backwards
+    BTreeCursor cursor;
+    size_t i = 0;
+    int r;
+    for (r = btree_seek(tree, &cursor, 0); r == 1; r = cursor_next(&cursor), i++)
+    {
+        if (i >= model->count || cursor.key != model->keys[i] || cursor.value != model->values[i])
+        {
+            fprintf(stderr, "cursor differs at pair %zu (key %llu)\n", i, (unsigned long long)cursor.key);
+            return -1;
+        }
+    }
+    if (r != 0 || i != model->count)
+    {
+        fprintf(stderr, "cursor saw %zu of %zu pairs (last result %d)\n", i, model->count, r);
+        return -1;
+    }
+    for (r = btree_seek_last(tree, &cursor); r == 1; r = cursor_prev(&cursor))
+    {
+        if (i == 0 || cursor.key != model->keys[--i])
+        {
+            fprintf(stderr, "reverse cursor differs at pair %zu\n", i);
+            return -1;
+        }
+    }
+    if (r != 0 || i != 0)
+    {
+        fprintf(stderr, "reverse cursor stopped %zu pairs early\n", i);
+        return -1;
+    }
+
+    // Point lookups on keys and on the gaps between them
+    for (i = test_random() % SAMPLE_STRIDE; i <= model->count; i += SAMPLE_STRIDE)
+    {
+        uint64_t value, gap;
+        if (i < model->count &&
+            (search_key(tree, model->keys[i], &value) != 0 || value != model->values[i]))
+        {
+            fprintf(stderr, "search_key(%llu) missed\n", (unsigned long long)model->keys[i]);
+            return -1;
+        }
+        if (model_gap(model, i, &gap) && search_key(tree, gap, &value) == 0)
+        {
+            fprintf(stderr, "search_key(%llu) found a deleted key\n", (unsigned long long)gap);
+            return -1;
+        }
+    }
+
+    // A range that starts and ends at random model positions
+    if (model->count > 0)
+    {
+        size_t a = test_random() % model->count, b = test_random() % model->count;
+        if (a > b)
+        {
+            size_t t = a;
+            a = b;
+            b = t;
+        }
+        ScanCheck check = {model, a, 1};
+        if (range_scan(tree, model->keys[a], model->keys[b], scan_check, &check) != 0 ||
+            !check.ok || check.next != b + 1)
+        {
+            fprintf(stderr, "range_scan(%zu..%zu) differs\n", a, b);
+            return -1;
+        }
+    }
+
+    // A batch of present and absent keys in random order
+    uint64_t probes[BATCH_PROBES], values[BATCH_PROBES];
+    int found[BATCH_PROBES];
+    for (i = 0; i < BATCH_PROBES; i++)
+    {
+        probes[i] = model->count && test_random() % 2 ? model->keys[test_random() % model->count]
+                                                      : test_random();
+    }
+    int num_found = search_keys_batch(tree, probes, BATCH_PROBES, values, found);
+    if (num_found < 0)
+    {
+        fprintf(stderr, "search_keys_batch() failed\n");
+        return -1;
+    }
+    for (i = 0; i < BATCH_PROBES; i++)
+    {
+        long at = model_find(model, probes[i]);
+        num_found -= found[i] != 0;
+        if (found[i] != (at >= 0) || (at >= 0 && values[i] != model->values[at]))
+        {
+            fprintf(stderr, "search_keys_batch() differs on key %llu\n", (unsigned long long)probes[i]);
+            return -1;
+        }
+    }
+    if (num_found != 0)
+    {
+        fprintf(stderr, "search_keys_batch() miscounted its hits\n");
+        return -1;
+    }
+    return 0;
+}
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+
+void test_seed(uint64_t seed)
+{
+    rng_state = seed ? seed : 0x9E3779B97F4A7C15ULL;
+}
+
+uint64_t test_random(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+void test_path(char *buf, size_t size, const char *name)
+{
+    const char *dir = getenv("TMPDIR");
+    snprintf(buf, size, "%s/btree-test-%ld-%s", dir && *dir ? dir : "/tmp", (long)getpid(), name);
+}
+
+void test_remove(const char *path)
+{
+    char log[4096];
+    snprintf(log, sizeof(log), "%s-wal", path);
+    unlink(path);
+    unlink(log);
+}
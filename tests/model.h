@@ -0,0 +1,68 @@
+// model.h
+#ifndef MODEL_H
+#define MODEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "btree.h"
+
+/**
+ * Test support
+ * ------------
+ * A Model is the expected contents of a tree: its pairs in a sorted array.
+ * The tests apply every operation to the tree and to the model, and
+ * model_check() compares the two through every read path the library
+ * offers. CHECK() stops the test with the failing condition; it stays on
+ * whatever NDEBUG says.
+ */
+#define CHECK(cond)                                                                  \
+    do                                                                               \
+    {                                                                                \
+        if (!(cond))                                                                 \
+        {                                                                            \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(1);                                                                 \
+        }                                                                            \
+    } while (0)
+
+typedef struct
+{
+    uint64_t *keys;
+    uint64_t *values;
+    size_t count;
+    size_t capacity;
+} Model;
+
+void model_init(Model *model);
+void model_free(Model *model);
+
+// Index of key in the model, or -1
+long model_find(const Model *model, uint64_t key);
+
+// 1 if the key was added, 0 if it was there and took the new value
+int model_put(Model *model, uint64_t key, uint64_t value);
+
+// 1 if the key was removed, 0 if it was not there
+int model_delete(Model *model, uint64_t key);
+
+/**
+ * Compare a tree with the model: validate_btree(), a cursor walk in both
+ * directions, search_key() on a sample of keys and of gaps, a range_scan()
+ * over a random interval and a search_keys_batch() of present and absent
+ * keys. Returns 0 if everything agrees; otherwise prints what differed.
+ */
+int model_check(BTree *tree, const Model *model);
+
+// xorshift64: the tests are repeatable for a given seed
+void test_seed(uint64_t seed);
+uint64_t test_random(void);
+
+// A path under TMPDIR (or /tmp) unique to this process
+void test_path(char *buf, size_t size, const char *name);
+
+// Remove an index file and the log next to it
+void test_remove(const char *path);
+
+#endif /* MODEL_H */
@@ -0,0 +1,278 @@
+// test_compressed.c
+// Compressed nodes: the block codec on its own, then whole trees of dense,
+// sparse and extreme keys in both formats, through reopen, convert_btree()
+// and compact_btree(). The test includes btree.c to reach the codec.
+#include "btree.c"
+#include "model.h"
+
+#define CODEC_NODES 20000 // Random nodes per codec run
+#define NUM_OPS 20000     // Random writes per tree
+
+typedef enum
+{
+    KEYS_DENSE,   // Consecutive runs: one-byte gaps
+    KEYS_SPARSE,  // Anywhere in the 64-bit space
+    KEYS_MIXED,   // Dense clusters scattered over the 64-bit space
+    KEYS_EXTREME, // Near 0, 2^63 and UINT64_MAX
+    KEY_PATTERNS
+} KeyPattern;
+
+static const char *pattern_names[] = {"dense", "sparse", "mixed", "extreme"};
+
+static uint64_t pattern_key(KeyPattern pattern)
+{
+    uint64_t r = test_random();
+    switch (pattern)
+    {
+    case KEYS_DENSE:
+        return r % 20000;
+    case KEYS_SPARSE:
+        return r;
+    case KEYS_MIXED:
+        return (r % 16) << 59 | (r >> 32) % 2000;
+    default:
+    {
+        static const uint64_t bases[] = {0, 1ULL << 63, UINT64_MAX - 1999};
+        return bases[r % 3] + (r >> 32) % 2000;
+    }
+    }
+}
+
+static uint64_t random_gap(void)
+{
+    static const unsigned widths[] = {1, 7, 8, 14, 32, 56, 63, 64};
+    unsigned width = widths[test_random() % 8];
+    uint64_t mask = width == 64 ? UINT64_MAX : (1ULL << width) - 1;
+    return (test_random() & mask) | 1;
+}
+
+// Fill node with random contents; interior nodes get children of `bits` bits
+static void random_node(const BTree *tree, BTreeNode *node, int leaf, unsigned bits)
+{
+    clear_node(tree, node);
+    node->block_id = test_random();
+    node->parent_block_id = test_random();
+    uint64_t n = test_random() % (tree->header.max_keys + 1);
+    uint64_t key = test_random() % 4 == 0 ? 0 : test_random() >> (test_random() % 64);
+    for (node->num_keys = 0; node->num_keys < n; node->num_keys++)
+    {
+        node->keys[node->num_keys] = key;
+        node->values[node->num_keys] = test_random();
+        uint64_t gap = random_gap();
+        if (key > UINT64_MAX - gap)
+            break;
+        key += gap;
+    }
+    if (node->num_keys < n && node->keys[node->num_keys - 1] < UINT64_MAX)
+        node->keys[node->num_keys++] = UINT64_MAX;
+
+    if (leaf)
+    {
+        node->prev_leaf = test_random();
+        node->next_leaf = test_random();
+        return;
+    }
+    uint64_t mask = bits == 64 ? UINT64_MAX : (1ULL << bits) - 1;
+    for (uint64_t i = 0; i <= node->num_keys; i++)
+        node->children[i] = (test_random() & mask) | 1;
+}
+
+static void check_same(const BTreeNode *a, const BTreeNode *b, int leaf)
+{
+    CHECK(a->block_id == b->block_id && a->parent_block_id == b->parent_block_id);
+    CHECK(a->num_keys == b->num_keys);
+    CHECK(memcmp(a->keys, b->keys, a->num_keys * sizeof(uint64_t)) == 0);
+    if (leaf)
+    {
+        CHECK(memcmp(a->values, b->values, a->num_keys * sizeof(uint64_t)) == 0);
+        CHECK(a->prev_leaf == b->prev_leaf && a->next_leaf == b->next_leaf);
+    }
+    else
+    {
+        CHECK(memcmp(a->children, b->children, (a->num_keys + 1) * sizeof(uint64_t)) == 0);
+    }
+}
+
+/**
+ * Every node that fits its block decodes to itself, every node that does not
+ * is refused, and a node node_full() passes still fits after taking the key
+ * furthest from its own.
+ */
+static void test_codec(const char *path, uint64_t block_size, uint64_t format_version)
+{
+    BTree tree;
+    memset(&tree, 0, sizeof(tree));
+    BTreeCreateOptions options = {0};
+    options.layout = BTREE_LAYOUT_BPLUS;
+    options.compressed = 1;
+    options.block_size = block_size;
+    options.format_version = format_version;
+    CHECK(create_btree_ex(&tree, path, &options) == 0);
+
+    BTreeNode *node = alloc_node(&tree), *copy = alloc_node(&tree);
+    unsigned char *block = (unsigned char *)malloc(block_size);
+    CHECK(node && copy && block);
+    int encoded = 0, grown = 0;
+    for (int i = 0; i < CODEC_NODES; i++)
+    {
+        int leaf = test_random() % 2;
+        random_node(&tree, node, leaf, 1 + test_random() % 64);
+        int fits = packed_node_size(node) <= packed_room(&tree);
+        CHECK((encode_compressed(&tree, node, block) == 0) == fits);
+        if (!fits)
+            continue;
+        CHECK(decode_compressed(&tree, block, copy) == 0);
+        check_same(node, copy, leaf);
+        encoded++;
+
+        // Append UINT64_MAX, or put 0 in front, and a child the file could have
+        uint64_t n = node->num_keys;
+        if (node_full(&tree, node) || (n > 0 && node->keys[0] == 0 && node->keys[n - 1] == UINT64_MAX))
+            continue;
+        if (n == 0 || node->keys[n - 1] < UINT64_MAX)
+        {
+            node->keys[n] = UINT64_MAX;
+        }
+        else
+        {
+            memmove(&node->keys[1], &node->keys[0], n * sizeof(uint64_t));
+            node->keys[0] = 0;
+        }
+        node->values[n] = test_random();
+        node->children[n + 1] = tree.header.next_block_id;
+        node->num_keys++;
+        CHECK(encode_compressed(&tree, node, block) == 0);
+        CHECK(decode_compressed(&tree, block, copy) == 0);
+        check_same(node, copy, leaf);
+        grown++;
+    }
+    CHECK(encoded > CODEC_NODES / 10 && grown > 0);
+
+    free(block);
+    free_node(copy);
+    free_node(node);
+    close_btree(&tree);
+    test_remove(path);
+}
+
+// The whole of a file, for comparing two
+static unsigned char *read_file(const char *path, long *size)
+{
+    FILE *fp = fopen(path, "rb");
+    CHECK(fp != NULL);
+    CHECK(fseek(fp, 0, SEEK_END) == 0);
+    *size = ftell(fp);
+    unsigned char *bytes = (unsigned char *)malloc(*size);
+    CHECK(bytes != NULL);
+    rewind(fp);
+    CHECK(fread(bytes, 1, *size, fp) == (size_t)*size);
+    fclose(fp);
+    return bytes;
+}
+
+static void open_tree(BTree *tree, const char *path)
+{
+    memset(tree, 0, sizeof(*tree));
+    tree->cache_frames = 32;
+    CHECK(open_btree(tree, path) == 0);
+    CHECK(tree->header.flags & BTREE_FLAG_COMPRESSED);
+}
+
+// The tree the model describes, after every way of rewriting the file
+static void check_rewrites(const char *path, const char *other, const Model *model,
+                           uint64_t format_version)
+{
+    BTree tree;
+    long size, round_trip_size;
+    unsigned char *before = read_file(path, &size);
+    uint64_t other_version = format_version == BTREE_FORMAT_V1 ? BTREE_FORMAT_V2 : BTREE_FORMAT_V1;
+    CHECK(convert_btree(path, other, other_version) == 0);
+    open_tree(&tree, other);
+    CHECK(tree.header.format_version == other_version);
+    CHECK(model_check(&tree, model) == 0);
+    close_btree(&tree);
+
+    // And back again, to the same bytes
+    CHECK(convert_btree(other, path, format_version) == 0);
+    unsigned char *after = read_file(path, &round_trip_size);
+    CHECK(round_trip_size == size && memcmp(before, after, size) == 0);
+    free(before);
+    free(after);
+    open_tree(&tree, path);
+    CHECK(model_check(&tree, model) == 0);
+    close_btree(&tree);
+
+    CHECK(compact_btree(path, other) == 0);
+    open_tree(&tree, other);
+    CHECK(model_check(&tree, model) == 0);
+    close_btree(&tree);
+    test_remove(other);
+}
+
+static void test_tree(const char *path, const char *other, KeyPattern pattern, uint64_t block_size,
+                      uint64_t format_version)
+{
+    BTree tree;
+    memset(&tree, 0, sizeof(tree));
+    tree.cache_frames = 32;
+    BTreeCreateOptions options = {0};
+    options.layout = BTREE_LAYOUT_BPLUS;
+    options.compressed = 1;
+    options.block_size = block_size;
+    options.format_version = format_version;
+    CHECK(create_btree_ex(&tree, path, &options) == 0);
+
+    Model model;
+    model_init(&model);
+    for (int i = 0; i < NUM_OPS; i++)
+    {
+        uint64_t key = pattern_key(pattern), value = test_random();
+        if (test_random() % 4 == 0)
+        {
+            CHECK(delete_key(&tree, key) == (model_delete(&model, key) ? 0 : -1));
+        }
+        else
+        {
+            CHECK(upsert_key(&tree, key, value) == 0);
+            model_put(&model, key, value);
+        }
+        if ((i + 1) % (NUM_OPS / 4) == 0)
+            CHECK(model_check(&tree, &model) == 0);
+    }
+    close_btree(&tree);
+
+    open_tree(&tree, path);
+    CHECK(model_check(&tree, &model) == 0);
+    int height, nodes, keys;
+    get_tree_stats(&tree, &height, &nodes, &keys);
+    close_btree(&tree);
+    check_rewrites(path, other, &model, format_version);
+
+    printf("%-8s %5llu-byte v%llu: %zu keys in %d nodes\n", pattern_names[pattern],
+           (unsigned long long)block_size, (unsigned long long)format_version, model.count, nodes);
+    model_free(&model);
+    test_remove(path);
+}
+
+int main(void)
+{
+    char path[256], other[256];
+    test_path(path, sizeof(path), "compressed.idx");
+    test_path(other, sizeof(other), "compressed-copy.idx");
+    test_remove(path);
+    test_remove(other);
+
+    test_seed(25);
+    for (uint64_t version = BTREE_FORMAT_V1; version <= BTREE_FORMAT_V2; version++)
+    {
+        test_codec(path, 512, version);
+        test_codec(path, 4096, version);
+    }
+    for (int pattern = 0; pattern < KEY_PATTERNS; pattern++)
+    {
+        test_tree(path, other, (KeyPattern)pattern, 512, BTREE_FORMAT_V1 + pattern % 2);
+        test_tree(path, other, (KeyPattern)pattern, 4096, BTREE_FORMAT_V2 - pattern % 2);
+    }
+    printf("test_compressed: ok\n");
+    return 0;
+}
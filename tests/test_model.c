@@ -0,0 +1,192 @@
+// test_model.c
+// Randomized model check of the write paths: insert, upsert, delete and the
+// free list, in every node layout at the smallest and a typical block size
+#define _POSIX_C_SOURCE 200809L
+#include <string.h>
+#include "model.h"
+
+#define NUM_OPS 40000      // Random operations per configuration
+#define KEYS_PER_BYTE 8    // Keys loaded first per byte of block, for a tree of 2-3 levels
+#define CHECKS_PER_RUN 8   // model_check() calls spread over the random phase
+#define CACHE_FRAMES 16    // Small enough that blocks are evicted and read back
+
+typedef struct
+{
+    const char *name;
+    BTreeLayout layout;
+    int compressed;
+    uint64_t block_size;
+} Config;
+
+static const Config configs[] = {
+    {"classic-512", BTREE_LAYOUT_BTREE, 0, 512},
+    {"classic-4096", BTREE_LAYOUT_BTREE, 0, 4096},
+    {"bplus-512", BTREE_LAYOUT_BPLUS, 0, 512},
+    {"bplus-4096", BTREE_LAYOUT_BPLUS, 0, 4096},
+    {"compressed-512", BTREE_LAYOUT_BPLUS, 1, 512},
+    {"compressed-4096", BTREE_LAYOUT_BPLUS, 1, 4096},
+};
+
+static void open_tree(BTree *tree, const char *path)
+{
+    memset(tree, 0, sizeof(*tree));
+    tree->cache_frames = CACHE_FRAMES;
+    tree->durability = BTREE_DURABILITY_PER_BATCH;
+    CHECK(open_btree(tree, path) == 0);
+}
+
+// Keys cluster in a small range so that most writes hit existing keys, with
+// an occasional key anywhere in the 64-bit space
+static uint64_t pick_key(const Model *model, uint64_t key_space)
+{
+    uint64_t roll = test_random() % 10;
+    if (roll < 4 && model->count > 0)
+        return model->keys[test_random() % model->count];
+    if (roll == 9)
+        return test_random();
+    return test_random() % key_space * 3;
+}
+
+static void random_ops(BTree *tree, Model *model, uint64_t key_space)
+{
+    for (int i = 0; i < NUM_OPS; i++)
+    {
+        uint64_t key = pick_key(model, key_space);
+        uint64_t value = test_random();
+        int present = model_find(model, key) >= 0;
+        uint64_t found;
+
+        switch (test_random() % 10)
+        {
+        case 0:
+        case 1:
+        case 2:
+            CHECK(upsert_key(tree, key, value) == 0);
+            model_put(model, key, value);
+            break;
+        case 3:
+            CHECK(insert_key(tree, key, value) == (present ? -1 : 0));
+            if (!present)
+                model_put(model, key, value);
+            break;
+        case 4:
+            CHECK(insert_if_absent(tree, key, value) == present);
+            if (!present)
+                model_put(model, key, value);
+            break;
+        case 5:
+            CHECK(search_key(tree, key, &found) == (present ? 0 : -1));
+            CHECK(!present || found == model->values[model_find(model, key)]);
+            break;
+        default:
+            CHECK(delete_key(tree, key) == (present ? 0 : -1));
+            model_delete(model, key);
+            break;
+        }
+
+        if ((i + 1) % (NUM_OPS / CHECKS_PER_RUN) == 0)
+            CHECK(model_check(tree, model) == 0);
+    }
+}
+
+// Delete every key in random order; the freed blocks must serve the refill
+static void drain_and_refill(BTree *tree, Model *model)
+{
+    Model saved;
+    model_init(&saved);
+    for (size_t i = 0; i < model->count; i++)
+        model_put(&saved, model->keys[i], model->values[i]);
+
+    uint64_t blocks = tree->header.next_block_id;
+    while (model->count > 0)
+    {
+        uint64_t key = model->keys[test_random() % model->count];
+        CHECK(delete_key(tree, key) == 0);
+        CHECK(delete_key(tree, key) == -1);
+        model_delete(model, key);
+        if (model->count % 2048 == 0)
+            CHECK(validate_btree(tree) == 1);
+    }
+    CHECK(tree->header.root_block_id == 0);
+    CHECK(tree->header.free_block_id != 0);
+    CHECK(model_check(tree, model) == 0);
+
+    for (size_t i = 0; i < saved.count; i++)
+    {
+        size_t j = (i * 7919) % saved.count; // 7919 is prime, so j visits every pair
+        if (model_find(model, saved.keys[j]) < 0)
+        {
+            CHECK(insert_key(tree, saved.keys[j], saved.values[j]) == 0);
+            model_put(model, saved.keys[j], saved.values[j]);
+        }
+    }
+    for (size_t i = 0; i < saved.count; i++)
+    {
+        if (model_put(model, saved.keys[i], saved.values[i]))
+            CHECK(insert_key(tree, saved.keys[i], saved.values[i]) == 0);
+    }
+
+    // Refilling in another order can shape the tree differently, but it
+    // should take about the blocks the deletes gave back
+    CHECK(tree->header.next_block_id <= blocks + blocks / 4 + 4);
+    CHECK(model_check(tree, model) == 0);
+    model_free(&saved);
+}
+
+static void run(const Config *config)
+{
+    char path[256];
+    test_path(path, sizeof(path), "model.idx");
+    test_remove(path);
+
+    BTree tree;
+    memset(&tree, 0, sizeof(tree));
+    tree.cache_frames = CACHE_FRAMES;
+    tree.durability = BTREE_DURABILITY_PER_BATCH;
+    BTreeCreateOptions options = {0};
+    options.layout = config->layout;
+    options.compressed = config->compressed;
+    options.block_size = config->block_size;
+    CHECK(create_btree_ex(&tree, path, &options) == 0);
+
+    // Grow the tree first so the random phase splits and merges inner nodes
+    Model model;
+    model_init(&model);
+    uint64_t key_space = config->block_size * KEYS_PER_BYTE * 2;
+    while (model.count < config->block_size * KEYS_PER_BYTE)
+    {
+        uint64_t key = test_random() % key_space * 3, value = test_random();
+        CHECK(upsert_key(&tree, key, value) == 0);
+        model_put(&model, key, value);
+    }
+    CHECK(model_check(&tree, &model) == 0);
+    random_ops(&tree, &model, key_space);
+
+    close_btree(&tree);
+    open_tree(&tree, path);
+    CHECK(model_check(&tree, &model) == 0);
+
+    drain_and_refill(&tree, &model);
+    close_btree(&tree);
+    open_tree(&tree, path);
+    CHECK(model_check(&tree, &model) == 0);
+
+    int height, nodes, keys;
+    get_tree_stats(&tree, &height, &nodes, &keys);
+    CHECK((size_t)keys == model.count);
+    printf("%-16s %zu keys, height %d, %d nodes\n", config->name, model.count, height, nodes);
+    close_btree(&tree);
+    model_free(&model);
+    test_remove(path);
+}
+
+int main(void)
+{
+    test_seed(19);
+    for (size_t i = 0; i < sizeof(configs) / sizeof(configs[0]); i++)
+    {
+        run(&configs[i]);
+    }
+    printf("test_model: ok\n");
+    return 0;
+}
@@ -0,0 +1,131 @@
+// test_optimistic.c
+// Optimistic lookups while a writer splits, merges and rewrites nodes: a
+// lookup may restart, but never returns a pair the tree did not hold.
+// Build the library and this test with -fsanitize=thread to check that the
+// readers and the writer share frame data only through atomics.
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <string.h>
+#include "model.h"
+
+#define NUM_OPS 20000   // Writer operations per layout
+#define KEY_SPACE 20000 // Keys the writer churns; even keys below it are never touched
+#define NUM_READERS 3
+
+typedef struct
+{
+    const char *name;
+    BTreeLayout layout;
+    int compressed;
+} Config;
+
+static const Config configs[] = {
+    {"classic", BTREE_LAYOUT_BTREE, 0},
+    {"bplus", BTREE_LAYOUT_BPLUS, 0},
+    {"compressed", BTREE_LAYOUT_BPLUS, 1},
+};
+
+// Every value the writer stores names its key in the low 32 bits
+static uint64_t value_for(uint64_t key, uint64_t generation)
+{
+    return generation << 32 | key;
+}
+
+typedef struct
+{
+    BTree *tree;
+    int done;
+    uint64_t seed;
+    uint64_t lookups;
+} Reader;
+
+static void *reader(void *arg)
+{
+    Reader *r = (Reader *)arg;
+    uint64_t x = r->seed;
+    while (!__atomic_load_n(&r->done, __ATOMIC_ACQUIRE))
+    {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        uint64_t key = x % KEY_SPACE, value;
+        int result = search_key(r->tree, key, &value);
+        if (key % 2 == 0)
+            CHECK(result == 0 && value == value_for(key, 0)); // Never written after the start
+        else
+            CHECK(result == -1 || (value & 0xFFFFFFFF) == key);
+        r->lookups++;
+    }
+    return NULL;
+}
+
+static void run(const char *path, const Config *config)
+{
+    test_remove(path);
+    BTree tree;
+    memset(&tree, 0, sizeof(tree));
+    tree.cache_frames = 64;
+    BTreeCreateOptions options = {0};
+    options.layout = config->layout;
+    options.compressed = config->compressed;
+    CHECK(create_btree_ex(&tree, path, &options) == 0);
+    tree.read_mode = BTREE_READS_OPTIMISTIC;
+
+    Model model;
+    model_init(&model);
+    for (uint64_t key = 0; key < KEY_SPACE; key += 2)
+    {
+        CHECK(insert_key(&tree, key, value_for(key, 0)) == 0);
+        model_put(&model, key, value_for(key, 0));
+    }
+
+    Reader readers[NUM_READERS];
+    pthread_t threads[NUM_READERS];
+    for (int i = 0; i < NUM_READERS; i++)
+    {
+        readers[i] = (Reader){&tree, 0, test_random() | 1, 0};
+        CHECK(pthread_create(&threads[i], NULL, reader, &readers[i]) == 0);
+    }
+
+    // Odd keys come and go, splitting and merging the nodes the readers cross
+    for (uint64_t i = 1; i <= NUM_OPS; i++)
+    {
+        uint64_t key = test_random() % KEY_SPACE | 1;
+        if (test_random() % 3 == 0)
+        {
+            CHECK(delete_key(&tree, key) == (model_delete(&model, key) ? 0 : -1));
+        }
+        else
+        {
+            CHECK(upsert_key(&tree, key, value_for(key, i)) == 0);
+            model_put(&model, key, value_for(key, i));
+        }
+    }
+
+    uint64_t lookups = 0;
+    for (int i = 0; i < NUM_READERS; i++)
+    {
+        __atomic_store_n(&readers[i].done, 1, __ATOMIC_RELEASE);
+        pthread_join(threads[i], NULL);
+        lookups += readers[i].lookups;
+    }
+    CHECK(model_check(&tree, &model) == 0);
+    printf("%-10s %llu lookups during %d writes\n", config->name, (unsigned long long)lookups, NUM_OPS);
+
+    close_btree(&tree);
+    model_free(&model);
+    test_remove(path);
+}
+
+int main(void)
+{
+    char path[256];
+    test_path(path, sizeof(path), "optimistic.idx");
+    test_seed(15);
+    for (size_t i = 0; i < sizeof(configs) / sizeof(configs[0]); i++)
+    {
+        run(path, &configs[i]);
+    }
+    printf("test_optimistic: ok\n");
+    return 0;
+}
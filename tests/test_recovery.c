@@ -0,0 +1,165 @@
+// test_recovery.c
+// Crash recovery: a child process writes under the log and is killed with
+// SIGKILL at a random moment. The reopened file must hold every write the
+// child saw succeed, and the write it was in the middle of either fully or
+// not at all.
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "model.h"
+
+#define ROUNDS 10                 // Kills per layout
+#define KEY_SPACE 6000
+#define CHECKPOINT_BYTES 65536    // Small, so some kills land in a checkpoint
+#define MAX_KILL_DELAY_US 60000
+
+typedef struct
+{
+    const char *name;
+    BTreeLayout layout;
+    int compressed;
+    uint64_t block_size;
+} Config;
+
+static const Config configs[] = {
+    {"classic-512", BTREE_LAYOUT_BTREE, 0, 512},
+    {"bplus-4096", BTREE_LAYOUT_BPLUS, 0, 4096},
+    {"compressed-512", BTREE_LAYOUT_BPLUS, 1, 512},
+};
+
+// Operation i of the sequence every round continues: an upsert, or a delete
+// when the value's low bits say so
+static void op_at(uint64_t i, uint64_t *key, uint64_t *value, int *is_delete)
+{
+    uint64_t x = (i + 1) * 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    x ^= x >> 31;
+    *key = x % KEY_SPACE;
+    *value = x;
+    *is_delete = x % 10 < 3;
+}
+
+static void apply(Model *model, uint64_t i)
+{
+    uint64_t key, value;
+    int is_delete;
+    op_at(i, &key, &value, &is_delete);
+    if (is_delete)
+        model_delete(model, key);
+    else
+        model_put(model, key, value);
+}
+
+static void open_logged(BTree *tree, const char *path)
+{
+    memset(tree, 0, sizeof(*tree));
+    tree->durability = BTREE_DURABILITY_WAL;
+    tree->checkpoint_bytes = CHECKPOINT_BYTES;
+    CHECK(open_btree(tree, path) == 0);
+}
+
+// Run operations from `next` on until killed, publishing each one it finishes
+static void child(const char *path, uint64_t next, volatile uint64_t *acked)
+{
+    BTree tree;
+    open_logged(&tree, path);
+    for (uint64_t i = next;; i++)
+    {
+        uint64_t key, value;
+        int is_delete;
+        op_at(i, &key, &value, &is_delete);
+        if (is_delete)
+            delete_key(&tree, key); // -1 for a missing key as well as on error
+        else if (upsert_key(&tree, key, value) != 0)
+            _exit(3);
+        __atomic_store_n(acked, i + 1, __ATOMIC_RELEASE);
+    }
+}
+
+// Whether the reopened file shows operation i
+static int op_applied(BTree *tree, uint64_t i)
+{
+    uint64_t key, value, found;
+    int is_delete;
+    op_at(i, &key, &value, &is_delete);
+    int present = search_key(tree, key, &found) == 0;
+    if (is_delete)
+        return !present;
+    return present && found == value;
+}
+
+static void run(const Config *config)
+{
+    char path[256];
+    test_path(path, sizeof(path), "recovery.idx");
+    test_remove(path);
+
+    BTree tree;
+    memset(&tree, 0, sizeof(tree));
+    BTreeCreateOptions options = {0};
+    options.layout = config->layout;
+    options.compressed = config->compressed;
+    options.block_size = config->block_size;
+    CHECK(create_btree_ex(&tree, path, &options) == 0);
+    close_btree(&tree);
+
+    volatile uint64_t *acked = (volatile uint64_t *)mmap(NULL, sizeof(uint64_t), PROT_READ | PROT_WRITE,
+                                                         MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    CHECK(acked != MAP_FAILED);
+
+    Model model;
+    model_init(&model);
+    uint64_t done = 0, in_flight = 0; // Operations in the model; in-flight ones among them
+    for (int round = 0; round < ROUNDS; round++)
+    {
+        *acked = done;
+        pid_t pid = fork();
+        CHECK(pid >= 0);
+        if (pid == 0)
+            child(path, done, acked);
+
+        struct timespec delay = {0, (long)(test_random() % MAX_KILL_DELAY_US + 1000) * 1000};
+        nanosleep(&delay, NULL);
+        kill(pid, SIGKILL);
+        int status;
+        CHECK(waitpid(pid, &status, 0) == pid);
+        CHECK(WIFSIGNALED(status));
+
+        uint64_t last = __atomic_load_n(acked, __ATOMIC_ACQUIRE);
+        for (; done < last; done++)
+            apply(&model, done);
+
+        // The kill usually lands in the log sync, after the log write, so
+        // the interrupted write is often there to replay
+        open_logged(&tree, path);
+        if (op_applied(&tree, done))
+        {
+            apply(&model, done++);
+            in_flight++;
+        }
+        CHECK(model_check(&tree, &model) == 0);
+        close_btree(&tree);
+    }
+    printf("%-16s %llu operations, %llu of %d interrupted writes recovered\n", config->name,
+           (unsigned long long)done, (unsigned long long)in_flight, ROUNDS);
+
+    munmap((void *)acked, sizeof(uint64_t));
+    model_free(&model);
+    test_remove(path);
+}
+
+int main(void)
+{
+    test_seed(22);
+    for (size_t i = 0; i < sizeof(configs) / sizeof(configs[0]); i++)
+    {
+        run(&configs[i]);
+    }
+    printf("test_recovery: ok\n");
+    return 0;
+}
@@ -0,0 +1,188 @@
+// test_snapshot.c
+// Snapshots taken while another thread writes: every snapshot must show the
+// tree as it stood between two writes, and keep showing it until closed
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <string.h>
+#include "model.h"
+
+#define NUM_OPS 20000  // Writes, each adding pair i and deleting pair i - WINDOW
+#define WINDOW 2000    // Pairs in the tree once the writer is under way
+#define NUM_READERS 2
+
+// Write i stores key_of(i) -> i, so any pair says which write made it. The
+// mix is a bijection, so no two writes share a key.
+static uint64_t key_of(uint64_t i)
+{
+    uint64_t x = i + 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+typedef struct
+{
+    BTree *tree;
+    int done;          // Set by the writer when it finishes
+    int snapshots;     // Snapshots checked by all readers
+    pthread_mutex_t lock;
+} Shared;
+
+static void *writer(void *arg)
+{
+    Shared *shared = (Shared *)arg;
+    for (uint64_t i = 0; i < NUM_OPS; i++)
+    {
+        CHECK(upsert_key(shared->tree, key_of(i), i) == 0);
+        if (i >= WINDOW)
+            CHECK(delete_key(shared->tree, key_of(i - WINDOW)) == 0);
+    }
+    __atomic_store_n(&shared->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+typedef struct
+{
+    uint64_t *values;
+    size_t count;
+} Pairs;
+
+static int collect(void *ctx, uint64_t key, uint64_t value)
+{
+    Pairs *pairs = (Pairs *)ctx;
+    CHECK(key == key_of(value));
+    pairs->values[pairs->count++] = value;
+    return 0;
+}
+
+static int compare_values(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// The snapshot must hold exactly the pairs of writes lo..hi, with hi - lo
+// one more than WINDOW at most (a snapshot between an add and its delete)
+static void check_snapshot(BTree *snapshot, uint64_t *values, uint64_t *probes, int *found)
+{
+    Pairs pairs = {values, 0};
+    CHECK(range_scan(snapshot, 0, UINT64_MAX, collect, &pairs) == 0);
+    CHECK(pairs.count <= WINDOW + 1);
+    if (pairs.count == 0)
+        return;
+    qsort(values, pairs.count, sizeof(uint64_t), compare_values);
+    uint64_t lo = values[0], hi = values[pairs.count - 1];
+    CHECK(hi - lo + 1 == pairs.count);
+    CHECK(lo == 0 || pairs.count >= WINDOW);
+
+    // The same pairs by key, the writes on either side absent, and a second
+    // scan after the writer has moved on
+    for (size_t i = 0; i < pairs.count; i++)
+        probes[i] = key_of(values[i]);
+    probes[pairs.count] = key_of(hi + 1);
+    probes[pairs.count + 1] = key_of(lo > 0 ? lo - 1 : hi + 2);
+    uint64_t *got = values + WINDOW + 1;
+    CHECK(search_keys_batch(snapshot, probes, pairs.count + 2, got, found) == (int)pairs.count);
+    for (size_t i = 0; i < pairs.count; i++)
+        CHECK(found[i] && got[i] == values[i]);
+
+    BTreeCursor cursor;
+    size_t seen = 0;
+    for (int r = btree_seek(snapshot, &cursor, 0); r == 1; r = cursor_next(&cursor))
+    {
+        CHECK(cursor.key == key_of(cursor.value));
+        CHECK(cursor.value >= lo && cursor.value <= hi);
+        seen++;
+    }
+    CHECK(seen == pairs.count);
+}
+
+static void *reader(void *arg)
+{
+    Shared *shared = (Shared *)arg;
+    uint64_t *values = (uint64_t *)malloc(2 * (WINDOW + 3) * sizeof(uint64_t));
+    uint64_t *probes = (uint64_t *)malloc((WINDOW + 3) * sizeof(uint64_t));
+    int *found = (int *)malloc((WINDOW + 3) * sizeof(int));
+    CHECK(values && probes && found);
+
+    int taken = 0;
+    while (!__atomic_load_n(&shared->done, __ATOMIC_ACQUIRE))
+    {
+        BTree snapshot;
+        CHECK(btree_snapshot(shared->tree, &snapshot) == 0);
+        check_snapshot(&snapshot, values, probes, found);
+        close_btree(&snapshot);
+        taken++;
+    }
+
+    pthread_mutex_lock(&shared->lock);
+    shared->snapshots += taken;
+    pthread_mutex_unlock(&shared->lock);
+    free(values);
+    free(probes);
+    free(found);
+    return NULL;
+}
+
+static void run(const char *path, BTreeDurability durability)
+{
+    test_remove(path);
+    BTree tree;
+    memset(&tree, 0, sizeof(tree));
+    tree.durability = durability;
+    CHECK(create_btree(&tree, path) == 0);
+
+    Shared shared = {&tree, 0, 0, PTHREAD_MUTEX_INITIALIZER};
+    pthread_t writer_thread, readers[NUM_READERS];
+    CHECK(pthread_create(&writer_thread, NULL, writer, &shared) == 0);
+    for (int i = 0; i < NUM_READERS; i++)
+        CHECK(pthread_create(&readers[i], NULL, reader, &shared) == 0);
+    pthread_join(writer_thread, NULL);
+    for (int i = 0; i < NUM_READERS; i++)
+        pthread_join(readers[i], NULL);
+    CHECK(shared.snapshots > 0);
+
+    Model model;
+    model_init(&model);
+    for (uint64_t i = NUM_OPS - WINDOW; i < NUM_OPS; i++)
+        model_put(&model, key_of(i), i);
+    CHECK(model_check(&tree, &model) == 0);
+
+    // With the snapshots closed, the writer's next pause frees every block
+    // they kept, so new pairs take no new block until all the old ones are
+    // back in the tree
+    uint64_t blocks = tree.header.next_block_id;
+    int height, nodes, keys;
+    uint64_t i = NUM_OPS;
+    while (tree.header.next_block_id == blocks)
+    {
+        CHECK(insert_key(&tree, key_of(i), i) == 0);
+        model_put(&model, key_of(i), i);
+        i++;
+    }
+    get_tree_stats(&tree, &height, &nodes, &keys);
+    CHECK((uint64_t)nodes >= blocks - 1);
+    CHECK(model_check(&tree, &model) == 0);
+    printf("%s: %d snapshots, %llu blocks reused\n",
+           durability == BTREE_DURABILITY_WAL ? "wal" : "none", shared.snapshots,
+           (unsigned long long)blocks - 1);
+
+    close_btree(&tree);
+    memset(&tree, 0, sizeof(tree));
+    CHECK(open_btree(&tree, path) == 0);
+    CHECK(model_check(&tree, &model) == 0);
+    close_btree(&tree);
+    model_free(&model);
+    test_remove(path);
+}
+
+int main(void)
+{
+    char path[256];
+    test_path(path, sizeof(path), "snapshot.idx");
+    test_seed(24);
+    run(path, BTREE_DURABILITY_NONE);
+    run(path, BTREE_DURABILITY_WAL);
+    printf("test_snapshot: ok\n");
+    return 0;
+}
@@ -0,0 +1,225 @@
+// test_wal.c
+// Logged writes in a pool too small to hold them: the pool floor, and the
+// rollback of a write that runs out of frames part way through.
+// The test includes btree.c to pin frames behind the tree's back.
+#include "btree.c"
+#include "model.h"
+
+#define POOL_FRAMES BTREE_MIN_WAL_CACHE_FRAMES
+#define NEIGHBOUR_KEYS 3000 // Keys in the tree whose frames crowd out the logged one
+#define START_KEYS 2000     // Keys in the logged tree before frames run short
+#define ROUNDS 60           // Rounds of starved writes, each with a different squeeze
+#define OPS_PER_ROUND 50
+#define LOAD_PAIRS 2000     // Pairs per starved load_data_ex()
+
+typedef struct
+{
+    BTree *tree;
+    BufferFrame *frames[POOL_FRAMES];
+    size_t count;
+} Squeeze;
+
+// Pin the neighbour's blocks until only `spare` frames are left for anyone else
+static void squeeze(Squeeze *s, BTree *neighbour, size_t spare)
+{
+    s->tree = neighbour;
+    s->count = 0;
+    for (uint64_t id = 1; s->count < POOL_FRAMES - spare; id++)
+    {
+        CHECK(id < neighbour->header.next_block_id);
+        s->frames[s->count] = pool_fetch(neighbour->pool, neighbour, id, 1);
+        CHECK(s->frames[s->count] != NULL);
+        s->count++;
+    }
+}
+
+static void release(Squeeze *s)
+{
+    for (size_t i = 0; i < s->count; i++)
+        pool_unpin(s->tree->pool, s->frames[i], 0);
+    s->count = 0;
+}
+
+static void open_logged(BTree *tree, const char *path, size_t cache_frames)
+{
+    memset(tree, 0, sizeof(*tree));
+    tree->cache_frames = cache_frames;
+    tree->durability = BTREE_DURABILITY_WAL;
+    CHECK(open_btree(tree, path) == 0);
+}
+
+// A logged handle asking for fewer frames gets the floor, and a shared pool
+// below it is refused
+static void test_pool_floor(const char *path)
+{
+    BTree tree;
+    memset(&tree, 0, sizeof(tree));
+    tree.cache_frames = BTREE_MIN_CACHE_FRAMES;
+    tree.durability = BTREE_DURABILITY_WAL;
+    CHECK(create_btree(&tree, path) == 0);
+    CHECK(tree.pool->num_frames == BTREE_MIN_WAL_CACHE_FRAMES);
+
+    Model model;
+    model_init(&model);
+    for (int i = 0; i < 20000; i++)
+    {
+        uint64_t key = test_random() % 8000, value = test_random();
+        if (test_random() % 3 == 0)
+        {
+            CHECK(delete_key(&tree, key) == (model_delete(&model, key) ? 0 : -1));
+        }
+        else
+        {
+            CHECK(upsert_key(&tree, key, value) == 0);
+            model_put(&model, key, value);
+        }
+    }
+    CHECK(model_check(&tree, &model) == 0);
+    close_btree(&tree);
+
+    open_logged(&tree, path, BTREE_MIN_CACHE_FRAMES);
+    CHECK(model_check(&tree, &model) == 0);
+    close_btree(&tree);
+
+    BufferPool *pool = create_buffer_pool(BTREE_MIN_WAL_CACHE_FRAMES - 1, BLOCK_SIZE);
+    memset(&tree, 0, sizeof(tree));
+    tree.shared_pool = pool;
+    tree.durability = BTREE_DURABILITY_WAL;
+    CHECK(open_btree(&tree, path) != 0);
+    destroy_buffer_pool(pool);
+
+    model_free(&model);
+    test_remove(path);
+}
+
+static int compare_pairs(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Load pairs the tree lacks with frames running short; the pairs kept must
+// be the sorted batch's first report.loaded
+static void starved_load(BTree *tree, Model *model, const char *csv)
+{
+    uint64_t pairs[LOAD_PAIRS][2];
+    FILE *fp = fopen(csv, "w");
+    CHECK(fp != NULL);
+    for (size_t i = 0; i < LOAD_PAIRS; i++)
+    {
+        size_t seen;
+        do
+        {
+            pairs[i][0] = test_random() % 1000000;
+            for (seen = 0; seen < i && pairs[seen][0] != pairs[i][0]; seen++)
+                ;
+        } while (seen < i || model_find(model, pairs[i][0]) >= 0);
+        pairs[i][1] = test_random();
+        fprintf(fp, "%llu,%llu\n", (unsigned long long)pairs[i][0], (unsigned long long)pairs[i][1]);
+    }
+    CHECK(fclose(fp) == 0);
+    qsort(pairs, LOAD_PAIRS, sizeof(pairs[0]), compare_pairs);
+
+    BTreeLoadReport report;
+    int result = load_data_ex(tree, csv, BTREE_INPUT_CSV, &report);
+    CHECK(result == 0 ? report.loaded == LOAD_PAIRS : report.loaded < LOAD_PAIRS);
+    for (size_t i = 0; i < report.loaded; i++)
+        model_put(model, pairs[i][0], pairs[i][1]);
+    printf("starved load kept %llu of %d pairs\n", (unsigned long long)report.loaded, LOAD_PAIRS);
+    unlink(csv);
+}
+
+// Writes that cannot get the frames they need fail and leave the tree as
+// of the last commit; the writes around them carry on as normal
+static void test_rollback(const char *path, const char *neighbour_path, const char *csv)
+{
+    BufferPool *pool = create_buffer_pool(POOL_FRAMES, BLOCK_SIZE);
+    BTree neighbour, tree;
+    memset(&neighbour, 0, sizeof(neighbour));
+    neighbour.shared_pool = pool;
+    CHECK(create_btree(&neighbour, neighbour_path) == 0);
+    for (uint64_t key = 0; key < NEIGHBOUR_KEYS; key++)
+        CHECK(insert_key(&neighbour, key, key) == 0);
+    CHECK(btree_sync(&neighbour) == 0);
+
+    memset(&tree, 0, sizeof(tree));
+    tree.shared_pool = pool;
+    tree.durability = BTREE_DURABILITY_WAL;
+    CHECK(create_btree(&tree, path) == 0);
+    Model model;
+    model_init(&model);
+    for (int i = 0; i < START_KEYS; i++)
+    {
+        uint64_t key = test_random() % 1000000, value = test_random();
+        CHECK(upsert_key(&tree, key, value) == 0);
+        model_put(&model, key, value);
+    }
+
+    Squeeze s;
+    int failures = 0, successes = 0;
+    for (int round = 0; round < ROUNDS; round++)
+    {
+        squeeze(&s, &neighbour, 2 + round % 7);
+        for (int i = 0; i < OPS_PER_ROUND; i++)
+        {
+            uint64_t key, value = test_random();
+            int result;
+            if (test_random() % 3 == 0 && model.count > 0)
+            {
+                key = model.keys[test_random() % model.count];
+                if ((result = delete_key(&tree, key)) == 0)
+                    model_delete(&model, key);
+            }
+            else
+            {
+                key = test_random() % 1000000;
+                if ((result = upsert_key(&tree, key, value)) == 0)
+                    model_put(&model, key, value);
+            }
+            if (result == 0)
+                successes++;
+            else
+                failures++;
+        }
+        release(&s);
+        CHECK(model_check(&tree, &model) == 0);
+    }
+    CHECK(failures > 0 && successes > 0);
+    printf("starved writes: %d failed, %d succeeded\n", failures, successes);
+
+    for (size_t spare = 24; spare >= 8; spare -= 8)
+    {
+        squeeze(&s, &neighbour, spare);
+        starved_load(&tree, &model, csv);
+        release(&s);
+        CHECK(model_check(&tree, &model) == 0);
+    }
+    CHECK(!tree.read_only);
+
+    close_btree(&tree);
+    close_btree(&neighbour);
+    destroy_buffer_pool(pool);
+
+    open_logged(&tree, path, 0);
+    CHECK(model_check(&tree, &model) == 0);
+    close_btree(&tree);
+    model_free(&model);
+    test_remove(path);
+    test_remove(neighbour_path);
+}
+
+int main(void)
+{
+    char path[256], neighbour_path[256], csv[256];
+    test_path(path, sizeof(path), "wal.idx");
+    test_path(neighbour_path, sizeof(neighbour_path), "wal-neighbour.idx");
+    test_path(csv, sizeof(csv), "wal-load.csv");
+    test_remove(path);
+    test_remove(neighbour_path);
+
+    test_seed(22);
+    test_pool_floor(path);
+    test_rollback(path, neighbour_path, csv);
+    printf("test_wal: ok\n");
+    return 0;
+}
@@ -0,0 +1,342 @@
+// wal.c
+#define _POSIX_C_SOURCE 200809L // fdatasync()
+#include "wal.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define WAL_MAGIC "4337WAL1"
+#define WAL_FILE_HEADER 16     // Magic, then the epoch
+#define WAL_RECORD_HEADER 40   // LSN, block id, type, length, checksum
+#define WAL_MAX_RECORD 65536   // Largest page image; anything longer is garbage
+#define WAL_BUFFER 65536       // Initial append buffer
+#define WAL_EXTENT (1 << 20)   // The file grows by this many zeroed bytes at a time
+
+struct Wal
+{
+    int fd;
+    char *path;
+    unsigned char *buffer; // Records appended since the last wal_sync()
+    size_t used, cap;
+    uint64_t epoch;        // Bumped by wal_reset(); part of every checksum
+    uint64_t size;         // Bytes in the log, buffered records included
+    uint64_t synced;       // Bytes known to be in the file
+    uint64_t allocated;    // Length of the file, zero-filled past `synced`
+};
+
+// Log words are little-endian on every host
+static void store_le64(unsigned char *p, uint64_t v)
+{
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    memcpy(p, &v, 8);
+}
+
+static uint64_t load_le64(const unsigned char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, 8);
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+static uint64_t mix(uint64_t h, uint64_t w)
+{
+    h = (h ^ w) * 0x100000001B3ULL;
+    return h ^ (h >> 29);
+}
+
+// Checksum of a record: the epoch, its first four header words, then the payload a word at a time
+static uint64_t record_checksum(uint64_t epoch, const unsigned char *header, const unsigned char *data, size_t len)
+{
+    uint64_t h = mix(0xCBF29CE484222325ULL, epoch);
+    for (int i = 0; i < 4; i++)
+        h = mix(h, load_le64(header + 8 * i));
+
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8)
+        h = mix(h, load_le64(data + i));
+    for (; i < len; i++)
+        h = mix(h, data[i]);
+    return h;
+}
+
+// Make the log's directory entry durable, so a new log survives a crash
+static int sync_parent_dir(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    char *dir = slash ? strndup(path, slash == path ? 1 : (size_t)(slash - path)) : strdup(".");
+    if (!dir)
+        return -1;
+
+    int fd = open(dir, O_RDONLY);
+    free(dir);
+    if (fd < 0)
+        return -1;
+    int result = fsync(fd);
+    close(fd);
+    return result;
+}
+
+static int write_file_header(Wal *wal)
+{
+    unsigned char header[WAL_FILE_HEADER];
+    memcpy(header, WAL_MAGIC, 8);
+    store_le64(header + 8, wal->epoch);
+    if (pwrite(wal->fd, header, WAL_FILE_HEADER, 0) != WAL_FILE_HEADER)
+        return -1;
+    return fdatasync(wal->fd);
+}
+
+static int write_all(int fd, const unsigned char *data, size_t len, off_t offset)
+{
+    while (len > 0)
+    {
+        ssize_t n = pwrite(fd, data, len, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        data += n;
+        len -= (size_t)n;
+        offset += n;
+    }
+    return 0;
+}
+
+/**
+ * Zero-fill the file out to the next extent past `end`. Appending would
+ * make every fdatasync() also commit the file's new length; writing into
+ * blocks that already exist does not, so only one sync per extent pays.
+ */
+static int extend(Wal *wal, uint64_t end)
+{
+    uint64_t target = (end + WAL_EXTENT - 1) / WAL_EXTENT * WAL_EXTENT;
+    unsigned char *zeros = (unsigned char *)calloc(1, WAL_EXTENT);
+    if (!zeros)
+        return -1;
+
+    int result = 0;
+    while (result == 0 && wal->allocated < target)
+    {
+        size_t len = (size_t)(target - wal->allocated);
+        if (len > WAL_EXTENT)
+            len = WAL_EXTENT;
+        result = write_all(wal->fd, zeros, len, (off_t)wal->allocated);
+        if (result == 0)
+            wal->allocated += len;
+    }
+    free(zeros);
+    return result;
+}
+
+Wal *wal_open(const char *path)
+{
+    Wal *wal = (Wal *)calloc(1, sizeof(Wal));
+    if (!wal)
+        return NULL;
+    wal->path = strdup(path);
+    wal->cap = WAL_BUFFER;
+    wal->buffer = (unsigned char *)malloc(wal->cap);
+    wal->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (!wal->path || !wal->buffer || wal->fd < 0)
+    {
+        if (wal->fd >= 0)
+            close(wal->fd);
+        free(wal->path);
+        free(wal->buffer);
+        free(wal);
+        return NULL;
+    }
+
+    wal->epoch = 1;
+    wal->size = wal->synced = wal->allocated = WAL_FILE_HEADER;
+    if (write_file_header(wal) != 0 || sync_parent_dir(path) != 0)
+    {
+        wal_close(wal, 1);
+        return NULL;
+    }
+    return wal;
+}
+
+int wal_append(Wal *wal, uint64_t lsn, int type, uint64_t block_id, const void *data, size_t len)
+{
+    size_t needed = wal->used + WAL_RECORD_HEADER + len;
+    if (needed > wal->cap)
+    {
+        size_t cap = wal->cap;
+        while (cap < needed)
+            cap *= 2;
+        unsigned char *buffer = (unsigned char *)realloc(wal->buffer, cap);
+        if (!buffer)
+            return -1;
+        wal->buffer = buffer;
+        wal->cap = cap;
+    }
+
+    unsigned char *record = wal->buffer + wal->used;
+    store_le64(record, lsn);
+    store_le64(record + 8, block_id);
+    store_le64(record + 16, (uint64_t)type);
+    store_le64(record + 24, len);
+    if (len > 0)
+        memcpy(record + WAL_RECORD_HEADER, data, len);
+    store_le64(record + 32, record_checksum(wal->epoch, record, record + WAL_RECORD_HEADER, len));
+
+    wal->used = needed;
+    wal->size += WAL_RECORD_HEADER + len;
+    return 0;
+}
+
+int wal_sync(Wal *wal)
+{
+    // A failed write keeps the records for a retry at the same offset; until
+    // then the torn record there ends the log
+    if ((wal->size > wal->allocated && extend(wal, wal->size) != 0) ||
+        write_all(wal->fd, wal->buffer, wal->used, (off_t)wal->synced) != 0 ||
+        fdatasync(wal->fd) != 0)
+        return -1;
+    wal->used = 0;
+    wal->synced = wal->size;
+    return 0;
+}
+
+uint64_t wal_size(const Wal *wal)
+{
+    return wal->size;
+}
+
+// The file keeps its length; the old records fail their checksums under the new epoch
+int wal_reset(Wal *wal)
+{
+    wal->used = 0;
+    wal->size = wal->synced = WAL_FILE_HEADER;
+    wal->epoch++;
+    return write_file_header(wal);
+}
+
+void wal_close(Wal *wal, int remove)
+{
+    if (!wal)
+        return;
+    if (wal->fd >= 0)
+        close(wal->fd);
+    if (remove)
+        unlink(wal->path);
+    free(wal->path);
+    free(wal->buffer);
+    free(wal);
+}
+
+// Read the next record; 1 if it is whole and its checksum matches, else 0
+static int read_record(FILE *fp, uint64_t epoch, unsigned char *header, unsigned char **data, size_t *cap)
+{
+    if (fread(header, WAL_RECORD_HEADER, 1, fp) != 1)
+        return 0;
+    uint64_t len = load_le64(header + 24);
+    if (len > WAL_MAX_RECORD)
+        return 0;
+    if (len > *cap)
+    {
+        unsigned char *grown = (unsigned char *)realloc(*data, len);
+        if (!grown)
+            return 0;
+        *data = grown;
+        *cap = len;
+    }
+    if (len > 0 && fread(*data, len, 1, fp) != 1)
+        return 0;
+    return load_le64(header + 32) == record_checksum(epoch, header, *data, len);
+}
+
+// Open a log and read its epoch; NULL if there is no log or it is empty
+static FILE *open_log(const char *path, uint64_t *epoch, int *result)
+{
+    *result = 0;
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+    {
+        if (errno != ENOENT)
+            *result = -1;
+        return NULL;
+    }
+
+    // A log cut short before its header was written holds nothing
+    unsigned char header[WAL_FILE_HEADER];
+    if (fread(header, WAL_FILE_HEADER, 1, fp) != 1 || memcmp(header, WAL_MAGIC, 8) != 0)
+    {
+        if (!feof(fp))
+            *result = -1;
+        fclose(fp);
+        return NULL;
+    }
+    *epoch = load_le64(header + 8);
+    return fp;
+}
+
+// 1 if the log at path holds any records, which a writable open would replay
+int wal_has_records(const char *path)
+{
+    uint64_t epoch;
+    int result;
+    FILE *fp = open_log(path, &epoch, &result);
+    if (!fp)
+        return result != 0;
+
+    unsigned char header[WAL_RECORD_HEADER];
+    unsigned char *data = NULL;
+    size_t cap = 0;
+    int found = read_record(fp, epoch, header, &data, &cap);
+    free(data);
+    fclose(fp);
+    return found;
+}
+
+int wal_replay(const char *path, WalApply apply, void *ctx, uint64_t *last_lsn)
+{
+    *last_lsn = 0;
+    uint64_t epoch;
+    int result;
+    FILE *fp = open_log(path, &epoch, &result);
+    if (!fp)
+        return result;
+
+    unsigned char header[WAL_RECORD_HEADER];
+    unsigned char *data = NULL;
+    size_t cap = 0;
+
+    // First pass: find where the last committed transaction ends
+    long committed_end = WAL_FILE_HEADER;
+    while (read_record(fp, epoch, header, &data, &cap))
+    {
+        if (load_le64(header + 16) == WAL_COMMIT)
+        {
+            committed_end = ftell(fp);
+            *last_lsn = load_le64(header);
+        }
+    }
+
+    // Second pass: apply the page images up to there, in log order
+    result = fseek(fp, WAL_FILE_HEADER, SEEK_SET) == 0 ? 0 : -1;
+    while (result == 0 && ftell(fp) < committed_end)
+    {
+        if (!read_record(fp, epoch, header, &data, &cap))
+        {
+            result = -1; // Changed since the first pass
+            break;
+        }
+        if (load_le64(header + 16) == WAL_PAGE &&
+            apply(ctx, load_le64(header), load_le64(header + 8), data, load_le64(header + 24)) != 0)
+            result = -1;
+    }
+
+    free(data);
+    fclose(fp);
+    return result;
+}
@@ -0,0 +1,49 @@
+// wal.h
+#ifndef WAL_H
+#define WAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Record types:
+ * - WAL_PAGE: the full image of one block after a change
+ * - WAL_COMMIT: the page records since the previous commit form one
+ *   transaction; replay applies them only once this record is on disk
+ */
+#define WAL_PAGE 1
+#define WAL_COMMIT 2
+
+/**
+ * Redo Log
+ * --------
+ * An append-only file of checksummed records. wal_append() only buffers a
+ * record; wal_sync() writes everything buffered with one sequential write
+ * and then waits for it to reach the disk. The file is zero-filled ahead of
+ * the records a megabyte at a time, so a sync never has to commit a new
+ * file length. wal_reset() empties the log once its records are no longer
+ * needed by starting a new epoch: the epoch in the file header goes into
+ * every record's checksum, so records from an earlier epoch no longer
+ * check out. wal_close() can then remove the file.
+ *
+ * wal_replay() reads a log back and hands the page records of every
+ * committed transaction to `apply`, oldest first. Reading stops at the
+ * first record that is torn or fails its checksum, and a transaction whose
+ * commit record never made it is skipped, so a crash in the middle of an
+ * append loses that transaction and nothing else.
+ */
+typedef struct Wal Wal;
+
+typedef int (*WalApply)(void *ctx, uint64_t lsn, uint64_t block_id, const void *data, size_t len);
+
+Wal *wal_open(const char *path);
+int wal_append(Wal *wal, uint64_t lsn, int type, uint64_t block_id, const void *data, size_t len);
+int wal_sync(Wal *wal);
+uint64_t wal_size(const Wal *wal);
+int wal_reset(Wal *wal);
+void wal_close(Wal *wal, int remove);
+
+int wal_has_records(const char *path);
+int wal_replay(const char *path, WalApply apply, void *ctx, uint64_t *last_lsn);
+
+#endif /* WAL_H */